@@ -1,9 +1,18 @@
 #include "types.h"
 #include "btree_base.h"
 #include "utils.h"
+#include "wal.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <vector>
 
 #define CLEANUP_FREE_CELLS 1
 #define MINIMAL_CELL_SIZE 5
+// descents BtreeMultiGet keeps in flight, enough to cover a miss with the work on the others
+#define BTREE_MULTI_GET_GROUP_SIZE 16
 
 #define ENABLE_TRACE_CREATE_CURSOR 1
 #define ENABLE_TRACE_CREATE_BTREE 0
@@ -12,10 +21,17 @@
 #define ENABLE_TRACE_INSERT_CELL 1
 #define ENABLE_TRACE_DELETE_CELL 1
 #define ENABLE_PRINT 1
+// structure changes are counted per thread, see BtreeGetThreadEvents
+#define ENABLE_EVENT_COUNTERS 1
+// cursor operations can be timed, see BtreeRecordLatencies
+#define ENABLE_LATENCY_HISTOGRAMS 1
 
 #if ENABLE_TRACE || ENABLE_PRINT
 #include <cstdio>
 #endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 #if ENABLE_TRACE_CREATE_CURSOR
 #	define TRACE_CREATE_CURSOR(x) TRACE(x)
@@ -53,46 +69,201 @@
 #    define TRACE_DELETE_CELL(x)
 #endif
 
+#if ENABLE_EVENT_COUNTERS
+thread_local BtreeEvents threadEvents = {};
+#    define COUNT_EVENT(field, amount) (threadEvents.field += (amount))
+#else
+#    define COUNT_EVENT(field, amount)
+#endif
+
+#if ENABLE_LATENCY_HISTOGRAMS
+#if !ENABLE_EVENT_COUNTERS
+#error "latency histograms tell operations which split or merged pages by the event counters"
+#endif
+#define BTREE_MAX_LATENCY_THREADS 256
+
+// histograms of a thread, only the owner writes them (so plain load and store do), collectors read them any time
+struct LatencySlot {
+    std::atomic<u64> counts[2][BTREE_LATENCY_OPERATIONS][BTREE_LATENCY_BUCKETS];
+    std::atomic<u64> max[2][BTREE_LATENCY_OPERATIONS];
+    std::atomic<u8> used;
+};
+
+std::atomic<u1> RecordLatencies(0);
+// allocated on the first use of the index, slots of exited threads are taken over by new ones
+std::atomic<LatencySlot*> LatencySlots[BTREE_MAX_LATENCY_THREADS];
+thread_local LatencySlot* latencySlot = nullptr;
+// nested cursor operations are timed as a part of the outermost one
+thread_local u8 latencyDepth = 0;
+
+struct LatencySlotOwner {
+    ~LatencySlotOwner() {
+        if (latencySlot != nullptr)
+            latencySlot->used.store(0, std::memory_order_release);
+    }
+};
+thread_local LatencySlotOwner latencySlotOwner;
+
+static void takeLatencySlot() {
+    for (u32 i = 0; i < BTREE_MAX_LATENCY_THREADS; ++i) {
+        LatencySlot* slot = LatencySlots[i].load(std::memory_order_acquire);
+        if (slot == nullptr) {
+            LatencySlot* created = new LatencySlot();
+            created->used.store(1, std::memory_order_relaxed);
+            if (LatencySlots[i].compare_exchange_strong(slot, created, std::memory_order_acq_rel)) {
+                latencySlot = created;
+                (void)&latencySlotOwner; // registers the destructor
+                return;
+            }
+            delete created;
+        }
+        u8 used = 0;
+        if (slot->used.load(std::memory_order_relaxed) != 0
+            || !slot->used.compare_exchange_strong(used, 1, std::memory_order_acquire))
+            continue;
+        latencySlot = slot;
+        (void)&latencySlotOwner;
+        return;
+    }
+}
+
+static inline u64 latencyNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// times the outermost cursor operation of the thread while recording is on, declared before
+// the PagerOperation so the end of the operation is timed too
+struct OperationLatency {
+    u8 operation;
+    u1 timed;
+    u64 structureChanges;
+    u64 start;
+
+    explicit OperationLatency(u8 operation) : operation(operation) {
+        timed = latencyDepth++ == 0 && RecordLatencies.load(std::memory_order_relaxed);
+        if (!timed)
+            return;
+        structureChanges = threadEvents.splits + threadEvents.merges;
+        start = latencyNow();
+    }
+
+    ~OperationLatency() {
+        --latencyDepth;
+        if (!timed)
+            return;
+        u64 elapsed = latencyNow() - start;
+        if (latencySlot == nullptr)
+            takeLatencySlot();
+        if (latencySlot == nullptr)
+            return;
+        u1 structural = threadEvents.splits + threadEvents.merges != structureChanges;
+        std::atomic<u64>& count = latencySlot->counts[structural][operation][BtreeLatencyBucket(elapsed)];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic<u64>& max = latencySlot->max[structural][operation];
+        if (elapsed > max.load(std::memory_order_relaxed))
+            max.store(elapsed, std::memory_order_relaxed);
+    }
+};
+#else
+struct OperationLatency {
+    explicit OperationLatency(u8 operation) {}
+};
+#endif
+
 #define TRACE_PAGE_DATA(x) TRACE(("page %u, leaf %u, cPointers %u, cells %u\n", x->pageIndex, x->PageType, x->nCellPointersCount, x->nCellsTotalSize));
 
 #if BTREE_LOCK_GRANULARITY_PER_PAGE
 pthread_rwlock_t globalLock;
 #endif
 
-u64 decode(const u8 size, const u8 *pBegin) {
-    u64 result = 0;
-    for(i16 i = (i16)size - 1; i >= 0; --i) {
-        result <<= 8;
-        result |= pBegin[i];
-    }
-    return result;
+// bytes of a packed key delta or value, every entry takes at least a byte of each
+static inline u8 packedWidth(u64 value) {
+    return getValueByteSize(value, 1);
 }
-u8 getValueByteSize(u64 value, u8 zeroWeight) {
-    if (value == 0) {
-        return zeroWeight;
-    } else {
-        for (u8 i = 1; i <= 8; ++i) {
-            if (value < (256 << (8 * (i - 1)))) {
-                return i;
-            }
-        }
+static inline u64 packedAreaSize(u64 count, u8 keyWidth, u8 valueWidth) {
+    return count * (keyWidth + valueWidth);
+}
+static inline u64 packedKey(const Page* page, u16 index) {
+    return page->packedBase + decode(page->packedKeyWidth, page->packedArea + index * page->packedKeyWidth);
+}
+static inline u8* packedValuePointer(Page* page, u16 index) {
+    return page->packedArea + PAGER_PACKED_PAGE_AREA_SIZE - (index + 1) * page->packedValueWidth;
+}
+static inline u64 packedValue(const Page* page, u16 index) {
+    return decode(page->packedValueWidth, page->packedArea + PAGER_PACKED_PAGE_AREA_SIZE - (index + 1) * page->packedValueWidth);
+}
+static inline void writePackedEntry(Page* page, u16 index, u64 key, u64 value) {
+    u64 delta = key - page->packedBase;
+    memcpy(page->packedArea + index * page->packedKeyWidth, &delta, page->packedKeyWidth);
+    memcpy(packedValuePointer(page, index), &value, page->packedValueWidth);
+}
+
+// base and widths a packed page needs for its entries and the given one (either added or replacing one of them)
+struct PackedLayout {
+    u64 base;
+    u8 keyWidth;
+    u8 valueWidth;
+};
+static PackedLayout packedLayoutWith(const Page* page, u64 key, u64 value) {
+    u16 count = page->nCellPointersCount;
+    if (count == 0)
+        return { key, 1, packedWidth(value) };
+    PackedLayout layout = { page->packedBase, page->packedKeyWidth, page->packedValueWidth };
+    u64 maxKey = packedKey(page, count - 1);
+    if (key < layout.base)
+        layout.base = key;
+    if (key > maxKey)
+        maxKey = key;
+    u8 keyWidth = packedWidth(maxKey - layout.base);
+    // with the same base current deltas stay as wide as they are, a lower base may need any width
+    if (keyWidth > layout.keyWidth || layout.base != page->packedBase)
+        layout.keyWidth = keyWidth;
+    if (packedWidth(value) > layout.valueWidth)
+        layout.valueWidth = packedWidth(value);
+    return layout;
+}
+
+// rewrites entries of the packed page with the given layout, it must fit all of them
+static void repackPage(Page* page, PackedLayout layout) {
+    u16 count = page->nCellPointersCount;
+    u64 keys[count + 1];
+    u64 values[count + 1];
+    for (u16 i = 0; i < count; ++i) {
+        keys[i] = packedKey(page, i);
+        values[i] = packedValue(page, i);
     }
-    return 8;
+    page->packedBase = layout.base;
+    page->packedKeyWidth = layout.keyWidth;
+    page->packedValueWidth = layout.valueWidth;
+    for (u16 i = 0; i < count; ++i)
+        writePackedEntry(page, i, keys[i], values[i]);
 }
-u8 encode(const u64 value, u8 *pBegin) {
-    u8 valueByteSize = getValueByteSize(value, 0);
-    u8 *pContent = pBegin;
-    u64 curValue = value;
 
-    while (curValue > 0) {
-        *pContent = curValue & 0xFF;
-        ++pContent;
-        curValue >>= 8;
+// replaces content of the packed page with sorted entries, packed as narrow as they allow
+static void fillPackedPage(Page* page, const u64* keys, const u64* values, u16 count) {
+    page->nCellPointersCount = 0;
+    if (count == 0)
+        return;
+    PackedLayout layout = { keys[0], packedWidth(keys[count - 1] - keys[0]), 1 };
+    for (u16 i = 0; i < count; ++i) {
+        if (packedWidth(values[i]) > layout.valueWidth)
+            layout.valueWidth = packedWidth(values[i]);
     }
-    return valueByteSize;
+    page->packedBase = layout.base;
+    page->packedKeyWidth = layout.keyWidth;
+    page->packedValueWidth = layout.valueWidth;
+    for (u16 i = 0; i < count; ++i)
+        writePackedEntry(page, i, keys[i], values[i]);
+    page->nCellPointersCount = count;
 }
+
 u64 calculatePageRelevantSize(const Page* page, u1 includeHeader) {
-    u64 result = page->nCellPointersCount * sizeof(u16) + (page->nCellsTotalSize - page->nFreeCellsTotalSize) * sizeof(u8);
+    u64 result = page->PageFormat == PAGER_PAGE_FORMAT_FIXED
+        ? page->nCellPointersCount * sizeof(u64) * 2
+        : page->PageFormat == PAGER_PAGE_FORMAT_PACKED
+        ? sizeof(u64) + packedAreaSize(page->nCellPointersCount, page->packedKeyWidth, page->packedValueWidth)
+        : page->nCellPointersCount * sizeof(u16) + (page->nCellsTotalSize - page->nFreeCellsTotalSize) * sizeof(u8);
     if (includeHeader)
         result += PAGER_PAGE_HEADER_SIZE;
     return result;
@@ -126,9 +297,47 @@ u8 writePayload(u8* pCellStart, const u64 key, u64 value, u8 forcedCellSize) {
 
     return cellSize;
 }
+void readEntry(const Page* page, u16 index, u64 *key, u64 *value) {
+    if (page->PageFormat == PAGER_PAGE_FORMAT_FIXED) {
+        *key = page->fixedKeys[index];
+        *value = page->fixedValues[index];
+        return;
+    }
+    if (page->PageFormat == PAGER_PAGE_FORMAT_PACKED) {
+        *key = packedKey(page, index);
+        *value = packedValue(page, index);
+        return;
+    }
+    readPayload(page->cells + page->cellPointers[index], key, value);
+}
+// bytes taken by the entry in the page, including its cell pointer
+u64 calculateEntrySize(const Page* page, u16 index) {
+    if (page->PageFormat == PAGER_PAGE_FORMAT_FIXED)
+        return sizeof(u64) * 2;
+    if (page->PageFormat == PAGER_PAGE_FORMAT_PACKED)
+        return page->packedKeyWidth + page->packedValueWidth;
+    u8 cellSize = page->cells[page->cellPointers[index]];
+    if (cellSize < MINIMAL_CELL_SIZE)
+        cellSize = MINIMAL_CELL_SIZE;
+    return cellSize + sizeof(u16);
+}
+u1 pageHasRoomForEntry(const Page* page, u64 key, u64 value) {
+    if (page->PageFormat == PAGER_PAGE_FORMAT_FIXED)
+        return page->nCellPointersCount < PAGER_FIXED_PAGE_CAPACITY;
+    if (page->PageFormat == PAGER_PAGE_FORMAT_PACKED) {
+        PackedLayout layout = packedLayoutWith(page, key, value);
+        return sizeof(u64) + packedAreaSize(page->nCellPointersCount + 1, layout.keyWidth, layout.valueWidth)
+            <= PAGER_PAGE_CONTENT_SIZE;
+    }
+    u8 expectedCellSize = 3 + getValueByteSize(key, 0) + getValueByteSize(value, 0);
+    if (expectedCellSize < MINIMAL_CELL_SIZE)
+        expectedCellSize = MINIMAL_CELL_SIZE;
+    return expectedCellSize + sizeof(u16) + calculatePageRelevantSize(page, 1) <= PAGER_PAGE_BYTE_SIZE;
+}
 void cleanCell(Page* page, u16 cellPointerIndex, u1 shiftPointers) {
     u16 cellSize = *(page->cells + page->cellPointers[cellPointerIndex]);
-    u1 isLastCell = (page->cellPointers[cellPointerIndex] + cellSize == page->nCellsTotalSize);
+    // the last added cell is the first one of the cells area
+    u1 isLastCell = (page->cellPointers[cellPointerIndex] == PAGER_PAGE_CONTENT_SIZE - page->nCellsTotalSize);
 
     if (!isLastCell) {
         // mark cell as free, adding it to linked list of free cells
@@ -145,7 +354,7 @@ void cleanCell(Page* page, u16 cellPointerIndex, u1 shiftPointers) {
         page->firstFreeCellIndex = cellIndex + 1;
         page->nFreeCellsTotalSize += cellTotalSize;
     } else {
-        page->nCellsTotalSize -= *(page->cells + page->cellPointers[page->nCellPointersCount - 1]);
+        page->nCellsTotalSize -= cellSize;
     }
     if(shiftPointers) {
         array_shift16(page->cellPointers, cellPointerIndex + 1, page->nCellPointersCount, -1);
@@ -153,8 +362,108 @@ void cleanCell(Page* page, u16 cellPointerIndex, u1 shiftPointers) {
     }
 }
 
-void BtreeCreateCursor(Btree* tree, Cursor** cursor, u1 write, u64 dbgI) {
-    Cursor* cur = new Cursor;
+void eraseEntry(Page* page, u16 index) {
+    if (page->PageFormat == PAGER_PAGE_FORMAT_FIXED) {
+        array_shift64(page->fixedKeys, index + 1, page->nCellPointersCount, -1);
+        array_shift64(page->fixedValues, index + 1, page->nCellPointersCount, -1);
+        --page->nCellPointersCount;
+        return;
+    }
+    if (page->PageFormat == PAGER_PAGE_FORMAT_PACKED) {
+        // deltas after the entry move to the front, values after it (stored backwards) move to the back
+        u16 after = page->nCellPointersCount - index - 1;
+        u8 keyWidth = page->packedKeyWidth;
+        u8 valueWidth = page->packedValueWidth;
+        memmove(page->packedArea + index * keyWidth, page->packedArea + (index + 1) * keyWidth, after * keyWidth);
+        u8* lastValue = packedValuePointer(page, page->nCellPointersCount - 1);
+        memmove(lastValue + valueWidth, lastValue, after * valueWidth);
+        --page->nCellPointersCount;
+        return;
+    }
+    cleanCell(page, index, 1);
+}
+
+// keeps pages touched by a public tree call pinned in the buffer pool until the call returns
+struct PagerOperation {
+    PagerOperation() { pagerBeginOperation(); }
+    ~PagerOperation() { pagerEndOperation(); }
+};
+
+// held by cursors of a buffered tree for the time of a call (exclusively by writers), no-op for other trees;
+// exclusive lock and single thread modes need none, as cursors of a tree never run concurrently with a writer there
+struct BufferedTreeLock {
+#if BTREE_LOCK_GRANULARITY_PER_PAGE || BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    Btree* tree;
+    u1 write;
+    BufferedTreeLock(Btree* tree, u1 write) : tree(tree->buffered ? tree : nullptr), write(write) {
+        if (this->tree == nullptr)
+            return;
+        if (write)
+            pthread_rwlock_wrlock(&tree->bufferLock);
+        else
+            pthread_rwlock_rdlock(&tree->bufferLock);
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+        // writers of a buffered tree allocate and free pages as structure modifications do
+        if (write)
+            pthread_mutex_lock(&tree->structureModificationLock);
+#endif
+    }
+    ~BufferedTreeLock() {
+        if (tree == nullptr)
+            return;
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+        if (write)
+            pthread_mutex_unlock(&tree->structureModificationLock);
+#endif
+        pthread_rwlock_unlock(&tree->bufferLock);
+    }
+#else
+    BufferedTreeLock(Btree*, u1) {}
+#endif
+};
+
+// pages read by a snapshot cursor come from its snapshot for the time of the call
+struct SnapshotRead {
+#if BTREE_LOCK_GRANULARITY_EXCLUSIVE
+    u1 active;
+    SnapshotRead(const Cursor* cursor) : active(cursor->snapshot != 0) {
+        if (active)
+            pagerBeginSnapshotRead(cursor->snapshot);
+    }
+    ~SnapshotRead() {
+        if (active)
+            pagerEndSnapshotRead();
+    }
+#else
+    SnapshotRead(const Cursor*) {}
+#endif
+};
+
+// root of the cursor's snapshot, the root page itself may have changed since it was opened
+static void resolveSnapshotRoot(Cursor* cursor) {
+#if BTREE_LOCK_GRANULARITY_EXCLUSIVE
+    if (cursor->snapshot != 0)
+        cursor->pRoot = pagerGetReadPage(cursor->tree->pRoot->pageIndex);
+#else
+    (void)cursor;
+#endif
+}
+
+// cursors released by BtreeDestroyCursor, linked through nextCursor
+struct CursorCache {
+    Cursor* first = nullptr;
+    u8 count = 0;
+    ~CursorCache() {
+        while (first != nullptr) {
+            Cursor* next = first->nextCursor;
+            delete first;
+            first = next;
+        }
+    }
+};
+thread_local CursorCache cursorCache;
+
+void BtreeInitCursor(Btree* tree, Cursor* cursor, u1 write, u64 dbgI) {
 #if BTREE_LOCK_GRANULARITY_EXCLUSIVE
     if(write) {
         TRACE_CREATE_CURSOR(("wrlock attt %llu\n", dbgI));
@@ -167,20 +476,230 @@ void BtreeCreateCursor(Btree* tree, Cursor** cursor, u1 write, u64 dbgI) {
     }
 #endif
 
-    cur->pRoot = tree->pRoot;
-    cur->write = write;
+    cursor->tree = tree;
+    cursor->pRoot = tree->pRoot;
+    cursor->write = write;
+    cursor->outdatedAncestors = 0;
+    cursor->positioned = 0;
+    cursor->key = 0;
+    cursor->messageKind = 0;
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    cursor->keyFound = 0;
+#endif
+#if BTREE_LOCK_GRANULARITY_EXCLUSIVE
+    cursor->snapshot = 0;
+    if (write) {
+        pagerBeginWrites();
+        // the root is reached through pRoot, getting it keeps its content for open snapshots
+        PagerOperation operation;
+        pagerGetReadPage(tree->pRoot->pageIndex);
+    }
+#endif
+#if BTREE_TRACK_OPEN_CURSORS
+    cursor->requiresSeek = 0;
+    cursor->nextCursor = tree->firstCursor;
+    tree->firstCursor = cursor;
+#else
+    cursor->nextCursor = nullptr;
+#endif
+}
+
+void BtreeReleaseCursor(Cursor* cursor, u64 dbgI) {
+#if BTREE_LOCK_GRANULARITY_EXCLUSIVE
+    if (cursor->snapshot != 0) {
+        pagerCloseSnapshot(cursor->snapshot);
+    } else {
+        if (cursor->write)
+            pagerEndWrites();
+        TRACE_CREATE_CURSOR(("unlock %llu\n", dbgI));
+        pthread_rwlock_unlock(&cursor->tree->lock);
+    }
+#endif
+#if BTREE_TRACK_OPEN_CURSORS
+    Cursor** link = &cursor->tree->firstCursor;
+    while (*link != cursor)
+        link = &(*link)->nextCursor;
+    *link = cursor->nextCursor;
+#endif
+    cursor->nextCursor = nullptr;
+}
+
+void BtreeRebindCursor(Btree* tree, Cursor* cursor, u1 write, u64 dbgI) {
+    BtreeReleaseCursor(cursor, dbgI);
+    BtreeInitCursor(tree, cursor, write, dbgI);
+}
+
+void BtreeResetCursor(Cursor* cursor) {
+    cursor->outdatedAncestors = 0;
+    cursor->positioned = 0;
+    cursor->messageKind = 0;
+}
+
+void BtreeInitSnapshotCursor(Btree* tree, Cursor* cursor) {
+    BtreeInitCursor(tree, cursor, 0);
+#if BTREE_LOCK_GRANULARITY_EXCLUSIVE
+    // no writer runs while the read lock is held, so the snapshot sees the tree between two write cursors
+    cursor->snapshot = pagerOpenSnapshot();
+    // the page file has no snapshots, the cursor keeps the read lock
+    if (cursor->snapshot != 0)
+        pthread_rwlock_unlock(&tree->lock);
+#endif
+}
+
+static Cursor* takeCachedCursor() {
+    Cursor* cur = cursorCache.first;
+    if (cur != nullptr) {
+        cursorCache.first = cur->nextCursor;
+        --cursorCache.count;
+    } else {
+        cur = new Cursor;
+    }
+    return cur;
+}
+
+void BtreeCreateCursor(Btree* tree, Cursor** cursor, u1 write, u64 dbgI) {
+    Cursor* cur = takeCachedCursor();
+    BtreeInitCursor(tree, cur, write, dbgI);
+    *cursor = cur;
+}
+
+void BtreeCreateSnapshotCursor(Btree* tree, Cursor** cursor) {
+    Cursor* cur = takeCachedCursor();
+    BtreeInitSnapshotCursor(tree, cur);
     *cursor = cur;
 }
 
 void BtreeDestroyCursor(Btree* tree, Cursor* cursor, u64 dbgI) {
-#if BTREE_LOCK_GRANULARITY_EXCLUSIVE
-    TRACE_CREATE_CURSOR(("unlock %llu\n", dbgI));
-    pthread_rwlock_unlock(&tree->lock);
+    BtreeReleaseCursor(cursor, dbgI);
+    if (cursorCache.count == BTREE_CURSOR_CACHE_SIZE) {
+        delete cursor;
+        return;
+    }
+    cursor->nextCursor = cursorCache.first;
+    cursorCache.first = cursor;
+    ++cursorCache.count;
+}
+
+#if BTREE_TRACK_OPEN_CURSORS
+// remembers the entry every other positioned cursor of the tree stands on before the writer changes pages,
+// with leafOnly only cursors in the given leaf are affected
+static void saveOtherCursors(const Cursor* writer, u1 leafOnly, PageIndex leafIndex) {
+    for (Cursor* other = writer->tree->firstCursor; other != nullptr; other = other->nextCursor) {
+        if (other == writer || !other->positioned)
+            continue;
+        if (leafOnly && other->pagePath[other->depth] != leafIndex)
+            continue;
+        u64 key;
+        u64 _;
+        // cursor after the last entry of a leaf returns to the key it was moved to
+        if (BtreeCursorReadData(other, &key, &_) == 0)
+            other->key = key;
+        other->requiresSeek = 1;
+    }
+}
+
+// moves cursors saved by saveOtherCursors to their entries (or the next ones, if they were removed)
+static void restoreOtherCursors(const Cursor* writer) {
+    for (Cursor* other = writer->tree->firstCursor; other != nullptr; other = other->nextCursor) {
+        if (other->requiresSeek) {
+            other->requiresSeek = 0;
+            BtreeCursorMoveTo(other, other->key);
+        }
+    }
+}
+#endif
+
+// index of the first key which is not less than the given one, count if there is no such key
+u16 searchFixedKeys(const u64* keys, const u16 count, const u64 key) {
+    if (count == 0)
+        return 0;
+    // the answer always stays within [base, base + n], the loop compiles into conditional moves
+    const u64* base = keys;
+    u16 n = count;
+#if defined(__AVX2__)
+    while (n > 8) {
+#else
+    while (n > 1) {
+#endif
+        u16 half = n / 2;
+        base = base[half] < key ? base + half : base;
+        n -= half;
+    }
+#if defined(__AVX2__)
+    // count keys less than the given one in the last (up to 8) keys, flipping the sign bit for unsigned compare
+    const __m256i sign = _mm256_set1_epi64x((long long)0x8000000000000000ULL);
+    const __m256i needle = _mm256_xor_si256(_mm256_set1_epi64x((long long)key), sign);
+    const __m256i lanes = _mm256_setr_epi64x(0, 1, 2, 3);
+    const __m256i limit = _mm256_set1_epi64x(n);
+    const __m256i lowMask = _mm256_cmpgt_epi64(limit, lanes);
+    const __m256i highMask = _mm256_cmpgt_epi64(limit, _mm256_add_epi64(lanes, _mm256_set1_epi64x(4)));
+    __m256i low = _mm256_xor_si256(_mm256_maskload_epi64((const long long*)base, lowMask), sign);
+    __m256i high = _mm256_xor_si256(_mm256_maskload_epi64((const long long*)base + 4, highMask), sign);
+    u32 lowLess = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_and_si256(_mm256_cmpgt_epi64(needle, low), lowMask)));
+    u32 highLess = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_and_si256(_mm256_cmpgt_epi64(needle, high), highMask)));
+    return (u16)(base - keys) + __builtin_popcount(lowLess) + __builtin_popcount(highLess);
+#else
+    return (u16)(base - keys) + (*base < key);
 #endif
-    delete cursor;
+}
+
+// searchFixedKeys over packed deltas, the width is a constant so every probe is a load, a mask and a compare
+template <u8 keyWidth>
+static u16 searchPackedDeltas(const u8* deltas, const u16 count, const u64 delta) {
+    u16 base = 0;
+    u16 n = count;
+    while (n > 1) {
+        u16 half = n / 2;
+        base = decode(keyWidth, deltas + (base + half) * keyWidth) < delta ? base + half : base;
+        n -= half;
+    }
+    return base + (decode(keyWidth, deltas + base * keyWidth) < delta);
+}
+
+// index of the first key of the packed page which is not less than the given one, count if there is no such key
+u16 searchPackedKeys(const Page* page, const u64 key) {
+    u16 count = page->nCellPointersCount;
+    if (count == 0 || key <= page->packedBase)
+        return 0;
+    u64 delta = key - page->packedBase;
+    u8 width = page->packedKeyWidth;
+    // delta doesn't fit the width, so it's greater than all deltas of the page
+    if (width < 8 && (delta >> (8 * width)) != 0)
+        return count;
+    switch (width) {
+        case 1: return searchPackedDeltas<1>(page->packedArea, count, delta);
+        case 2: return searchPackedDeltas<2>(page->packedArea, count, delta);
+        case 3: return searchPackedDeltas<3>(page->packedArea, count, delta);
+        case 4: return searchPackedDeltas<4>(page->packedArea, count, delta);
+        case 5: return searchPackedDeltas<5>(page->packedArea, count, delta);
+        case 6: return searchPackedDeltas<6>(page->packedArea, count, delta);
+        case 7: return searchPackedDeltas<7>(page->packedArea, count, delta);
+        case 8: return searchPackedDeltas<8>(page->packedArea, count, delta);
+    }
+    // only an optimistic reader of a page being changed may get here, its result is dropped anyway
+    return 0;
 }
 
 u1 binarySearch(Page* page, const u64 key, u64 *resultValue, u16 *resultIndex) {
+    if (page->PageFormat == PAGER_PAGE_FORMAT_PACKED) {
+        u16 count = page->nCellPointersCount;
+        u16 index = searchPackedKeys(page, key);
+        *resultIndex = index;
+        if (count == 0)
+            return 0;
+        *resultValue = packedValue(page, index < count ? index : count - 1);
+        return index < count && packedKey(page, index) == key;
+    }
+    if (page->PageFormat == PAGER_PAGE_FORMAT_FIXED) {
+        u16 count = page->nCellPointersCount;
+        u16 index = searchFixedKeys(page->fixedKeys, count, key);
+        *resultIndex = index;
+        if (count == 0)
+            return 0;
+        // as for cells, a key greater than all others gets the value of the last entry
+        *resultValue = page->fixedValues[index < count ? index : count - 1];
+        return index < count && page->fixedKeys[index] == key;
+    }
     u64 left = 0;
     u64 right = page->nCellPointersCount;
     u64 currentKey;
@@ -188,7 +707,7 @@ u1 binarySearch(Page* page, const u64 key, u64 *resultValue, u16 *resultIndex) {
     TRACE_PAGE_DATA(page);
     while(left < right) {
         u64 middle = (left + right) / 2;
-        readPayload(page->cells + page->cellPointers[middle], &currentKey, &value);
+        readEntry(page, middle, &currentKey, &value);
         TRACE(("binSearch: curkey = %llu value = %llu\n", currentKey, value));
         if(currentKey == key) {
             TRACE(("binSearch: hit\n"));
@@ -204,16 +723,122 @@ u1 binarySearch(Page* page, const u64 key, u64 *resultValue, u16 *resultIndex) {
         }
     }
     if(left < page->nCellPointersCount)
-        readPayload(page->cells + page->cellPointers[left], &currentKey, &value);
+        readEntry(page, left, &currentKey, &value);
     TRACE(("binSearch: left = %llu right = %llu\n", left, right));
     *resultValue = value;
     *resultIndex = left;
     return 0;
 }
-u8 BtreeCursorMoveTo(Cursor* cursor, const u64 key) {
-    TRACE(("move invoked\n"));
-    cursor->depth = 0;
-    Page* page = cursor->pRoot;
+
+// pending messages of an inner page of a buffered tree
+static u16 messageCount(const Page* node) {
+    if (node->prevLeafIndex == 0)
+        return 0;
+    Page* messages = pagerGetReadPage(node->prevLeafIndex - 1);
+    u16 count = messages->nCellPointersCount;
+    pagerReleasePageLock(messages);
+    return count;
+}
+
+// merges sorted messages into the message page of the node (creating it if needed),
+// new messages go after the queued ones with the same key, as they are newer
+static void addMessages(Page* node, const u64* keys, const u64* values, const u8* kinds, u16 count) {
+    if (node->prevLeafIndex == 0) {
+        Page* created = pagerCreateNewPage(PAGER_PAGE_TYPE_MESSAGES, PAGER_PAGE_FORMAT_FIXED);
+        node->prevLeafIndex = created->pageIndex + 1;
+        pagerReleasePageLock(created);
+    }
+    Page* messages = pagerGetWritePage(node->prevLeafIndex - 1);
+    i32 queued = messages->nCellPointersCount - 1;
+    i32 added = count - 1;
+    for (i32 target = queued + count; added >= 0; --target) {
+        if (queued >= 0 && messages->messageKeys[queued] > keys[added]) {
+            messages->messageKeys[target] = messages->messageKeys[queued];
+            messages->messageValues[target] = messages->messageValues[queued];
+            messages->messageKinds[target] = messages->messageKinds[queued];
+            --queued;
+        } else {
+            messages->messageKeys[target] = keys[added];
+            messages->messageValues[target] = values[added];
+            messages->messageKinds[target] = kinds[added];
+            --added;
+        }
+    }
+    messages->nCellPointersCount += count;
+    pagerReleasePageLock(messages);
+}
+
+static void eraseMessages(Page* messages, u16 from, u16 count) {
+    u16 after = messages->nCellPointersCount - from - count;
+    memmove(messages->messageKeys + from, messages->messageKeys + from + count, after * sizeof(u64));
+    memmove(messages->messageValues + from, messages->messageValues + from + count, after * sizeof(u64));
+    memmove(messages->messageKinds + from, messages->messageKinds + from + count, after);
+    messages->nCellPointersCount -= count;
+}
+
+// newest message for the key in the message page of the node, 0 if there is none
+static u8 findMessage(const Page* node, u64 key, u64* value) {
+    if (node->prevLeafIndex == 0)
+        return 0;
+    Page* messages = pagerGetReadPage(node->prevLeafIndex - 1);
+    u16 count = messages->nCellPointersCount;
+    u8 kind = 0;
+    for (u16 i = searchFixedKeys(messages->messageKeys, count, key); i < count && messages->messageKeys[i] == key; ++i) {
+        kind = messages->messageKinds[i];
+        *value = messages->messageValues[i];
+    }
+    pagerReleasePageLock(messages);
+    return kind;
+}
+
+// inner node was split, messages above the max key of the left half go to the right one
+static void splitMessages(Page* left, Page* right, u64 leftMaxKey) {
+    if (left->prevLeafIndex == 0)
+        return;
+    Page* messages = pagerGetWritePage(left->prevLeafIndex - 1);
+    u16 count = messages->nCellPointersCount;
+    u16 from = searchFixedKeys(messages->messageKeys, count, leftMaxKey);
+    while (from < count && messages->messageKeys[from] == leftMaxKey)
+        ++from;
+    if (from < count)
+        addMessages(right, messages->messageKeys + from, messages->messageValues + from, messages->messageKinds + from,
+                    count - from);
+    messages->nCellPointersCount = from;
+    pagerReleasePageLock(messages);
+}
+
+// right inner node is merged into the left one, its messages (all of greater keys) follow the left ones
+static void mergeMessages(Page* left, Page* right) {
+    if (right->prevLeafIndex == 0)
+        return;
+    if (left->prevLeafIndex == 0) {
+        left->prevLeafIndex = right->prevLeafIndex;
+    } else {
+        Page* messages = pagerGetWritePage(right->prevLeafIndex - 1);
+        addMessages(left, messages->messageKeys, messages->messageValues, messages->messageKinds,
+                    messages->nCellPointersCount);
+        pagerReleasePageLock(messages);
+        pagerFreePage(right->prevLeafIndex - 1);
+    }
+    right->prevLeafIndex = 0;
+}
+
+// descends to the leaf for the key starting at pagePath[fromDepth], path above fromDepth must lead there;
+// returns 1 and the value if the key is in the leaf
+static u1 descendCursor(Cursor* cursor, u8 fromDepth, const u64 key, u64 *value) {
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+restart:
+#endif
+    cursor->depth = fromDepth;
+    Page* page = fromDepth == 0 ? cursor->pRoot : pagerGetReadPage(cursor->pagePath[fromDepth]);
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    u64 version = pagerReadPageVersion(page);
+    // page changed since the path was recorded, the path above may not lead to it anymore
+    if (fromDepth > 0 && version != cursor->versions[fromDepth]) {
+        fromDepth = 0;
+        goto restart;
+    }
+#endif
 
     TRACE(("entering %u\n", cursor->pRoot->pageIndex));
     while (page->PageType != PAGER_PAGE_TYPE_LEAF) {
@@ -235,8 +860,25 @@ u8 BtreeCursorMoveTo(Cursor* cursor, const u64 key) {
         //if(moved) {
             //cursor->pagePath[cursor->depth] = pageIndex;//page->cells;
             cursor->indices[cursor->depth++] = pointerIndex;
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+            // page index must be validated before following it, child version - before leaving the parent
+            if (!pagerValidatePageVersion(page, version)) {
+                fromDepth = 0;
+                goto restart;
+            }
+            Page* child = pagerGetReadPage(pageIndex);
+            u64 childVersion = pagerReadPageVersion(child);
+            if (!pagerValidatePageVersion(page, version)) {
+                fromDepth = 0;
+                goto restart;
+            }
+            cursor->versions[cursor->depth - 1] = version;
+            page = child;
+            version = childVersion;
+#else
 			pagerReleasePageLock(page);
             page = pagerGetReadPage(pageIndex);
+#endif
 
         //} else {
 //            cursor->pagePath[cursor->depth] = pageIndex;
@@ -261,8 +903,14 @@ u8 BtreeCursorMoveTo(Cursor* cursor, const u64 key) {
     TRACE(("leaving %u\n", cursor->depth));
     cursor->pagePath[cursor->depth] = page->pageIndex;
 
-    u64 _;
-    binarySearch(page, key, &_, cursor->indices + cursor->depth);
+    u1 found = binarySearch(page, key, value, cursor->indices + cursor->depth);
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    if (!pagerValidatePageVersion(page, version)) {
+        fromDepth = 0;
+        goto restart;
+    }
+    cursor->versions[cursor->depth] = version;
+#endif
 	pagerReleasePageLock(page);
 //    u1 moved = 0;
 //    for (u16 i = 0; i < page->nCellPointersCount; ++i) {
@@ -277,14 +925,60 @@ u8 BtreeCursorMoveTo(Cursor* cursor, const u64 key) {
 //    if(!moved) {
 //    }
 
+    return found;
+}
+
+// newest message for the key in message pages on the cursor path, the ones closer to the root are newer
+static u8 findPathMessage(const Cursor* cursor, u64 key, u64* value) {
+    for (u8 depth = 0; depth < cursor->depth; ++depth) {
+        Page* node = pagerGetReadPage(cursor->pagePath[depth]);
+        u8 kind = findMessage(node, key, value);
+        pagerReleasePageLock(node);
+        if (kind != 0)
+            return kind;
+    }
+    return 0;
+}
+
+u8 BtreeCursorMoveTo(Cursor* cursor, const u64 key) {
+    OperationLatency latency(BTREE_LATENCY_MOVE_TO);
+    PagerOperation operation;
+    BufferedTreeLock lock(cursor->tree, 0);
+    SnapshotRead snapshotRead(cursor);
+    resolveSnapshotRoot(cursor);
+    TRACE(("move invoked\n"));
+    cursor->outdatedAncestors = 0;
+    cursor->positioned = 1;
+    cursor->key = key;
+    u64 _;
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    cursor->keyFound = descendCursor(cursor, 0, key, &_);
+#else
+    descendCursor(cursor, 0, key, &_);
+#endif
+    cursor->messageKind = cursor->tree->buffered ? findPathMessage(cursor, key, &cursor->messageValue) : 0;
     return 1;
 }
 
 void BtreeCursorFirstLeaf(Cursor* cursor) {
+    PagerOperation operation;
+    cursor->outdatedAncestors = 0;
+    cursor->positioned = 1;
+    cursor->key = 0;
+    cursor->messageKind = 0;
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    // smallest key lives in the first cell of the first leaf
+    BtreeCursorMoveTo(cursor, 0);
+    cursor->messageKind = 0;
+    return;
+#endif
+    BufferedTreeLock lock(cursor->tree, 0);
+    SnapshotRead snapshotRead(cursor);
+    resolveSnapshotRoot(cursor);
     cursor->depth = 0;
     Page* page = cursor->pRoot;
 #if BTREE_LOCK_GRANULARITY_PER_PAGE
-	pthread_rwlock_rdlock(&page->lock);
+	pthread_rwlock_rdlock(pagerGetPageLock(page));
 #endif
 
     while (page->PageType != PAGER_PAGE_TYPE_LEAF) {
@@ -292,7 +986,7 @@ void BtreeCursorFirstLeaf(Cursor* cursor) {
         u64 pageIndex;
         cursor->indices[cursor->depth] = 0;
         cursor->pagePath[cursor->depth++] = page->pageIndex;
-        readPayload(page->cells + page->cellPointers[0], &key, &pageIndex);
+        readEntry(page, 0, &key, &pageIndex);
         pagerReleasePageLock(page);
         page = pagerGetReadPage(pageIndex);
     }
@@ -302,88 +996,365 @@ void BtreeCursorFirstLeaf(Cursor* cursor) {
     cursor->pagePath[cursor->depth] = page->pageIndex;
 }
 
-u1 BtreeCursorNextEntry(Cursor* cursor) {
+// moves cursor to the next (or previous) entry, switching leaves through the sibling links
+u1 stepCursorEntry(Cursor* cursor, const u1 forward) {
+    PagerOperation operation;
+    BufferedTreeLock lock(cursor->tree, 0);
+    SnapshotRead snapshotRead(cursor);
+    cursor->messageKind = 0;
     u8 d = cursor->depth;
-    Page* node = pagerGetReadPage(cursor->pagePath[d]);
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+restart:
+#endif
+    PageIndex pageIndex = cursor->pagePath[d];
+    Page* page = pagerGetReadPage(pageIndex);
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    u64 version = pagerReadPageVersion(page);
+    // entries of the leaf moved since the cursor was placed (or the page was freed and holds other keys now),
+    // the position is found again by the key of the current entry; if it is gone, the next one is at the position
+    u1 atNext = 0;
+    if (version != cursor->versions[d]) {
+        u64 _;
+        // a cursor moved to a missing key is at the entry after it already
+        atNext = !descendCursor(cursor, 0, cursor->key, &_) && forward && cursor->keyFound;
+        d = cursor->depth;
+        cursor->outdatedAncestors = 0;
+        pageIndex = cursor->pagePath[d];
+        page = pagerGetReadPage(pageIndex);
+        version = cursor->versions[d];
+    }
+#else
+    const u1 atNext = 0;
+#endif
     u16 i = cursor->indices[d];
-
-    if (i + 1 < node->nCellPointersCount) {
-        // Next in current leaf
-        cursor->indices[d]++;
-        pagerReleasePageLock(node);
-        return 1;
+    u16 count = page->nCellPointersCount;
+    u1 found;
+    u16 target;
+    if (forward) {
+        target = atNext ? i : i + 1;
+        found = target < count;
+    } else {
+        found = i > 0 && count > 0;
+        target = (i < count ? i : count) - 1;
     }
 
-    // Walk up to find a parent with a right sibling
-    while (d > 0) {
-        --d;
-        Page* parent = pagerGetReadPage(cursor->pagePath[d]);
-        u16 idx = cursor->indices[d];
-
-        if (idx + 1 < parent->nCellPointersCount) {
-            // Found a right sibling
-            u64 k;
-            u64 pageIndex;
-            readPayload(parent->cells + parent->cellPointers[idx + 1], &k, &pageIndex);
-
-            // Descend to leftmost leaf of this sibling
-            Page* next = pagerGetReadPage(pageIndex);
-            d++;
-            while (next->PageType != PAGER_PAGE_TYPE_LEAF) {
-                cursor->pagePath[d] = next->pageIndex;
-                cursor->indices[d - 1]++;
-                readPayload(next->cells + next->cellPointers[0], &k, &pageIndex);
-                pagerReleasePageLock(next);
-                next = pagerGetReadPage(pageIndex);
-                d++;
-            }
-            pagerReleasePageLock(next);
+    while (!found) {
+        PageIndex siblingIndex = forward ? page->nextLeafIndex : page->prevLeafIndex;
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+        if (!pagerValidatePageVersion(page, version))
+            goto restart;
+#endif
+        if (siblingIndex == 0)
+            break;
+#if !BTREE_LOCK_GRANULARITY_OPTIMISTIC
+        pagerReleasePageLock(page);
+#endif
+        Page* sibling = pagerGetReadPage(siblingIndex - 1);
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+        u64 siblingVersion = pagerReadPageVersion(sibling);
+        if (!pagerValidatePageVersion(page, version))
+            goto restart;
+        version = siblingVersion;
+#endif
+        page = sibling;
+        pageIndex = siblingIndex - 1;
+        count = page->nCellPointersCount;
+        found = count > 0;
+        target = forward ? 0 : count - 1;
+    }
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    u64 key = cursor->key;
+    u64 _;
+    if (found)
+        readEntry(page, target, &key, &_);
+    if (!pagerValidatePageVersion(page, version))
+        goto restart;
+    cursor->versions[d] = version;
+    cursor->key = key;
+    cursor->keyFound = found;
+#endif
+    pagerReleasePageLock(page);
 
-            cursor->pagePath[d] = next->pageIndex;
-            cursor->indices[d] = 0;
-            cursor->depth = d;
-            return 1;
-        }
-        pagerReleasePageLock(parent);
+    if (!found)
+        return 0;
+    if (pageIndex != cursor->pagePath[d]) {
+        cursor->pagePath[d] = pageIndex;
+        cursor->outdatedAncestors = 1;
     }
+    cursor->indices[d] = target;
+    return 1;
+}
 
-    return 0;
+u1 BtreeCursorNextEntry(Cursor* cursor) {
+    return stepCursorEntry(cursor, 1);
+}
+
+u1 BtreeCursorPrevEntry(Cursor* cursor) {
+    return stepCursorEntry(cursor, 0);
 }
 
 u1 BtreeCursorReadData(const Cursor* cursor, u64 *key, u64 *value) {
+    // pending message is newer than anything in the leaf
+    if (cursor->messageKind == BTREE_MESSAGE_INSERT) {
+        *key = cursor->key;
+        *value = cursor->messageValue;
+        return 0;
+    }
+    if (cursor->messageKind == BTREE_MESSAGE_REMOVE)
+        return 1;
+    PagerOperation operation;
+    BufferedTreeLock lock(cursor->tree, 0);
+    SnapshotRead snapshotRead(cursor);
     Page* page = pagerGetReadPage(cursor->pagePath[cursor->depth]);
-    if (page->PageType != PAGER_PAGE_TYPE_LEAF) {
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    while (1) {
+        u64 version = pagerReadPageVersion(page);
+        if (version != cursor->versions[cursor->depth]) {
+            // leaf changed since the cursor was placed, the entry is looked up again by its key; if it was removed
+            // there is none to read, the next step goes to the entry after it
+            Cursor current = *cursor;
+            u64 _;
+            if (!descendCursor(&current, 0, cursor->key, &_) && cursor->keyFound)
+                return 1;
+            return BtreeCursorReadData(&current, key, value);
+        }
+        u16 index = cursor->indices[cursor->depth];
+        u1 readable = page->PageType == PAGER_PAGE_TYPE_LEAF && index < page->nCellPointersCount;
+        if (readable)
+            readEntry(page, index, key, value);
+        if (pagerValidatePageVersion(page, version))
+            return readable ? 0 : 1;
+    }
+#endif
+    // cursor may stay after the last entry, there is no cell pointer there
+    if (page->PageType != PAGER_PAGE_TYPE_LEAF || cursor->indices[cursor->depth] >= page->nCellPointersCount) {
+        pagerReleasePageLock(page);
         return 1;
     }
 
-    readPayload(page->cells + page->cellPointers[cursor->indices[cursor->depth]], key, value);
+    readEntry(page, cursor->indices[cursor->depth], key, value);
     pagerReleasePageLock(page);
     return 0;
 }
 
-void vacuumCells(Page* page) {
-    u16 relevantCellPointers[page->nCellPointersCount];
-    u8 relevantCells[page->nCellsTotalSize];
-    u16 cellPointer = 0;
-    for (u16 i = 0; i < page->nCellPointersCount; ++i) {
-        relevantCellPointers[i] = cellPointer;
-        u8 *cellStart = page->cells + page->cellPointers[i];
-        u8 cellTotalSize = *cellStart;
-        for (u8 *j = cellStart; j < cellStart + cellTotalSize; ++j) {
-            relevantCells[cellPointer++] = *j;
+// ancestors of a leaf reached through sibling links are unknown, descend again to the current entry
+void restoreCursorPath(Cursor* cursor) {
+    u64 key;
+    u64 _;
+    if (BtreeCursorReadData(cursor, &key, &_) == 0)
+        BtreeCursorMoveTo(cursor, key);
+    cursor->outdatedAncestors = 0;
+}
+
+#if !BTREE_LOCK_GRANULARITY_PER_PAGE
+// deepest depth of the cursor path whose subtree still holds the key, the key must not be less than the one
+// the path was built for (so only the upper bound of every subtree is checked)
+static u8 resumeDepth(const Cursor* cursor, const u64 key) {
+    for (u8 depth = 0; depth < cursor->depth; ++depth) {
+        Page* page = pagerGetReadPage(cursor->pagePath[depth]);
+        u16 index = cursor->indices[depth];
+        u1 inside = index + 1 >= page->nCellPointersCount;
+        if (!inside) {
+            u64 separator;
+            u64 _;
+            readEntry(page, index, &separator, &_);
+            inside = key <= separator;
         }
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+        // the separator is only meaningful if the page is the one the path was built through
+        if (!pagerValidatePageVersion(page, cursor->versions[depth]))
+            return 0;
+#endif
+        if (!inside)
+            return depth;
     }
-
-    page->nCellsTotalSize = cellPointer;
-    array_copy16(relevantCellPointers, page->cellPointers, 0, 0, page->nCellPointersCount);
-    array_copy8(relevantCells, page->cells, 0, 0, cellPointer);
-    page->nFreeCellsTotalSize = 0;
-    page->firstFreeCellIndex = 0;
+    return cursor->depth;
 }
+#endif
 
-void insertCell(Cursor* cursor, const u8 depth, u64 key, u64 value, u1 newPointer);
-void replaceKeyInParent(Cursor* cursor, const u8 depth, const u64 newKey) {
-    if (depth == 0)
+// key being looked up by BtreeMultiGet, descents of a group advance one level per round
+struct MultiGetSlot {
+    u64 keyIndex;
+    PageIndex pageIndex;
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    // page the current one was reached from, 0 means current page is the root
+    PageIndex parentIndex; // actually index + 1
+    u64 parentVersion;
+#endif
+};
+
+// looks up a group of keys in lock-step: every round moves each unfinished descent one level down
+// and prefetches the child, so misses of the whole group overlap instead of following each other
+static void multiGetGroup(PageIndex rootIndex, const u64* keys, u64 from, u64 count, u64* values, u1* found) {
+    MultiGetSlot slots[BTREE_MULTI_GET_GROUP_SIZE];
+    for (u64 i = 0; i < count; ++i) {
+        slots[i].keyIndex = from + i;
+        slots[i].pageIndex = rootIndex;
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+        slots[i].parentIndex = 0;
+#endif
+    }
+
+    u64 active = count;
+    while (active > 0) {
+        // pages are pinned only for one round, the pool never has to hold whole paths of the group
+        PagerOperation round;
+        for (u64 i = 0; i < active;) {
+            MultiGetSlot* slot = slots + i;
+            const u64 key = keys[slot->keyIndex];
+            Page* page = pagerGetReadPage(slot->pageIndex);
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+            u64 version = pagerReadPageVersion(page);
+            // parent must be unchanged after the child version is read, as in BtreeCursorMoveTo
+            if (slot->parentIndex != 0
+                && !pagerValidatePageVersion(pagerGetReadPage(slot->parentIndex - 1), slot->parentVersion)) {
+                slot->pageIndex = rootIndex;
+                slot->parentIndex = 0;
+                ++i;
+                continue;
+            }
+#endif
+            u64 value;
+            u16 index;
+            u1 hit = binarySearch(page, key, &value, &index);
+            u1 isLeaf = page->PageType == PAGER_PAGE_TYPE_LEAF;
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+            if (!pagerValidatePageVersion(page, version)) {
+                slot->pageIndex = rootIndex;
+                slot->parentIndex = 0;
+                ++i;
+                continue;
+            }
+#endif
+            pagerReleasePageLock(page);
+            if (isLeaf) {
+                found[slot->keyIndex] = hit;
+                if (hit)
+                    values[slot->keyIndex] = value;
+                // finished descent takes the place of the last active one
+                *slot = slots[--active];
+                continue;
+            }
+            pagerPrefetchPage(value);
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+            slot->parentIndex = slot->pageIndex + 1;
+            slot->parentVersion = version;
+#endif
+            slot->pageIndex = value;
+            ++i;
+        }
+    }
+}
+
+u64 BtreeMultiGet(Btree* tree, const u64* keys, u64 n, u64* values, u1* found) {
+    Cursor* cursor;
+    BtreeCreateCursor(tree, &cursor, 0);
+
+    if (tree->buffered) {
+        // messages on the path decide first, groups and resumed descents don't look at them
+        for (u64 i = 0; i < n; ++i) {
+            BtreeCursorMoveTo(cursor, keys[i]);
+            u64 key;
+            u64 value;
+            found[i] = BtreeCursorReadData(cursor, &key, &value) == 0 && key == keys[i];
+            if (found[i])
+                values[i] = value;
+        }
+    }
+
+    u1 sorted = !tree->buffered;
+    for (u64 i = 1; i < n && sorted; ++i)
+        sorted = keys[i - 1] <= keys[i];
+
+#if !BTREE_LOCK_GRANULARITY_PER_PAGE
+    // neighbouring sorted keys mostly share the path, descend only from where it splits off;
+    // per page locks don't protect the path between lookups, so that mode always uses groups
+    if (sorted) {
+        for (u64 i = 0; i < n; ++i) {
+            PagerOperation operation;
+            u8 fromDepth = i == 0 ? 0 : resumeDepth(cursor, keys[i]);
+            u64 value;
+            found[i] = descendCursor(cursor, fromDepth, keys[i], &value);
+            if (found[i])
+                values[i] = value;
+        }
+    }
+#else
+    sorted = 0;
+#endif
+
+    if (!sorted && !tree->buffered) {
+        PageIndex rootIndex = cursor->pRoot->pageIndex;
+        for (u64 from = 0; from < n; from += BTREE_MULTI_GET_GROUP_SIZE) {
+            u64 count = n - from < BTREE_MULTI_GET_GROUP_SIZE ? n - from : BTREE_MULTI_GET_GROUP_SIZE;
+            multiGetGroup(rootIndex, keys, from, count, values, found);
+        }
+    }
+
+    BtreeDestroyCursor(tree, cursor);
+
+    u64 foundCount = 0;
+    for (u64 i = 0; i < n; ++i)
+        foundCount += found[i];
+    return foundCount;
+}
+
+void vacuumCells(Page* page) {
+    if (page->PageFormat != PAGER_PAGE_FORMAT_CELLS)
+        return;
+    COUNT_EVENT(vacuums, 1);
+    u16 relevantCellPointers[page->nCellPointersCount];
+    u8 relevantCells[page->nCellsTotalSize];
+    u16 cellPointer = 0;
+    for (u16 i = 0; i < page->nCellPointersCount; ++i) {
+        relevantCellPointers[i] = cellPointer;
+        u8 *cellStart = page->cells + page->cellPointers[i];
+        u8 cellTotalSize = *cellStart;
+        for (u8 *j = cellStart; j < cellStart + cellTotalSize; ++j) {
+            relevantCells[cellPointer++] = *j;
+        }
+    }
+
+    // cells are placed in the order of pointers at the end of the content
+    u16 cellsStart = PAGER_PAGE_CONTENT_SIZE - cellPointer;
+    for (u16 i = 0; i < page->nCellPointersCount; ++i)
+        relevantCellPointers[i] += cellsStart;
+    page->nCellsTotalSize = cellPointer;
+    array_copy16(relevantCellPointers, page->cellPointers, 0, 0, page->nCellPointersCount);
+    array_copy8(relevantCells, page->cells, 0, cellsStart, cellPointer);
+    page->nFreeCellsTotalSize = 0;
+    page->firstFreeCellIndex = 0;
+}
+
+// puts leaf page right after the left one in the list of leaf siblings
+void linkLeafAfter(Page* left, Page* right) {
+    right->prevLeafIndex = left->pageIndex + 1;
+    right->nextLeafIndex = left->nextLeafIndex;
+    if (left->nextLeafIndex != 0) {
+        Page* next = pagerGetWritePage(left->nextLeafIndex - 1);
+        next->prevLeafIndex = right->pageIndex + 1;
+        pagerReleasePageLock(next);
+    }
+    left->nextLeafIndex = right->pageIndex + 1;
+}
+void unlinkLeaf(Page* page) {
+    if (page->prevLeafIndex != 0) {
+        Page* prev = pagerGetWritePage(page->prevLeafIndex - 1);
+        prev->nextLeafIndex = page->nextLeafIndex;
+        pagerReleasePageLock(prev);
+    }
+    if (page->nextLeafIndex != 0) {
+        Page* next = pagerGetWritePage(page->nextLeafIndex - 1);
+        next->prevLeafIndex = page->prevLeafIndex;
+        pagerReleasePageLock(next);
+    }
+    page->prevLeafIndex = 0;
+    page->nextLeafIndex = 0;
+}
+
+void insertCell(Cursor* cursor, const u8 depth, u64 key, u64 value, u1 newPointer);
+void replaceKeyInParent(Cursor* cursor, const u8 depth, const u64 newKey) {
+    if (depth == 0)
         return;
     //Page* parent = pagerGetPage(cursor->pagePath[depth - 1]);
     //u16 childIndex = cursor->indices[depth - 1];
@@ -391,6 +1362,20 @@ void replaceKeyInParent(Cursor* cursor, const u8 depth, const u64 newKey) {
     //u8* cellStart = parent->cells + parent->cellPointers[childIndex];
     insertCell(cursor, depth - 1, newKey, cursor->pagePath[depth], 0);
 }
+// separator of a page whose max key was changed by an insert; separators of a buffered tree only grow,
+// a lower one would route keys of messages queued above the page to its right sibling
+void raiseKeyInParent(Cursor* cursor, const u8 depth, const u64 newKey) {
+    if (depth > 0 && cursor->tree->buffered) {
+        Page* parent = pagerGetReadPage(cursor->pagePath[depth - 1]);
+        u64 separator;
+        u64 _;
+        readEntry(parent, cursor->indices[depth - 1], &separator, &_);
+        pagerReleasePageLock(parent);
+        if (newKey <= separator)
+            return;
+    }
+    replaceKeyInParent(cursor, depth, newKey);
+}
 void splitNodes(Cursor* cursor, u8 depth) {
 #if BTREE_LOCK_GRANULARITY_PER_PAGE
 	pthread_rwlock_rdlock(&globalLock);
@@ -399,6 +1384,7 @@ void splitNodes(Cursor* cursor, u8 depth) {
     Page* current = pagerGetWritePage(cursor->pagePath[depth]);
 
     TRACE_SPLIT(("split started for depth %u", depth));
+    COUNT_EVENT(splits, 1);
 
     Page* parent;
     Page* newLeft;
@@ -411,11 +1397,11 @@ void splitNodes(Cursor* cursor, u8 depth) {
     if (depth == 0) {
         // parent stays on the same page, create 2 pages instead
         parent = current;
-        newLeft = pagerCreateNewPage(current->PageType);
-        newRight = pagerCreateNewPage(current->PageType);
+        newLeft = pagerCreateNewPage(current->PageType, current->PageFormat);
+        newRight = pagerCreateNewPage(current->PageType, current->PageFormat);
 #if BTREE_LOCK_GRANULARITY_PER_PAGE
-        pthread_rwlock_wrlock(&newLeft->lock);
-        pthread_rwlock_wrlock(&newRight->lock);
+        pthread_rwlock_wrlock(pagerGetPageLock(newLeft));
+        pthread_rwlock_wrlock(pagerGetPageLock(newRight));
 #endif
         vacuumCells(parent);
         cellPointers = parent->cellPointers;
@@ -425,9 +1411,9 @@ void splitNodes(Cursor* cursor, u8 depth) {
     } else {
         parent = pagerGetWritePage(cursor->pagePath[depth - 1]);
         newLeft = current;
-        newRight = pagerCreateNewPage(current->PageType);
+        newRight = pagerCreateNewPage(current->PageType, current->PageFormat);
 #if BTREE_LOCK_GRANULARITY_PER_PAGE
-        pthread_rwlock_wrlock(&newRight->lock);
+        pthread_rwlock_wrlock(pagerGetPageLock(newRight));
 #endif
         vacuumCells(current);
         cellPointers = current->cellPointers;
@@ -439,36 +1425,74 @@ void splitNodes(Cursor* cursor, u8 depth) {
     TRACE_SPLIT(("splitNode: %u into %u + %u\n", current->pageIndex, newLeft->pageIndex, newRight->pageIndex));
 
     u16 midPtrIdx;
-    u16 midCellIdx;
-    u64 accumPageSize = 0;
-    for (u16 i = 0; i < cellPointersCount; ++i) {
-        accumPageSize += sizeof(u16) + *(cells + cellPointers[i]);
-        if (accumPageSize >= PAGER_PAGE_BYTE_SIZE / 2) {
-            midPtrIdx = i;
-            midCellIdx = cellPointers[i];
-            break;
+    if (current->PageFormat == PAGER_PAGE_FORMAT_FIXED) {
+        midPtrIdx = cellPointersCount / 2;
+        if (newLeft != current) {
+            array_copy64(current->fixedKeys, newLeft->fixedKeys, 0, 0, midPtrIdx);
+            array_copy64(current->fixedValues, newLeft->fixedValues, 0, 0, midPtrIdx);
+        }
+        array_copy64(current->fixedKeys, newRight->fixedKeys, midPtrIdx, 0, cellPointersCount - midPtrIdx);
+        array_copy64(current->fixedValues, newRight->fixedValues, midPtrIdx, 0, cellPointersCount - midPtrIdx);
+        newLeft->nCellPointersCount = midPtrIdx;
+        newRight->nCellPointersCount = cellPointersCount - midPtrIdx;
+    } else if (current->PageFormat == PAGER_PAGE_FORMAT_PACKED) {
+        // halves are packed on their own, usually narrower than the whole page
+        midPtrIdx = cellPointersCount / 2;
+        u64 keys[cellPointersCount];
+        u64 values[cellPointersCount];
+        for (u16 i = 0; i < cellPointersCount; ++i)
+            readEntry(current, i, keys + i, values + i);
+        fillPackedPage(newLeft, keys, values, midPtrIdx);
+        fillPackedPage(newRight, keys + midPtrIdx, values + midPtrIdx, cellPointersCount - midPtrIdx);
+    } else {
+        u16 midCellIdx;
+        u64 accumPageSize = 0;
+        for (u16 i = 0; i < cellPointersCount; ++i) {
+            accumPageSize += sizeof(u16) + *(cells + cellPointers[i]);
+            if (accumPageSize >= PAGER_PAGE_BYTE_SIZE / 2) {
+                midPtrIdx = i;
+                midCellIdx = cellPointers[i];
+                break;
+            }
         }
-    }
 
-    if (newLeft != current) {
-        array_copy8(cells, newLeft->cells, 0, 0, midCellIdx);
-        array_copy16(cellPointers, newLeft->cellPointers, 0, 0, midPtrIdx);
-    }
-    array_copy8(cells, newRight->cells, midCellIdx, 0, cellsCount - midCellIdx);
-    for (u16 i = midPtrIdx; i < cellPointersCount; ++i) {
-        newRight->cellPointers[i - midPtrIdx] = cellPointers[i] - midCellIdx;
+        // after vacuum cells go in the order of pointers, right half already ends the content,
+        // left half moves to the end of the content by the size of the right half
+        u16 cellsStart = PAGER_PAGE_CONTENT_SIZE - cellsCount;
+        u16 rightCellsSize = PAGER_PAGE_CONTENT_SIZE - midCellIdx;
+        array_copy8(cells, newRight->cells, midCellIdx, midCellIdx, rightCellsSize);
+        array_copy16(cellPointers, newRight->cellPointers, midPtrIdx, 0, cellPointersCount - midPtrIdx);
+
+        memmove(newLeft->cells + cellsStart + rightCellsSize, cells + cellsStart, midCellIdx - cellsStart);
+        for (u16 i = 0; i < midPtrIdx; ++i) {
+            newLeft->cellPointers[i] = cellPointers[i] + rightCellsSize;
+        }
+
+        newLeft->nCellsTotalSize = midCellIdx - cellsStart;
+        newLeft->nCellPointersCount = midPtrIdx;
+        newRight->nCellsTotalSize = rightCellsSize;
+        newRight->nCellPointersCount = cellPointersCount - midPtrIdx;
     }
 
-    newLeft->nCellsTotalSize = midCellIdx;
-    newLeft->nCellPointersCount = midPtrIdx;
-    newRight->nCellsTotalSize = cellsCount - midCellIdx;
-    newRight->nCellPointersCount = cellPointersCount - midPtrIdx;
+    if (current->PageType == PAGER_PAGE_TYPE_LEAF) {
+        if (newLeft != current) {
+            // root stays in place, its leaf neighbours (if any) go to the new left page
+            newLeft->prevLeafIndex = current->prevLeafIndex;
+            newLeft->nextLeafIndex = current->nextLeafIndex;
+            current->prevLeafIndex = 0;
+            current->nextLeafIndex = 0;
+        }
+        linkLeafAfter(newLeft, newRight);
+    }
 
     u64 _;
     u64 leftMaxKey;
     u64 rightMaxKey;
-    readPayload(newLeft->cells + newLeft->cellPointers[newLeft->nCellPointersCount - 1], &leftMaxKey, &_);
-    readPayload(newRight->cells + newRight->cellPointers[newRight->nCellPointersCount - 1], &rightMaxKey, &_);
+    readEntry(newLeft, newLeft->nCellPointersCount - 1, &leftMaxKey, &_);
+    readEntry(newRight, newRight->nCellPointersCount - 1, &rightMaxKey, &_);
+
+    if (depth > 0 && current->PageType == PAGER_PAGE_TYPE_PARENT && cursor->tree->buffered)
+        splitMessages(newLeft, newRight, leftMaxKey);
 
     u1 transferCursorRight = cursor->indices[depth] >= midPtrIdx;
 
@@ -503,6 +1527,12 @@ void splitNodes(Cursor* cursor, u8 depth) {
             cursor->indices[1] -= midPtrIdx;
         }
     } else {
+        // right half of a buffered tree page keeps the old separator, messages above may be for keys
+        // between its max key and the separator
+        u64 rightSeparator = rightMaxKey;
+        if (cursor->tree->buffered)
+            readEntry(parent, cursor->indices[depth - 1], &rightSeparator, &_);
+
         // during replacement tree could grow, adjusting depth
         // pages remains the same, because node split affect only ancestors
         u8 prevDepth = cursor->depth;
@@ -512,7 +1542,7 @@ void splitNodes(Cursor* cursor, u8 depth) {
         ++cursor->indices[depth - 1];
 
         prevDepth = cursor->depth;
-        insertCell(cursor, depth - 1, rightMaxKey, newRight->pageIndex, 1);
+        insertCell(cursor, depth - 1, rightSeparator, newRight->pageIndex, 1);
         depth += cursor->depth - prevDepth;
 
         if (transferCursorRight) {
@@ -530,9 +1560,83 @@ void splitNodes(Cursor* cursor, u8 depth) {
     TRACE_SPLIT(("split done %u\n", current->pageIndex));
 
 }
+void insertFixedEntry(Cursor* cursor, u8 depth, Page* current, u64 key, u64 value, u1 newPointer) {
+    u16 index = cursor->indices[depth];
+    u16 count = current->nCellPointersCount;
+    u64 prevMaxKey = count > 0 ? current->fixedKeys[count - 1] : 0;
+
+    if (newPointer) {
+        if (count >= PAGER_FIXED_PAGE_CAPACITY) {
+            u8 prevDepth = cursor->depth;
+            TRACE_INSERT_CELL(("insertCell: overflow detected for fixed page %u\n", current->pageIndex));
+            splitNodes(cursor, depth);
+            depth += cursor->depth - prevDepth;
+            insertCell(cursor, depth, key, value, newPointer);
+            pagerReleasePageLock(current);
+            return;
+        }
+        array_shift64(current->fixedKeys, index, count, 1);
+        array_shift64(current->fixedValues, index, count, 1);
+        ++current->nCellPointersCount;
+    }
+    current->fixedKeys[index] = key;
+    current->fixedValues[index] = value;
+    pagerReleasePageLock(current);
+
+    if (count == 0 || current->fixedKeys[current->nCellPointersCount - 1] != prevMaxKey) {
+        raiseKeyInParent(cursor, depth, key);
+    }
+}
+void insertPackedEntry(Cursor* cursor, u8 depth, Page* current, u64 key, u64 value, u1 newPointer) {
+    u16 index = cursor->indices[depth];
+    u16 count = current->nCellPointersCount;
+    u64 prevMaxKey = count > 0 ? packedKey(current, count - 1) : 0;
+
+    PackedLayout layout = packedLayoutWith(current, key, value);
+    if (sizeof(u64) + packedAreaSize(count + newPointer, layout.keyWidth, layout.valueWidth) > PAGER_PAGE_CONTENT_SIZE) {
+        u8 prevDepth = cursor->depth;
+        TRACE_INSERT_CELL(("insertCell: overflow detected for packed page %u\n", current->pageIndex));
+        splitNodes(cursor, depth);
+        depth += cursor->depth - prevDepth;
+        insertCell(cursor, depth, key, value, newPointer);
+        pagerReleasePageLock(current);
+        return;
+    }
+    // entry doesn't fit the current widths (or the page is empty and has none), all entries are widened
+    if (count == 0 || layout.base != current->packedBase || layout.keyWidth != current->packedKeyWidth
+        || layout.valueWidth != current->packedValueWidth)
+        repackPage(current, layout);
+
+    if (newPointer) {
+        u16 after = count - index;
+        u8 keyWidth = current->packedKeyWidth;
+        u8 valueWidth = current->packedValueWidth;
+        memmove(current->packedArea + (index + 1) * keyWidth, current->packedArea + index * keyWidth, after * keyWidth);
+        if (count > 0) {
+            u8* lastValue = packedValuePointer(current, count - 1);
+            memmove(lastValue - valueWidth, lastValue, after * valueWidth);
+        }
+        ++current->nCellPointersCount;
+    }
+    writePackedEntry(current, index, key, value);
+    pagerReleasePageLock(current);
+
+    if (count == 0 || packedKey(current, current->nCellPointersCount - 1) != prevMaxKey) {
+        raiseKeyInParent(cursor, depth, key);
+    }
+}
 void insertCell(Cursor* cursor, u8 depth, u64 key, u64 value, u1 newPointer) {
     Page* current = pagerGetWritePage(cursor->pagePath[depth]);
 
+    if (current->PageFormat == PAGER_PAGE_FORMAT_FIXED) {
+        insertFixedEntry(cursor, depth, current, key, value, newPointer);
+        return;
+    }
+    if (current->PageFormat == PAGER_PAGE_FORMAT_PACKED) {
+        insertPackedEntry(cursor, depth, current, key, value, newPointer);
+        return;
+    }
+
     u16 existingCellIndex = 0;
     u8 existingCellSize = 0;
 
@@ -548,21 +1652,19 @@ void insertCell(Cursor* cursor, u8 depth, u64 key, u64 value, u1 newPointer) {
     u8 actualCellSize = expectedCellSize;
     u1 payloadQuickWritten = 0;
 
-    u64 prevMaxKey;
+    u64 prevMaxKey = 0;
     u64 _;
-    readPayload(current->cells + current->cellPointers[current->nCellPointersCount - 1], &prevMaxKey, &_);
+    if (current->nCellPointersCount > 0)
+        readEntry(current, current->nCellPointersCount - 1, &prevMaxKey, &_);
 
-    if(!newPointer) {
-        if(existingCellSize >= expectedCellSize) {
-            writePayload(current->cells + current->cellPointers[cursor->indices[depth]], key, value, existingCellSize);
-            payloadQuickWritten = 1;
-        } else {
-            cleanCell(current, existingCellIndex, 0);
-        }
+    if(!newPointer && existingCellSize >= expectedCellSize) {
+        writePayload(current->cells + current->cellPointers[cursor->indices[depth]], key, value, existingCellSize);
+        payloadQuickWritten = 1;
     }
 
     if (!payloadQuickWritten) {
-        u64 pageRelevantSize = calculatePageRelevantSize(current, 1);
+        // grown cell replaces the existing one, which stays in place until the page is known to hold the grown one
+        u64 pageRelevantSize = calculatePageRelevantSize(current, 1) - existingCellSize;
         if (expectedCellSize + pointerSize + pageRelevantSize > PAGER_PAGE_BYTE_SIZE) {
             u8 prevDepth = cursor->depth;
             TRACE_INSERT_CELL(("insertCell: overflow detected for page %u, page pointers = %u, relevant size = %llu cell size = %u\n", current->pageIndex, current->nCellPointersCount, pageRelevantSize, expectedCellSize));
@@ -577,74 +1679,366 @@ void insertCell(Cursor* cursor, u8 depth, u64 key, u64 value, u1 newPointer) {
             return;
         }
 
-        // try to find a free cell to insert
-        u16 freeCellIndex = current->firstFreeCellIndex;
-        u16 prevCellIndex = 0;
-        u8 prevCellSize = 0;
-        while (freeCellIndex != 0) {
-            u1 found = 0;
-            u8 correctedIndex = freeCellIndex - 1;
-            u8 freeCellSize = current->cells[correctedIndex];
-            if (freeCellSize >= expectedCellSize) {
-                actualCellSize = freeCellSize;
-                found = 1;
-            }
-            u8 nextCellIndexSize = current->cells[correctedIndex + 1];
-
-            u16 nextCellIndex = 0;
-            freeCellIndex = 0;
-            for (u8 i = nextCellIndexSize - 1; i >= 0; --i) {
-                nextCellIndex <<= 8;
-                nextCellIndex |= current->cells[correctedIndex + 2 + i];
-            }
+        if (!newPointer) {
+            // existing cell goes together with its pointer, vacuum would copy it back as a live one otherwise;
+            // grown cell gets a new pointer at the same index
+            cleanCell(current, cursor->indices[depth], 1);
+            newPointer = 1;
+            pointerSize = sizeof(u16);
+        }
 
-            if(found) {
-            	// remove found free cell from the linked list
-                if(prevCellIndex != 0) {
-					writePayload(current->cells + prevCellIndex - 1, nextCellIndex, 0, prevCellSize);
-                } else {
-                	current->firstFreeCellIndex = nextCellIndex;
+        // pointers and cells share the content, so the new pointer needs room as well
+        u16 freeCellIndex = 0;
+        u64 pageTotalSize = calculatePageTotalSize(current, 1);
+        if (pageTotalSize + pointerSize + expectedCellSize > PAGER_PAGE_BYTE_SIZE) {
+            vacuumCells(current);
+        } else {
+            // try to find a free cell to insert
+            freeCellIndex = current->firstFreeCellIndex;
+            u16 prevCellIndex = 0;
+            u8 prevCellSize = 0;
+            while (freeCellIndex != 0) {
+                u16 correctedIndex = freeCellIndex - 1;
+                u8 freeCellSize = current->cells[correctedIndex];
+                u64 nextCellIndex;
+                readPayload(current->cells + correctedIndex, &nextCellIndex, &_);
+
+                if (freeCellSize >= expectedCellSize) {
+                    actualCellSize = freeCellSize;
+                    // remove found free cell from the linked list
+                    if(prevCellIndex != 0) {
+                        writePayload(current->cells + prevCellIndex - 1, nextCellIndex, 0, prevCellSize);
+                    } else {
+                        current->firstFreeCellIndex = nextCellIndex;
+                    }
+                    current->nFreeCellsTotalSize -= freeCellSize;
+                    break;
                 }
-                current->nFreeCellsTotalSize -= freeCellSize;
-                break;
-            } else {
                 prevCellIndex = freeCellIndex;
                 prevCellSize = freeCellSize;
-				freeCellIndex = nextCellIndex;
+                freeCellIndex = nextCellIndex;
             }
         }
 
-        u16 insertionCellPointer = current->nCellsTotalSize;
+        u16 insertionCellPointer;
         if (freeCellIndex != 0) {
+            COUNT_EVENT(freeCellReuses, 1);
             insertionCellPointer = freeCellIndex - 1;
         } else {
-            u64 pageTotalSize = calculatePageTotalSize(current, 1);
-            if (pageTotalSize + pointerSize + expectedCellSize > PAGER_PAGE_BYTE_SIZE) {
-                vacuumCells(current);
-                insertionCellPointer = current->nCellsTotalSize;
-            }
+            // cells grow from the end of the content towards the pointers
+            insertionCellPointer = PAGER_PAGE_CONTENT_SIZE - current->nCellsTotalSize - actualCellSize;
+            current->nCellsTotalSize += actualCellSize;
         }
 
-        if(newPointer)
-            array_shift16(current->cellPointers, cursor->indices[depth], ++current->nCellPointersCount, 1);
+        if(newPointer) {
+            array_shift16(current->cellPointers, cursor->indices[depth], current->nCellPointersCount, 1);
+            ++current->nCellPointersCount;
+        }
         current->cellPointers[cursor->indices[depth]] = insertionCellPointer;
         writePayload(current->cells + insertionCellPointer, key, value, actualCellSize);
         TRACE_INSERT_CELL(("insertCell: success write in page %u for value %llu\n", current->pageIndex, key));
-        if (freeCellIndex == 0)
-            current->nCellsTotalSize += actualCellSize;
         pagerReleasePageLock(current);
     }
 
     u64 newMaxKey;
-    readPayload(current->cells + current->cellPointers[current->nCellPointersCount - 1], &newMaxKey, &_);
+    readEntry(current, current->nCellPointersCount - 1, &newMaxKey, &_);
 
     if(newMaxKey != prevMaxKey) {
-        replaceKeyInParent(cursor, depth, key);
+        raiseKeyInParent(cursor, depth, key);
+    }
+}
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+// checks that insertion changes only the leaf: no split and no new max key for the parent
+u1 isLeafOnlyInsert(const Cursor* cursor, const Page* leaf, u64 key, u64 value) {
+    if (cursor->depth > 0 && cursor->indices[cursor->depth] >= leaf->nCellPointersCount)
+        return 0;
+    return pageHasRoomForEntry(leaf, key, value);
+}
+
+// checks that removal changes only the leaf: max key stays and leaf can't be merged with siblings
+u1 isLeafOnlyRemove(const Cursor* cursor, const Page* leaf) {
+    u8 depth = cursor->depth;
+    u16 index = cursor->indices[depth];
+    if (depth == 0)
+        return 1;
+    if (index + 1 >= leaf->nCellPointersCount)
+        return 0;
+
+    u64 remainingSize = calculatePageRelevantSize(leaf, 0) - calculateEntrySize(leaf, index);
+
+    // siblings are read without locks, the result is only a hint whether merge is worth trying
+    Page* parent = pagerGetReadPage(cursor->pagePath[depth - 1]);
+    u64 parentVersion = cursor->versions[depth - 1];
+    u16 idxInParent = cursor->indices[depth - 1];
+    for (i16 direction = -1; direction <= 1; direction += 2) {
+        i32 siblingIdx = (i32)idxInParent + direction;
+        if (siblingIdx < 0 || siblingIdx >= parent->nCellPointersCount)
+            continue;
+        u64 _;
+        u64 siblingIndex;
+        readEntry(parent, siblingIdx, &_, &siblingIndex);
+        if (!pagerValidatePageVersion(parent, parentVersion))
+            return 0;
+        Page* sibling = pagerGetReadPage(siblingIndex);
+        if (PAGER_PAGE_HEADER_SIZE + remainingSize + calculatePageRelevantSize(sibling, 0) < PAGER_PAGE_BYTE_SIZE)
+            return 0;
+    }
+    return pagerValidatePageVersion(parent, parentVersion);
+}
+
+// locks every page from the root to the leaf (and their siblings, if merge is possible),
+// descending again until all locked pages have the versions cursor has seen
+void lockCursorPath(Cursor* cursor, u1 lockSiblings) {
+    while (1) {
+        u1 valid = 1;
+        for (u8 d = 0; d <= cursor->depth && valid; ++d) {
+            valid = pagerLockPage(pagerGetReadPage(cursor->pagePath[d])) == cursor->versions[d];
+        }
+        for (u8 d = 1; d <= cursor->depth && valid && lockSiblings; ++d) {
+            Page* parent = pagerGetReadPage(cursor->pagePath[d - 1]);
+            u16 idxInParent = cursor->indices[d - 1];
+            u64 _;
+            u64 siblingIndex;
+            if (idxInParent > 0) {
+                readEntry(parent, idxInParent - 1, &_, &siblingIndex);
+                pagerLockPage(pagerGetReadPage(siblingIndex));
+            }
+            if (idxInParent + 1 < parent->nCellPointersCount) {
+                readEntry(parent, idxInParent + 1, &_, &siblingIndex);
+                pagerLockPage(pagerGetReadPage(siblingIndex));
+            }
+        }
+        if (valid) {
+            // splits and merges relink leaf neighbours, which may belong to other parents
+            Page* leaf = pagerGetReadPage(cursor->pagePath[cursor->depth]);
+            if (leaf->prevLeafIndex != 0)
+                pagerLockPage(pagerGetReadPage(leaf->prevLeafIndex - 1));
+            if (leaf->nextLeafIndex != 0) {
+                Page* next = pagerGetReadPage(leaf->nextLeafIndex - 1);
+                pagerLockPage(next);
+                if (next->nextLeafIndex != 0)
+                    pagerLockPage(pagerGetReadPage(next->nextLeafIndex - 1));
+            }
+            return;
+        }
+        pagerReleaseWriteLocks(0);
+        BtreeCursorMoveTo(cursor, cursor->key);
+    }
+}
+#endif
+
+void removeCell(Cursor* cursor, const u8 depth, const u16 cellPointerIndex);
+// applies a message which reached a leaf, as an unbuffered tree applies the write
+static void applyMessage(Cursor* cursor, u64 key, u64 value, u8 kind) {
+    u64 _;
+    u1 found = descendCursor(cursor, 0, key, &_);
+    if (kind == BTREE_MESSAGE_INSERT)
+        insertCell(cursor, cursor->depth, key, value, 1);
+    else if (found)
+        removeCell(cursor, cursor->depth, cursor->indices[cursor->depth]);
+}
+
+// moves the largest run of messages going to one child a level down: into the message page of the child or,
+// for a leaf child, into the leaf; if the child message page is full it is flushed instead, so every call
+// frees room in one message page on the way down from the node
+static void flushMessages(Cursor* cursor, PageIndex nodeIndex) {
+    Page* node = pagerGetWritePage(nodeIndex);
+    Page* messages = pagerGetWritePage(node->prevLeafIndex - 1);
+    u16 count = messages->nCellPointersCount;
+
+    // messages are sorted, the ones going to the same child follow each other
+    u16 runFrom = 0;
+    u16 runCount = 0;
+    u64 runChild = 0;
+    for (u16 from = 0; from < count;) {
+        u64 separator;
+        u64 child;
+        u16 position;
+        binarySearch(node, messages->messageKeys[from], &child, &position);
+        if (position >= node->nCellPointersCount)
+            position = node->nCellPointersCount - 1;
+        readEntry(node, position, &separator, &child);
+        u16 to = from + 1;
+        // last child takes every greater key as well
+        if (position + 1 == node->nCellPointersCount)
+            to = count;
+        while (to < count && messages->messageKeys[to] <= separator)
+            ++to;
+        if (to - from > runCount) {
+            runFrom = from;
+            runCount = to - from;
+            runChild = child;
+        }
+        from = to;
+    }
+    pagerReleasePageLock(node);
+
+    Page* child = pagerGetReadPage(runChild);
+    u1 isLeaf = child->PageType == PAGER_PAGE_TYPE_LEAF;
+    u16 room = isLeaf ? runCount : PAGER_MESSAGE_PAGE_CAPACITY - messageCount(child);
+    pagerReleasePageLock(child);
+    if (room == 0) {
+        pagerReleasePageLock(messages);
+        flushMessages(cursor, runChild);
+        return;
+    }
+    if (runCount > room)
+        runCount = room;
+
+    if (isLeaf) {
+        // leaf writes may split and merge pages up to the root, the run leaves the message page before them
+        u64 keys[runCount];
+        u64 values[runCount];
+        u8 kinds[runCount];
+        array_copy64(messages->messageKeys, keys, runFrom, 0, runCount);
+        array_copy64(messages->messageValues, values, runFrom, 0, runCount);
+        memcpy(kinds, messages->messageKinds + runFrom, runCount);
+        eraseMessages(messages, runFrom, runCount);
+        pagerReleasePageLock(messages);
+        for (u16 i = 0; i < runCount; ++i)
+            applyMessage(cursor, keys[i], values[i], kinds[i]);
+        return;
+    }
+    child = pagerGetWritePage(runChild);
+    addMessages(child, messages->messageKeys + runFrom, messages->messageValues + runFrom,
+                messages->messageKinds + runFrom, runCount);
+    pagerReleasePageLock(child);
+    eraseMessages(messages, runFrom, runCount);
+    pagerReleasePageLock(messages);
+}
+
+// logs the change while its entries are still locked, so the log keeps the order of changes of every key;
+// returns the sequence number for walCommit, 0 if there is no log
+static u64 logChange(u8 kind, u64 key, u64 value) {
+    return walIsOpen() ? walAppend(kind, key, value) : 0;
+}
+
+// queues the write in the root message page, flushing full message pages below first;
+// returns the sequence number of the logged message
+static u64 writeMessage(Cursor* cursor, u64 key, u64 value, u8 kind) {
+    BufferedTreeLock lock(cursor->tree, 1);
+#if BTREE_TRACK_OPEN_CURSORS
+    saveOtherCursors(cursor, 0, 0);
+#endif
+    Page* root = cursor->pRoot;
+    if (root->PageType == PAGER_PAGE_TYPE_LEAF) {
+        // there is no message page yet, the write goes to the only leaf
+        applyMessage(cursor, key, value, kind);
+    } else {
+        while (messageCount(root) == PAGER_MESSAGE_PAGE_CAPACITY)
+            flushMessages(cursor, root->pageIndex);
+        addMessages(root, &key, &value, &kind, 1);
+    }
+    u64 sequence = logChange(kind == BTREE_MESSAGE_INSERT ? WAL_RECORD_INSERT : WAL_RECORD_REMOVE, key, value);
+    cursor->positioned = 0;
+    cursor->messageKind = 0;
+#if BTREE_TRACK_OPEN_CURSORS
+    restoreOtherCursors(cursor);
+#endif
+    return sequence;
+}
+
+// flushes the node and then every node below it, children are read again after every flush
+// as flushes split and merge them
+static void drainMessages(Cursor* cursor, PageIndex nodeIndex) {
+    while (1) {
+        PagerOperation operation;
+        Page* node = pagerGetReadPage(nodeIndex);
+        // node may be freed by a merge meanwhile, its messages went to the left sibling
+        u1 pending = node->PageType == PAGER_PAGE_TYPE_PARENT && messageCount(node) > 0;
+        pagerReleasePageLock(node);
+        if (!pending)
+            break;
+        flushMessages(cursor, nodeIndex);
     }
+    for (u16 i = 0;; ++i) {
+        u64 childIndex;
+        {
+            PagerOperation operation;
+            Page* node = pagerGetReadPage(nodeIndex);
+            u1 done = node->PageType != PAGER_PAGE_TYPE_PARENT || i >= node->nCellPointersCount;
+            u64 _;
+            if (!done)
+                readEntry(node, i, &_, &childIndex);
+            pagerReleasePageLock(node);
+            if (done)
+                return;
+        }
+        drainMessages(cursor, childIndex);
+    }
+}
+
+// applies every pending message of the tree, the caller holds the buffer lock for writing
+static void drainAllMessages(Cursor* cursor) {
+    // a pass may miss messages moved to a node it has already left, until none are left
+    BtreeStats stats;
+    do {
+        drainMessages(cursor, cursor->tree->pRoot->pageIndex);
+        BtreeCollectStats(cursor->tree, &stats);
+    } while (stats.messages > 0);
 }
+
+void BtreeFlushMessages(Btree* tree) {
+    if (!tree->buffered)
+        return;
+    Cursor* cursor;
+    BtreeCreateCursor(tree, &cursor, 1);
+    {
+        BufferedTreeLock lock(tree, 1);
+#if BTREE_TRACK_OPEN_CURSORS
+        saveOtherCursors(cursor, 0, 0);
+#endif
+        drainAllMessages(cursor);
+#if BTREE_TRACK_OPEN_CURSORS
+        restoreOtherCursors(cursor);
+#endif
+    }
+    BtreeDestroyCursor(tree, cursor);
+}
+
 void BtreeCursorInsertEntry(Btree *tree, Cursor* cursor, u64 key, u64 value) {
+    OperationLatency latency(BTREE_LATENCY_INSERT);
+    PagerOperation operation;
     if(!cursor->write)
         return;
+    if (cursor->tree->buffered) {
+        walCommit(writeMessage(cursor, key, value, BTREE_MESSAGE_INSERT));
+        return;
+    }
+    if (cursor->outdatedAncestors)
+        restoreCursorPath(cursor);
+
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    while (1) {
+        Page* leaf = pagerGetReadPage(cursor->pagePath[cursor->depth]);
+        if (!pagerTryLockPage(leaf, cursor->versions[cursor->depth])) {
+            BtreeCursorMoveTo(cursor, cursor->key);
+            continue;
+        }
+        if (leaf->PageType != PAGER_PAGE_TYPE_LEAF) {
+            pagerReleaseWriteLocks(0);
+            return;
+        }
+        if (!isLeafOnlyInsert(cursor, leaf, key, value)) {
+            pagerReleaseWriteLocks(0);
+            break;
+        }
+        insertCell(cursor, cursor->depth, key, value, 1);
+        u64 sequence = logChange(WAL_RECORD_INSERT, key, value);
+        pagerReleaseWriteLocks(1);
+        walCommit(sequence);
+        return;
+    }
+
+    pthread_mutex_lock(&cursor->tree->structureModificationLock);
+    lockCursorPath(cursor, 0);
+    insertCell(cursor, cursor->depth, key, value, 1);
+    u64 sequence = logChange(WAL_RECORD_INSERT, key, value);
+    pagerReleaseWriteLocks(1);
+    pthread_mutex_unlock(&cursor->tree->structureModificationLock);
+    walCommit(sequence);
+    return;
+#endif
 
 #if 0
 	pthread_rwlock_wrlock(&tree->lock);
@@ -656,14 +2050,33 @@ void BtreeCursorInsertEntry(Btree *tree, Cursor* cursor, u64 key, u64 value) {
 
     pagerReleasePageLock(current);
 
+#if BTREE_TRACK_OPEN_CURSORS
+    // without a split only entries of the leaf move
+    saveOtherCursors(cursor, pageHasRoomForEntry(current, key, value), current->pageIndex);
+#endif
     insertCell(cursor, cursor->depth, key, value, 1);
+    // an exclusive write cursor keeps the tree locked until it's destroyed, so its commits can't be grouped
+    walCommit(logChange(WAL_RECORD_INSERT, key, value));
+#if BTREE_TRACK_OPEN_CURSORS
+    restoreOtherCursors(cursor);
+#endif
 
 #if 0
 	pthread_rwlock_unlock(&tree->lock);
 #endif
 }
 
-void removeCell(Cursor* cursor, const u8 depth, const u16 cellPointerIndex);
+// bytes the left page would take (header included) with entries of the right one appended
+u64 calculateMergedPageSize(const Page* left, const Page* right) {
+    u16 leftCount = left->nCellPointersCount;
+    u16 rightCount = right->nCellPointersCount;
+    if (left->PageFormat != PAGER_PAGE_FORMAT_PACKED || leftCount == 0 || rightCount == 0)
+        return PAGER_PAGE_HEADER_SIZE + calculatePageRelevantSize(left, 0) + calculatePageRelevantSize(right, 0);
+    // merged page is packed with one base, its deltas span both pages
+    u8 keyWidth = packedWidth(packedKey(right, rightCount - 1) - packedKey(left, 0));
+    u8 valueWidth = left->packedValueWidth > right->packedValueWidth ? left->packedValueWidth : right->packedValueWidth;
+    return PAGER_PAGE_HEADER_SIZE + sizeof(u64) + packedAreaSize(leftCount + rightCount, keyWidth, valueWidth);
+}
 u1 mergeNodes(Cursor* cursor, u8 depth, PageIndex parentCellLeftIndex, PageIndex parentCellRightIndex) {
     Page* parent = nullptr;
     if (depth > 0)
@@ -677,9 +2090,9 @@ u1 mergeNodes(Cursor* cursor, u8 depth, PageIndex parentCellLeftIndex, PageIndex
     TRACE_PAGE_DATA(left);
     TRACE_PAGE_DATA(right);
 
-    u64 leftRelevantSize = calculatePageRelevantSize(left, 0); // left->nCellPointersCount * sizeof(u16) + (left->nCellsCount - left->nFreeCellsCount) * sizeof(u8);
-    u64 rightRelevantSize = calculatePageRelevantSize(right, 0); //right->nCellPointersCount * sizeof(u16) + (right->nCellsCount - right->nFreeCellsCount) * sizeof(u8);
-    if (PAGER_PAGE_HEADER_SIZE + leftRelevantSize + rightRelevantSize >= PAGER_PAGE_BYTE_SIZE) {
+    u1 mergesMessages = left->PageType == PAGER_PAGE_TYPE_PARENT && cursor->tree->buffered;
+    if (calculateMergedPageSize(left, right) >= PAGER_PAGE_BYTE_SIZE
+        || (mergesMessages && messageCount(left) + messageCount(right) > PAGER_MESSAGE_PAGE_CAPACITY)) {
 		pagerReleasePageLock(right);
     	pagerReleasePageLock(left);
     	pagerReleasePageLock(parent);
@@ -688,6 +2101,7 @@ u1 mergeNodes(Cursor* cursor, u8 depth, PageIndex parentCellLeftIndex, PageIndex
     } else {
     	TRACE_MERGE(("mergeNodes: size checking returned true\n"));
     }
+    COUNT_EVENT(merges, 1);
 
     pagerGetWritePage(parentCellLeftIndex);
     pagerGetWritePage(parentCellRightIndex);
@@ -697,23 +2111,45 @@ u1 mergeNodes(Cursor* cursor, u8 depth, PageIndex parentCellLeftIndex, PageIndex
     vacuumCells(left);
     vacuumCells(right);
 
-    array_copy8(right->cells, left->cells, 0, left->nCellsTotalSize, right->nCellsTotalSize);
-    for (u16 i = 0; i < right->nCellPointersCount; ++i) {
-        left->cellPointers[left->nCellPointersCount + i] = right->cellPointers[i] + left->nCellsTotalSize;
+    u16 leftCount = left->nCellPointersCount;
+    if (left->PageFormat == PAGER_PAGE_FORMAT_FIXED) {
+        array_copy64(right->fixedKeys, left->fixedKeys, 0, left->nCellPointersCount, right->nCellPointersCount);
+        array_copy64(right->fixedValues, left->fixedValues, 0, left->nCellPointersCount, right->nCellPointersCount);
+    } else if (left->PageFormat == PAGER_PAGE_FORMAT_PACKED) {
+        u16 count = leftCount + right->nCellPointersCount;
+        u64 keys[count];
+        u64 values[count];
+        for (u16 i = 0; i < leftCount; ++i)
+            readEntry(left, i, keys + i, values + i);
+        for (u16 i = leftCount; i < count; ++i)
+            readEntry(right, i - leftCount, keys + i, values + i);
+        fillPackedPage(left, keys, values, count);
+    } else {
+        // right cells go right before the left ones
+        u16 rightCellsStart = PAGER_PAGE_CONTENT_SIZE - right->nCellsTotalSize;
+        array_copy8(right->cells, left->cells, rightCellsStart, rightCellsStart - left->nCellsTotalSize, right->nCellsTotalSize);
+        for (u16 i = 0; i < right->nCellPointersCount; ++i) {
+            left->cellPointers[left->nCellPointersCount + i] = right->cellPointers[i] - left->nCellsTotalSize;
+        }
     }
 
     // shift cursor to the left if necessary
     if(cursor->pagePath[depth] == right->pageIndex) {
         TRACE_MERGE(("mergeNodes: shifting cursor to the left (depth = %u)\n", depth));
         cursor->pagePath[depth] = left->pageIndex;
-        cursor->indices[depth] += left->nCellPointersCount;
+        cursor->indices[depth] += leftCount;
         --cursor->indices[depth - 1];
     }
 
-    left->nCellPointersCount = left->nCellPointersCount + right->nCellPointersCount;
+    left->nCellPointersCount = leftCount + right->nCellPointersCount;
     left->nCellsTotalSize = left->nCellsTotalSize + right->nCellsTotalSize;
 
-	pagerReleasePageLock(right);
+    if (right->PageType == PAGER_PAGE_TYPE_LEAF)
+        unlinkLeaf(right);
+    if (mergesMessages)
+        mergeMessages(left, right);
+
+    pagerReleasePageLock(right);
     pagerReleasePageLock(left);
     pagerReleasePageLock(parent);
     pagerFreePage(right->pageIndex);
@@ -724,7 +2160,15 @@ u1 mergeNodes(Cursor* cursor, u8 depth, PageIndex parentCellLeftIndex, PageIndex
 
     TRACE_PAGE_DATA(left);
 
-    readPayload(left->cells + left->cellPointers[left->nCellPointersCount - 1], &maxPageKey, &_);
+    // merged page of a buffered tree takes the separator of the right one (which isn't below its max key),
+    // merged empty leaves have no max key at all
+    if (cursor->tree->buffered) {
+        parent = pagerGetReadPage(cursor->pagePath[depth - 1]);
+        readEntry(parent, rightPageCellPointerIndex, &maxPageKey, &_);
+        pagerReleasePageLock(parent);
+    } else {
+        readEntry(left, left->nCellPointersCount - 1, &maxPageKey, &_);
+    }
     TRACE_MERGE(("mergeNodes: new page max key = %llu\n", maxPageKey));
     removeCell(cursor, depth - 1, rightPageCellPointerIndex);
     TRACE_MERGE(("mergeNodes: replacing key in parent\n"));
@@ -738,16 +2182,16 @@ void removeCell(Cursor* cursor, const u8 depth, const u16 cellPointerIndex) {
     TRACE_PAGE_DATA(page);
 
 #if BTREE_LOCK_GRANULARITY_PER_PAGE
-	pthread_rwlock_wrlock(&page->lock);
+	pthread_rwlock_wrlock(pagerGetPageLock(page));
 #endif
 
     u64 _;
     u64 keyForDelete;
 	TRACE_DELETE_CELL(("removeCell: looking for cell #%u on page %u (depth = %u)\n", cellPointerIndex, cursor->pagePath[depth], depth));
-    readPayload(page->cells + page->cellPointers[cellPointerIndex], &keyForDelete, &_);
+    readEntry(page, cellPointerIndex, &keyForDelete, &_);
 
     TRACE_DELETE_CELL(("removeCell: cleaning cell with found key %llu\n", keyForDelete));
-    cleanCell(page, cellPointerIndex, 1);
+    eraseEntry(page, cellPointerIndex);
     TRACE_PAGE_DATA(page);
 
     if (depth == 0) {
@@ -759,17 +2203,20 @@ void removeCell(Cursor* cursor, const u8 depth, const u16 cellPointerIndex) {
     u16 idxInParent = cursor->indices[depth - 1];
 
     u64 keyInParent;
-    readPayload(parent->cells + parent->cellPointers[idxInParent], &keyInParent, &_);
-    if (keyInParent == keyForDelete) {
+    readEntry(parent, idxInParent, &keyInParent, &_);
+    // buffered trees keep separators (see raiseKeyInParent) and empty pages, which merge with siblings below
+    if (keyInParent == keyForDelete && !cursor->tree->buffered) {
         if(page->nCellPointersCount == 0) {
             TRACE_DELETE_CELL(("removeCell: this was the last cell, clean parent\n"));
             removeCell(cursor, depth - 1, idxInParent);
+            if (page->PageType == PAGER_PAGE_TYPE_LEAF)
+                unlinkLeaf(page);
             pagerFreePage(page->pageIndex);
             return;
         } else {
             TRACE_DELETE_CELL(("removeCell: need to replace key in parent\n"));
             u64 newMaxKey;
-            readPayload(page->cells + page->cellPointers[page->nCellPointersCount - 1], &newMaxKey, &_);
+            readEntry(page, page->nCellPointersCount - 1, &newMaxKey, &_);
             // lesser key never takes more bytes than current, so we guarantee it'll fit into cell
             replaceKeyInParent(cursor, depth, newMaxKey);
             TRACE_DELETE_CELL(("removeCell: parent key replaced with %llu\n", newMaxKey));
@@ -785,12 +2232,12 @@ void removeCell(Cursor* cursor, const u8 depth, const u16 cellPointerIndex) {
     u64 siblingIndex;
     u1 merged = 0;
     if (idxInParent < parent->nCellPointersCount - 1) {
-        readPayload(parent->cells + parent->cellPointers[idxInParent + 1], &_, &siblingIndex);
+        readEntry(parent, idxInParent + 1, &_, &siblingIndex);
         TRACE_DELETE_CELL(("removeCell: initialized merge with the right node\n"));
         merged = mergeNodes(cursor, depth, page->pageIndex, siblingIndex);
     }
     if (!merged && idxInParent > 0) {
-        readPayload(parent->cells + parent->cellPointers[idxInParent - 1], &_, &siblingIndex);
+        readEntry(parent, idxInParent - 1, &_, &siblingIndex);
         TRACE_DELETE_CELL(("removeCell: initialized merge with the left node\n"));
         mergeNodes(cursor, depth, siblingIndex, page->pageIndex);
     }
@@ -798,6 +2245,62 @@ void removeCell(Cursor* cursor, const u8 depth, const u16 cellPointerIndex) {
     TRACE_DELETE_CELL(("removeCell: done, %u\n", depth));
 }
 u1 BtreeCursorRemoveEntry(Cursor* cursor) {
+    OperationLatency latency(BTREE_LATENCY_REMOVE);
+    PagerOperation operation;
+    if (cursor->tree->buffered) {
+        u64 key;
+        u64 _;
+        if (!cursor->write || BtreeCursorReadData(cursor, &key, &_) != 0)
+            return 0;
+        walCommit(writeMessage(cursor, key, 0, BTREE_MESSAGE_REMOVE));
+        return 1;
+    }
+    if (cursor->write && cursor->outdatedAncestors)
+        restoreCursorPath(cursor);
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    if (!cursor->write)
+        return 0;
+    while (1) {
+        Page* leaf = pagerGetWritePage(cursor->pagePath[cursor->depth]);
+        if (!pagerTryLockPage(leaf, cursor->versions[cursor->depth])) {
+            BtreeCursorMoveTo(cursor, cursor->key);
+            continue;
+        }
+        if (leaf->PageType != PAGER_PAGE_TYPE_LEAF || cursor->indices[cursor->depth] >= leaf->nCellPointersCount) {
+            pagerReleaseWriteLocks(0);
+            return 0;
+        }
+        if (!isLeafOnlyRemove(cursor, leaf)) {
+            pagerReleaseWriteLocks(0);
+            break;
+        }
+        u64 key;
+        u64 value;
+        readEntry(leaf, cursor->indices[cursor->depth], &key, &value);
+        eraseEntry(leaf, cursor->indices[cursor->depth]);
+        u64 sequence = logChange(WAL_RECORD_REMOVE, key, value);
+        pagerReleaseWriteLocks(1);
+        walCommit(sequence);
+        return 1;
+    }
+
+    pthread_mutex_lock(&cursor->tree->structureModificationLock);
+    lockCursorPath(cursor, 1);
+    Page* leaf = pagerGetReadPage(cursor->pagePath[cursor->depth]);
+    u1 removed = cursor->indices[cursor->depth] < leaf->nCellPointersCount;
+    u64 sequence = 0;
+    if (removed) {
+        u64 key;
+        u64 value;
+        readEntry(leaf, cursor->indices[cursor->depth], &key, &value);
+        removeCell(cursor, cursor->depth, cursor->indices[cursor->depth]);
+        sequence = logChange(WAL_RECORD_REMOVE, key, value);
+    }
+    pagerReleaseWriteLocks(1);
+    pthread_mutex_unlock(&cursor->tree->structureModificationLock);
+    walCommit(sequence);
+    return removed;
+#endif
     Page* page = pagerGetReadPage(cursor->pagePath[cursor->depth]);
 
     if (page->PageType != PAGER_PAGE_TYPE_LEAF || !cursor->write)
@@ -806,81 +2309,1099 @@ u1 BtreeCursorRemoveEntry(Cursor* cursor) {
     pagerReleasePageLock(page);
 
     u16 entryIndex = cursor->indices[cursor->depth];
+    // value tells the removed entry from other ones with the same key when the log is replayed
+    u64 key;
+    u64 value;
+    readEntry(page, entryIndex, &key, &value);
 
+#if BTREE_TRACK_OPEN_CURSORS
+    // removal may merge the leaf, any cursor can be affected
+    saveOtherCursors(cursor, 0, 0);
+#endif
     removeCell(cursor, cursor->depth, entryIndex);
+    walCommit(logChange(WAL_RECORD_REMOVE, key, value));
+#if BTREE_TRACK_OPEN_CURSORS
+    restoreOtherCursors(cursor);
+#endif
     return 1;
 }
 
-PageIndex createTreeCore(u64 *pKeys, u64 *pValues, u64 size, u1 isLeaf) {
-    Page* current = nullptr;
-    u64 totalPageSize = PAGER_PAGE_BYTE_SIZE;
+static void clearPageContent(Page* page) {
+    page->nCellPointersCount = 0;
+    page->nCellsTotalSize = 0;
+    page->firstFreeCellIndex = 0;
+    page->nFreeCellsTotalSize = 0;
+    page->packedKeyWidth = 0;
+    page->packedValueWidth = 0;
+}
+
+// first entry of the page with a key not below the given one, binarySearch may stop at any of equal keys
+static u16 lowerBoundEntry(Page* page, u64 key) {
+    u64 _;
+    u16 index;
+    binarySearch(page, key, &_, &index);
+    while (index > 0) {
+        u64 previous;
+        readEntry(page, index - 1, &previous, &_);
+        if (previous < key)
+            break;
+        --index;
+    }
+    return index;
+}
 
-    u16 pagesCount = 0;
+// first entry of the page with a key above the given one
+static u16 upperBoundEntry(Page* page, u64 key) {
+    return key == ~0ULL ? page->nCellPointersCount : lowerBoundEntry(page, key + 1);
+}
+
+// first (or last) leaf of the subtree
+static Page* edgeLeaf(PageIndex pageIndex, u1 last) {
+    Page* page = pagerGetReadPage(pageIndex);
+    while (page->PageType != PAGER_PAGE_TYPE_LEAF) {
+        u64 _;
+        u64 child;
+        readEntry(page, last ? page->nCellPointersCount - 1 : 0, &_, &child);
+        pagerReleasePageLock(page);
+        page = pagerGetReadPage(child);
+    }
+    pagerReleasePageLock(page);
+    return page;
+}
 
-    // assume all keys and values are 8-bytes long each, + 2 bytes for pointer + 3 bytes for header
-    // divide this value by page content size, rounding up
-    u64 pessimisticPageCount = (size * (sizeof(u64) * 2 + sizeof(u16) + 3) / (PAGER_PAGE_BYTE_SIZE - PAGER_PAGE_HEADER_SIZE)) + 2;
-    TRACE_CREATE_BTREE(("pessimisticPageCount %llu for data %llu\n", pessimisticPageCount, size));
+// frees every page of the subtree and returns the amount of its entries, which are logged as removed;
+// sequence is set to the one of the last record
+static u64 freeSubtree(Cursor* cursor, PageIndex pageIndex, u64* sequence) {
+    Page* page = pagerGetWritePage(pageIndex);
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    // readers which are still below the dropped child restart on the new version
+    pagerLockPage(page);
+#endif
+    u64 removed = 0;
+    if (page->PageType == PAGER_PAGE_TYPE_LEAF) {
+        removed = page->nCellPointersCount;
+        for (u16 i = 0; i < page->nCellPointersCount && walIsOpen(); ++i) {
+            u64 key;
+            u64 value;
+            readEntry(page, i, &key, &value);
+            *sequence = logChange(WAL_RECORD_REMOVE, key, value);
+        }
+    } else {
+        for (u16 i = 0; i < page->nCellPointersCount; ++i) {
+            u64 _;
+            u64 child;
+            readEntry(page, i, &_, &child);
+            removed += freeSubtree(cursor, child, sequence);
+        }
+        // message page of a buffered tree, emptied before the range is deleted
+        if (cursor->tree->buffered && page->prevLeafIndex != 0) {
+            Page* messages = pagerGetWritePage(page->prevLeafIndex - 1);
+            pagerReleasePageLock(messages);
+            pagerFreePage(messages->pageIndex);
+            pagerUnpinPage(messages);
+        }
+    }
+    pagerReleasePageLock(page);
+    // freed while still locked, so readers which see the page as free see its new version as well
+    pagerFreePage(pageIndex);
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    pagerReleaseWriteLock(page, 1);
+#endif
+    // subtrees can be far larger than the pool, freed pages don't stay pinned until the end of the operation
+    pagerUnpinPage(page);
+    return removed;
+}
 
-    u64 *pageKeys = new u64[pessimisticPageCount];
-    u64 *pageIndices = new u64[pessimisticPageCount];
+// frees the children [first, last) of the node at the depth with their subtrees
+static void dropChildren(Cursor* cursor, u8 depth, u16 first, u16 last, u64* removed, u64* sequence) {
+    Page* node = pagerGetWritePage(cursor->pagePath[depth]);
+    u64 _;
+    u64 firstChild;
+    u64 lastChild;
+    readEntry(node, first, &_, &firstChild);
+    readEntry(node, last - 1, &_, &lastChild);
+    pagerReleasePageLock(node);
+
+    // dropped leaves follow each other, their neighbours are linked together
+    PageIndex prevLeafIndex = edgeLeaf(firstChild, 0)->prevLeafIndex;
+    PageIndex nextLeafIndex = edgeLeaf(lastChild, 1)->nextLeafIndex;
+    if (prevLeafIndex != 0) {
+        Page* prev = pagerGetWritePage(prevLeafIndex - 1);
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+        pagerLockPage(prev);
+#endif
+        prev->nextLeafIndex = nextLeafIndex;
+        pagerReleasePageLock(prev);
+    }
+    if (nextLeafIndex != 0) {
+        Page* next = pagerGetWritePage(nextLeafIndex - 1);
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+        pagerLockPage(next);
+#endif
+        next->prevLeafIndex = prevLeafIndex;
+        pagerReleasePageLock(next);
+    }
 
-    for (u64 i = 0; i < size; ++i) {
-        u64 keySize = getValueByteSize(pKeys[i], 0);
-        u64 valueSize = getValueByteSize(pValues[i], 0);
-
-        u8 expectedCellSize = keySize + valueSize + 3;
-        if (expectedCellSize < MINIMAL_CELL_SIZE)
-            expectedCellSize = MINIMAL_CELL_SIZE;
-
-        totalPageSize += expectedCellSize + 2; // headers + cell pointer
-
-        if (totalPageSize >= PAGER_PAGE_BYTE_SIZE) {
-            TRACE_CREATE_BTREE(("allocating new Page %llu\n", totalPageSize));
-            current = pagerCreateNewPage(isLeaf ? PAGER_PAGE_TYPE_LEAF : PAGER_PAGE_TYPE_PARENT);
-            totalPageSize = PAGER_PAGE_HEADER_SIZE;
-            current->nCellsTotalSize = 0;
-            current->nCellPointersCount = 0;
-            current->nFreeCellsTotalSize = 0;
-            pageIndices[pagesCount++] = current->pageIndex;
+    for (u16 i = first; i < last; ++i) {
+        u64 child;
+        readEntry(node, i, &_, &child);
+        *removed += freeSubtree(cursor, child, sequence);
+    }
+    // cells of all but the last dropped child are erased at once, removeCell takes the last one: it updates the key
+    // of the node in its parent and merges the node with a sibling
+    for (u16 i = last - 1; i-- > first;)
+        eraseEntry(node, i);
+    removeCell(cursor, depth, first);
+}
+
+// one step of BtreeDeleteRange from the first entry not below lo: drops the children of the highest node on the
+// path whose keys are all in the range or, if there are none, removes the entries of the range from the leaf;
+// returns 0 once no entry of the range is left
+static u1 deleteRangeStep(Cursor* cursor, u64* lo, u64 hi, u64* removed, u64* sequence) {
+    PagerOperation operation;
+    u64 _;
+    cursor->key = *lo;
+    cursor->positioned = 1;
+    cursor->outdatedAncestors = 0;
+    cursor->messageKind = 0;
+    descendCursor(cursor, 0, *lo, &_);
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    // writers of a buffered tree exclude all other cursors
+    if (!cursor->tree->buffered)
+        lockCursorPath(cursor, 1);
+#endif
+
+    // keys of the children after the one the path goes through are above lo, they are all in the range
+    // up to the first child with a greater key than hi
+    for (u8 depth = 0; depth < cursor->depth; ++depth) {
+        Page* node = pagerGetReadPage(cursor->pagePath[depth]);
+        u16 first = cursor->indices[depth] + 1;
+        u16 last = first;
+        while (last < node->nCellPointersCount) {
+            u64 separator;
+            readEntry(node, last, &separator, &_);
+            if (separator > hi)
+                break;
+            ++last;
+        }
+        pagerReleasePageLock(node);
+        if (last == first)
+            continue;
+        dropChildren(cursor, depth, first, last, removed, sequence);
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+        pagerReleaseWriteLocks(1);
+#endif
+        return 1;
+    }
+
+    Page* leaf = pagerGetWritePage(cursor->pagePath[cursor->depth]);
+    u16 count = leaf->nCellPointersCount;
+    u16 from = lowerBoundEntry(leaf, *lo);
+    u16 to = upperBoundEntry(leaf, hi);
+    u1 more = to == count;
+    if (from < to) {
+        for (u16 i = from; i < to && walIsOpen(); ++i) {
+            u64 key;
+            u64 value;
+            readEntry(leaf, i, &key, &value);
+            *sequence = logChange(WAL_RECORD_REMOVE, key, value);
+        }
+        *removed += to - from;
+        // as for children, only the last entry goes through removeCell, which rebalances the leaf
+        for (u16 i = to - 1; i-- > from;)
+            eraseEntry(leaf, i);
+    }
+    pagerReleasePageLock(leaf);
+    if (from < to) {
+        removeCell(cursor, cursor->depth, from);
+    } else if (from == count) {
+        // separators of a buffered tree may be above the max key of their page: keys up to the smallest separator
+        // of the path belong to the leaf, which has none of them left
+        u1 bounded = 0;
+        u64 bound = 0;
+        for (u8 depth = 0; depth < cursor->depth; ++depth) {
+            Page* node = pagerGetReadPage(cursor->pagePath[depth]);
+            if (cursor->indices[depth] + 1 < node->nCellPointersCount) {
+                u64 separator;
+                readEntry(node, cursor->indices[depth], &separator, &_);
+                if (!bounded || separator < bound)
+                    bound = separator;
+                bounded = 1;
+            }
+            pagerReleasePageLock(node);
+        }
+        more = bounded && bound < hi;
+        if (more)
+            *lo = bound + 1;
+    }
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    pagerReleaseWriteLocks(from < to);
+#endif
+    return more;
+}
+
+// removeCell frees emptied pages up to the root, which stays in place and becomes an empty leaf
+static void resetEmptyRoot(Btree* tree) {
+    PagerOperation operation;
+    Page* root = pagerGetReadPage(tree->pRoot->pageIndex);
+    if (root->PageType != PAGER_PAGE_TYPE_PARENT || root->nCellPointersCount > 0) {
+        pagerReleasePageLock(root);
+        return;
+    }
+    pagerReleasePageLock(root);
+    root = pagerGetWritePage(root->pageIndex);
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    pagerLockPage(root);
+#endif
+    clearPageContent(root);
+    root->PageType = PAGER_PAGE_TYPE_LEAF;
+    root->prevLeafIndex = 0;
+    root->nextLeafIndex = 0;
+    pagerReleasePageLock(root);
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    pagerReleaseWriteLocks(1);
+#endif
+}
+
+u64 BtreeDeleteRange(Btree* tree, u64 lo, u64 hi) {
+    if (lo > hi)
+        return 0;
+    Cursor* cursor;
+    BtreeCreateCursor(tree, &cursor, 1);
+    u64 removed = 0;
+    u64 sequence = 0;
+    {
+        BufferedTreeLock lock(tree, 1);
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+        // the buffer lock of a buffered tree holds it already
+        if (!tree->buffered)
+            pthread_mutex_lock(&tree->structureModificationLock);
+#endif
+#if BTREE_TRACK_OPEN_CURSORS
+        saveOtherCursors(cursor, 0, 0);
+#endif
+        // pending messages would bring removed entries back, or go away with the dropped pages
+        if (tree->buffered)
+            drainAllMessages(cursor);
+        while (deleteRangeStep(cursor, &lo, hi, &removed, &sequence))
+            resetEmptyRoot(tree);
+        resetEmptyRoot(tree);
+#if BTREE_TRACK_OPEN_CURSORS
+        restoreOtherCursors(cursor);
+#endif
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+        if (!tree->buffered)
+            pthread_mutex_unlock(&tree->structureModificationLock);
+#endif
+    }
+    BtreeDestroyCursor(tree, cursor);
+    walCommit(sequence);
+    return removed;
+}
+
+u64 BtreeCountRange(Btree* tree, u64 lo, u64 hi) {
+    if (lo > hi)
+        return 0;
+    Cursor cursor;
+    BtreeInitCursor(tree, &cursor, 0);
+    u64 count = 0;
+    u1 descend = 1;
+    PageIndex leafIndex = 0;
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    u64 version = 0;
+#endif
+    while (1) {
+        PagerOperation operation;
+        BufferedTreeLock lock(tree, 0);
+        if (descend) {
+            u64 _;
+            descendCursor(&cursor, 0, lo, &_);
+            leafIndex = cursor.pagePath[cursor.depth];
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+            version = cursor.versions[cursor.depth];
+#endif
+        }
+        Page* leaf = pagerGetReadPage(leafIndex);
+        u16 entries = leaf->nCellPointersCount;
+        // later leaves have no key below lo, they are counted from their first entry
+        u16 first = descend ? lowerBoundEntry(leaf, lo) : 0;
+        u16 end = upperBoundEntry(leaf, hi);
+        PageIndex nextLeafIndex = leaf->nextLeafIndex;
+        u64 lastKey = 0;
+        u64 _;
+        if (entries > 0)
+            readEntry(leaf, entries - 1, &lastKey, &_);
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+        // version of the next leaf is taken while the link to it is still valid
+        u64 nextVersion = 0;
+        if (nextLeafIndex != 0)
+            nextVersion = pagerReadPageVersion(pagerGetReadPage(nextLeafIndex - 1));
+        if (!pagerValidatePageVersion(leaf, version)) {
+            descend = 1;
+            continue;
         }
+        version = nextVersion;
+#endif
+        pagerReleasePageLock(leaf);
+        if (end > first)
+            count += end - first;
+        if (end < entries || nextLeafIndex == 0 || lastKey == ~0ULL)
+            break;
+        // a restarted descent goes on after the counted keys
+        if (entries > 0)
+            lo = lastKey + 1;
+        descend = 0;
+        leafIndex = nextLeafIndex - 1;
+    }
+    BtreeReleaseCursor(&cursor);
+    return count;
+}
+
+// bytes of a page the bulk load fills, fillFactor is a percent of the page content
+static u64 bulkLoadPageBudget(u8 fillFactor) {
+    if (fillFactor == 0 || fillFactor > 100)
+        fillFactor = 100;
+    return PAGER_PAGE_HEADER_SIZE + PAGER_PAGE_CONTENT_SIZE * fillFactor / 100;
+}
+
+// bytes the entry takes in the page, including its cell pointer
+static u8 bulkLoadEntrySize(u64 key, u64 value, u8 pageFormat) {
+    if (pageFormat == PAGER_PAGE_FORMAT_FIXED)
+        return 2 * sizeof(u64);
+    u8 cellSize = getValueByteSize(key, 0) + getValueByteSize(value, 0) + 3;
+    if (cellSize < MINIMAL_CELL_SIZE)
+        cellSize = MINIMAL_CELL_SIZE;
+    return cellSize + 2;
+}
+
+// content bytes of entries appended to a page in ascending key order, as appendEntry lays them out
+struct PageFill {
+    u64 size;
+    u64 count;
+    u64 firstKey; // packed pages only
+    u8 valueWidth; // packed pages only
+};
+
+// content bytes the page would take with one more entry; entries of packed pages are widened to the widest one
+static u64 pageFillSizeWith(const PageFill* fill, u8 pageFormat, u64 key, u64 value) {
+    if (pageFormat != PAGER_PAGE_FORMAT_PACKED)
+        return fill->size + bulkLoadEntrySize(key, value, pageFormat);
+    u64 firstKey = fill->count > 0 ? fill->firstKey : key;
+    u8 valueWidth = packedWidth(value) > fill->valueWidth ? packedWidth(value) : fill->valueWidth;
+    return sizeof(u64) + packedAreaSize(fill->count + 1, packedWidth(key - firstKey), valueWidth);
+}
+
+static void pageFillAdd(PageFill* fill, u8 pageFormat, u64 key, u64 value) {
+    fill->size = pageFillSizeWith(fill, pageFormat, key, value);
+    if (fill->count == 0)
+        fill->firstKey = key;
+    if (packedWidth(value) > fill->valueWidth)
+        fill->valueWidth = packedWidth(value);
+    ++fill->count;
+}
+
+// appends the entry after all entries of the page, entrySize is the one given by bulkLoadEntrySize
+// (packed pages compute their own layout)
+static void appendEntry(Page* page, u64 key, u64 value, u8 entrySize) {
+    if (page->PageFormat == PAGER_PAGE_FORMAT_PACKED) {
+        u16 count = page->nCellPointersCount;
+        PackedLayout layout = packedLayoutWith(page, key, value);
+        if (count == 0 || layout.keyWidth != page->packedKeyWidth || layout.valueWidth != page->packedValueWidth)
+            repackPage(page, layout);
+        writePackedEntry(page, count, key, value);
+        ++page->nCellPointersCount;
+        return;
+    }
+    if (page->PageFormat == PAGER_PAGE_FORMAT_FIXED) {
+        page->fixedKeys[page->nCellPointersCount] = key;
+        page->fixedValues[page->nCellPointersCount] = value;
+        ++page->nCellPointersCount;
+        return;
+    }
+    u16 cellSize = entrySize - 2;
+    page->nCellsTotalSize += cellSize;
+    page->cellPointers[page->nCellPointersCount++] = PAGER_PAGE_CONTENT_SIZE - page->nCellsTotalSize;
+    writePayload(page->cells + PAGER_PAGE_CONTENT_SIZE - page->nCellsTotalSize, key, value, cellSize);
+}
+
+// packs sorted entries into the pages of one tree level and returns the amount of pages.
+// Pages are taken from the reserved range starting at *reservedPageIndex, or one by one from the pager if it's null.
+// Last key and index of every page go to pageKeys and pageIndices; if pageKeys is null pages are only counted.
+static u64 packTreeLevel(u64 *pKeys, u64 *pValues, u64 size, u1 isLeaf, u8 pageFormat, u64 pageBudget,
+                         PageIndex* reservedPageIndex, u64 *pageKeys, u64 *pageIndices) {
+    Page* current = nullptr;
+    PageFill fill = {};
+    u64 pagesCount = 0;
+    u8 pageType = isLeaf ? PAGER_PAGE_TYPE_LEAF : PAGER_PAGE_TYPE_PARENT;
 
-        current->cellPointers[current->nCellPointersCount++] = current->nCellsTotalSize;
-        u8 totalCellSize = writePayload(current->cells + current->nCellsTotalSize, pKeys[i], pValues[i], 0);
-        current->nCellsTotalSize += totalCellSize;
+    for (u64 i = 0; i < size; ++i) {
+        u8 expectedEntrySize = bulkLoadEntrySize(pKeys[i], pValues[i], pageFormat);
 
+        u1 newPage = pagesCount == 0
+            || PAGER_PAGE_HEADER_SIZE + pageFillSizeWith(&fill, pageFormat, pKeys[i], pValues[i]) >= pageBudget;
+        if (newPage) {
+            fill = {};
+            ++pagesCount;
+        }
+        pageFillAdd(&fill, pageFormat, pKeys[i], pValues[i]);
+        if (pageKeys == nullptr)
+            continue;
+
+        if (newPage) {
+            TRACE_CREATE_BTREE(("allocating new Page %llu\n", pagesCount));
+            Page* previous = current;
+            current = reservedPageIndex != nullptr
+                ? pagerCreateReservedPage((*reservedPageIndex)++, pageType, pageFormat)
+                : pagerCreateNewPage(pageType, pageFormat);
+            if (isLeaf && previous != nullptr) {
+                previous->nextLeafIndex = current->pageIndex + 1;
+                current->prevLeafIndex = previous->pageIndex + 1;
+            }
+            // previous page is complete, let the buffer pool write it out
+            if (previous != nullptr)
+                pagerUnpinPage(previous);
+            pageIndices[pagesCount - 1] = current->pageIndex;
+        }
+        appendEntry(current, pKeys[i], pValues[i], expectedEntrySize);
         pageKeys[pagesCount - 1] = pKeys[i];
     }
+    return pagesCount;
+}
+
+PageIndex createTreeCore(u64 *pKeys, u64 *pValues, u64 size, u1 isLeaf, u8 pageFormat, u64 pageBudget) {
+    u64 pagesCount = packTreeLevel(pKeys, pValues, size, isLeaf, pageFormat, pageBudget, nullptr, nullptr, nullptr);
+    TRACE_CREATE_BTREE(("pagesCount %llu for data %llu\n", pagesCount, size));
+
+    u64 *pageKeys = new u64[pagesCount];
+    u64 *pageIndices = new u64[pagesCount];
+    packTreeLevel(pKeys, pValues, size, isLeaf, pageFormat, pageBudget, nullptr, pageKeys, pageIndices);
+
+    PageIndex result = pageIndices[0];
     if (pagesCount > 1) {
-        TRACE_CREATE_BTREE(("creating new tree, pagesCount is %d\n", pagesCount));
-        return createTreeCore(pageKeys, pageIndices, pagesCount, 0);
+        TRACE_CREATE_BTREE(("creating new tree, pagesCount is %llu\n", pagesCount));
+        result = createTreeCore(pageKeys, pageIndices, pagesCount, 0, pageFormat, pageBudget);
     }
     delete [] pageKeys;
     delete [] pageIndices;
-    return current->pageIndex;
+    return result;
+}
+
+// slice of the sorted input packed into leaves by one bulk load thread
+struct BulkLoadPart {
+    u64 *pKeys;
+    u64 *pValues;
+    u64 size;
+    u8 pageFormat;
+    u64 pageBudget;
+    u64 pagesCount;
+    PageIndex firstPageIndex;
+    // slices of the leaf level arrays, the part writes pagesCount entries
+    u64 *pageKeys;
+    u64 *pageIndices;
+};
+
+static void* countBulkLoadPart(void* arg) {
+    BulkLoadPart* part = (BulkLoadPart*)arg;
+    part->pagesCount = packTreeLevel(part->pKeys, part->pValues, part->size, 1, part->pageFormat, part->pageBudget,
+                                     nullptr, nullptr, nullptr);
+    return nullptr;
 }
+
+static void* buildBulkLoadPart(void* arg) {
+    BulkLoadPart* part = (BulkLoadPart*)arg;
+    PagerOperation operation;
+    PageIndex pageIndex = part->firstPageIndex;
+    packTreeLevel(part->pKeys, part->pValues, part->size, 1, part->pageFormat, part->pageBudget,
+                  &pageIndex, part->pageKeys, part->pageIndices);
+    return nullptr;
+}
+
+static void runBulkLoadParts(BulkLoadPart* parts, u16 partsCount, void* (*job)(void*)) {
+    pthread_t* threads = new pthread_t[partsCount];
+    // the calling thread takes the first part itself
+    for (u16 i = 1; i < partsCount; ++i)
+        pthread_create(threads + i, nullptr, job, parts + i);
+    job(parts);
+    for (u16 i = 1; i < partsCount; ++i)
+        pthread_join(threads[i], nullptr);
+    delete [] threads;
+}
+
+// leaves are built by threadsCount threads, each packs its slice of the input into a page range reserved up front;
+// upper levels are small (a fraction of a percent of the leaves) and are built by the calling thread
+static PageIndex createTreeParallel(u64 *pKeys, u64 *pValues, u64 size, u8 pageFormat, u64 pageBudget, u16 threadsCount) {
+    BulkLoadPart* parts = new BulkLoadPart[threadsCount];
+    for (u16 i = 0; i < threadsCount; ++i) {
+        u64 from = size * i / threadsCount;
+        u64 to = size * (i + 1) / threadsCount;
+        parts[i] = { pKeys + from, pValues + from, to - from, pageFormat, pageBudget, 0, 0, nullptr, nullptr };
+    }
+    runBulkLoadParts(parts, threadsCount, countBulkLoadPart);
+
+    u64 leavesCount = 0;
+    for (u16 i = 0; i < threadsCount; ++i)
+        leavesCount += parts[i].pagesCount;
+    u64 *leafKeys = new u64[leavesCount];
+    u64 *leafIndices = new u64[leavesCount];
+    PageIndex firstPageIndex = pagerReservePages(leavesCount);
+    u64 leavesBefore = 0;
+    for (u16 i = 0; i < threadsCount; ++i) {
+        parts[i].firstPageIndex = firstPageIndex + leavesBefore;
+        parts[i].pageKeys = leafKeys + leavesBefore;
+        parts[i].pageIndices = leafIndices + leavesBefore;
+        leavesBefore += parts[i].pagesCount;
+    }
+    runBulkLoadParts(parts, threadsCount, buildBulkLoadPart);
+
+    // parts are adjacent in the reserved range, link the leaves on their borders
+    for (u16 i = 1; i < threadsCount; ++i) {
+        PageIndex leftIndex = parts[i].firstPageIndex - 1;
+        Page* left = pagerGetWritePage(leftIndex);
+        left->nextLeafIndex = leftIndex + 2;
+        pagerReleasePageLock(left);
+        Page* right = pagerGetWritePage(leftIndex + 1);
+        right->prevLeafIndex = leftIndex + 1;
+        pagerReleasePageLock(right);
+    }
+
+    PageIndex result = leafIndices[0];
+    if (leavesCount > 1)
+        result = createTreeCore(leafKeys, leafIndices, leavesCount, 0, pageFormat, pageBudget);
+    delete [] leafKeys;
+    delete [] leafIndices;
+    delete [] parts;
+    return result;
+}
+
 // builds tree from the array of given keys and values, keys must be ordered in ascending order
-Btree* BtreeCreateTree(u64 *pKeys, u64 *pValues, u64 size) {
-    PageIndex rootPageIdx = createTreeCore(pKeys, pValues, size, 1);
-    Btree* tree = new Btree;
-    tree->pRoot = pagerGetReadPage(rootPageIdx);
-    pagerReleasePageLock(tree->pRoot);
+Btree* BtreeCreateTree(u64 *pKeys, u64 *pValues, u64 size, u8 pageFormat, u8 fillFactor, u16 threadsCount,
+                       u1 buffered) {
+    PagerOperation operation;
+    u64 pageBudget = bulkLoadPageBudget(fillFactor);
+    if (threadsCount > size)
+        threadsCount = size;
+    PageIndex rootPageIdx;
+    if (size == 0) {
+        // an empty tree is a single empty leaf, as a tree whose entries were all removed
+        Page* root = pagerCreateNewPage(PAGER_PAGE_TYPE_LEAF, pageFormat);
+        rootPageIdx = root->pageIndex;
+        pagerUnpinPage(root);
+    } else {
+        rootPageIdx = threadsCount > 1
+            ? createTreeParallel(pKeys, pValues, size, pageFormat, pageBudget, threadsCount)
+            : createTreeCore(pKeys, pValues, size, 1, pageFormat, pageBudget);
+    }
     TRACE_CREATE_BTREE(("root page index %u\n", rootPageIdx));
+    // root never moves (splits keep it in place), so its index is enough to open the tree again
+    pagerSetRootPageIndex(rootPageIdx);
+    // bulk loaded tree has no messages yet, it is a valid buffered tree as well
+    return BtreeOpenTree(buffered);
+}
+// pending changes of an inner node on the path of BtreeInsertBatch, applied by a single rewrite of the node
+// once the batch moves past it; children are replaced by the pages they were rewritten into
+struct BatchNodeUpdate {
+    PageIndex pageIndex;
+    u16 positionInParent;
+    std::vector<u16> positions; // replaced children in ascending order
+    std::vector<u64> counts; // amount of entries replacing each of them
+    std::vector<u64> keys;
+    std::vector<u64> children;
+};
+
+static u1 entriesFitPage(const u64* keys, const u64* values, u64 count, u8 pageFormat) {
+    PageFill fill = {};
+    for (u64 i = 0; i < count && fill.size <= PAGER_PAGE_CONTENT_SIZE; ++i)
+        pageFillAdd(&fill, pageFormat, keys[i], values[i]);
+    return fill.size <= PAGER_PAGE_CONTENT_SIZE;
+}
+
+// lays out entries evenly over the page and as many new pages as needed, new leaves are linked after it;
+// last key and index of every page go to pageKeys and pageIndices (count entries each at most), returns page count
+static u64 distributeEntries(Page* page, const u64* keys, const u64* values, u64 count, u64* pageKeys, u64* pageIndices) {
+    u8 pageFormat = page->PageFormat;
+    u64 pagesNeeded;
+    u64 targetSize = 0;
+    u64 targetCount = 0;
+    if (pageFormat == PAGER_PAGE_FORMAT_PACKED) {
+        // size of a packed entry depends on the page it's in, so pages are balanced by the amount of entries
+        // after counting how many pages are needed when every one is filled up
+        PageFill fill = {};
+        pagesNeeded = 1;
+        for (u64 i = 0; i < count; ++i) {
+            if (fill.count > 0 && pageFillSizeWith(&fill, pageFormat, keys[i], values[i]) > PAGER_PAGE_CONTENT_SIZE) {
+                fill = {};
+                ++pagesNeeded;
+            }
+            pageFillAdd(&fill, pageFormat, keys[i], values[i]);
+        }
+        targetCount = (count + pagesNeeded - 1) / pagesNeeded;
+    } else {
+        u64 totalSize = 0;
+        for (u64 i = 0; i < count; ++i)
+            totalSize += bulkLoadEntrySize(keys[i], values[i], pageFormat);
+        pagesNeeded = (totalSize + PAGER_PAGE_CONTENT_SIZE - 1) / PAGER_PAGE_CONTENT_SIZE;
+        targetSize = (totalSize + pagesNeeded - 1) / pagesNeeded;
+    }
+
+    clearPageContent(page);
+    Page* current = page;
+    u64 pagesCount = 1;
+    PageFill fill = {};
+    for (u64 i = 0; i < count; ++i) {
+        u8 entrySize = bulkLoadEntrySize(keys[i], values[i], pageFormat);
+        u1 targetReached = pageFormat == PAGER_PAGE_FORMAT_PACKED ? fill.count >= targetCount : fill.size >= targetSize;
+        if (fill.count > 0
+            && (targetReached || pageFillSizeWith(&fill, pageFormat, keys[i], values[i]) > PAGER_PAGE_CONTENT_SIZE)) {
+            Page* next = pagerCreateNewPage(page->PageType, page->PageFormat);
+            if (page->PageType == PAGER_PAGE_TYPE_LEAF)
+                linkLeafAfter(current, next);
+            if (current != page)
+                pagerUnpinPage(current);
+            current = next;
+            fill = {};
+            pageIndices[pagesCount++] = current->pageIndex;
+        }
+        appendEntry(current, keys[i], values[i], entrySize);
+        pageFillAdd(&fill, pageFormat, keys[i], values[i]);
+        pageKeys[pagesCount - 1] = keys[i];
+    }
+    pageIndices[0] = page->pageIndex;
+    if (current != page)
+        pagerUnpinPage(current);
+    COUNT_EVENT(splits, pagesCount - 1);
+    return pagesCount;
+}
+
+// root stays in place: if entries don't fit, they go to new pages and the root becomes their parent,
+// as many times as needed
+static void rewriteRoot(Page* root, u8 pageType, u64* keys, u64* values, u64 count) {
+    u64* levelKeys = keys;
+    u64* levelValues = values;
+    while (!entriesFitPage(levelKeys, levelValues, count, root->PageFormat)) {
+        Page* first = pagerCreateNewPage(pageType, root->PageFormat);
+        u64* pageKeys = new u64[count];
+        u64* pageIndices = new u64[count];
+        count = distributeEntries(first, levelKeys, levelValues, count, pageKeys, pageIndices);
+        pagerUnpinPage(first);
+        if (levelKeys != keys) {
+            delete [] levelKeys;
+            delete [] levelValues;
+        }
+        levelKeys = pageKeys;
+        levelValues = pageIndices;
+        pageType = PAGER_PAGE_TYPE_PARENT;
+    }
+    clearPageContent(root);
+    root->PageType = pageType;
+    for (u64 i = 0; i < count; ++i)
+        appendEntry(root, levelKeys[i], levelValues[i], bulkLoadEntrySize(levelKeys[i], levelValues[i], root->PageFormat));
+    if (levelKeys != keys) {
+        delete [] levelKeys;
+        delete [] levelValues;
+    }
+}
+
+// writes the new content of the node at the depth, the parent (if any) learns about new pages and max key later
+static void rewriteBatchNode(BatchNodeUpdate* updates, u8 depth, u16 positionInParent, Page* node,
+                             u64* keys, u64* values, u64 count) {
+    if (depth == 0) {
+        rewriteRoot(node, node->PageType, keys, values, count);
+        return;
+    }
+    u64 _;
+    u64 prevMaxKey = 0;
+    if (node->nCellPointersCount > 0)
+        readEntry(node, node->nCellPointersCount - 1, &prevMaxKey, &_);
+
+    u64* pageKeys = new u64[count];
+    u64* pageIndices = new u64[count];
+    u64 pagesCount = distributeEntries(node, keys, values, count, pageKeys, pageIndices);
+    if (pagesCount > 1 || pageKeys[0] != prevMaxKey) {
+        BatchNodeUpdate* parent = updates + depth - 1;
+        parent->positions.push_back(positionInParent);
+        parent->counts.push_back(pagesCount);
+        parent->keys.insert(parent->keys.end(), pageKeys, pageKeys + pagesCount);
+        parent->children.insert(parent->children.end(), pageIndices, pageIndices + pagesCount);
+    }
+    delete [] pageKeys;
+    delete [] pageIndices;
+}
+
+// applies collected changes of the inner node at the depth
+static void flushBatchNode(BatchNodeUpdate* updates, u8 depth) {
+    BatchNodeUpdate* update = updates + depth;
+    Page* node = pagerGetWritePage(update->pageIndex);
+    u1 modified = !update->positions.empty();
+    if (modified) {
+        u16 oldCount = node->nCellPointersCount;
+        u64 count = oldCount + update->keys.size() - update->positions.size();
+        u64* keys = new u64[count];
+        u64* children = new u64[count];
+        u64 entry = 0;
+        u64 replacement = 0;
+        u64 replacementEntry = 0;
+        for (u16 i = 0; i < oldCount; ++i) {
+            if (replacement < update->positions.size() && update->positions[replacement] == i) {
+                for (u64 j = 0; j < update->counts[replacement]; ++j, ++entry, ++replacementEntry) {
+                    keys[entry] = update->keys[replacementEntry];
+                    children[entry] = update->children[replacementEntry];
+                }
+                ++replacement;
+                continue;
+            }
+            readEntry(node, i, keys + entry, children + entry);
+            ++entry;
+        }
+        rewriteBatchNode(updates, depth, update->positionInParent, node, keys, children, count);
+        delete [] keys;
+        delete [] children;
+    }
+    pagerReleasePageLock(node);
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    pagerReleaseWriteLock(node, modified);
+#endif
+    update->positions.clear();
+    update->counts.clear();
+    update->keys.clear();
+    update->children.clear();
+}
+
+// descends without versions: inner pages change only under the structureModificationLock of the tree held by the batch
+static void descendForBatch(Cursor* cursor, u64 key) {
+    cursor->depth = 0;
+    Page* page = pagerGetReadPage(cursor->pRoot->pageIndex);
+    while (page->PageType != PAGER_PAGE_TYPE_LEAF) {
+        u64 child;
+        u16 index;
+        binarySearch(page, key, &child, &index);
+        if (index >= page->nCellPointersCount)
+            index = page->nCellPointersCount - 1;
+        cursor->pagePath[cursor->depth] = page->pageIndex;
+        cursor->indices[cursor->depth++] = index;
+        pagerReleasePageLock(page);
+        page = pagerGetReadPage(child);
+    }
+    cursor->pagePath[cursor->depth] = page->pageIndex;
+    pagerReleasePageLock(page);
+}
+
+// merges sorted entries into the leaf the cursor is at, all keys must belong to it; returns the amount of new entries.
+// Changes are logged while the leaf is locked, sequence is set to the one of the last record if there is a log
+static u64 insertLeafRun(Cursor* cursor, BatchNodeUpdate* updates, const u64* keys, const u64* values, u64 count, u1 upsert,
+                         u64* sequence) {
+    Page* leaf = pagerGetWritePage(cursor->pagePath[cursor->depth]);
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    pagerLockPage(leaf);
+    // new pages are linked in front of the next leaf
+    Page* next = leaf->nextLeafIndex != 0 ? pagerGetReadPage(leaf->nextLeafIndex - 1) : nullptr;
+    if (next != nullptr)
+        pagerLockPage(next);
+#endif
+    u16 oldCount = leaf->nCellPointersCount;
+    u64* mergedKeys = new u64[oldCount + count];
+    u64* mergedValues = new u64[oldCount + count];
+    u64 merged = 0;
+    u64 inserted = 0;
+    u16 old = 0;
+    u64 oldKey;
+    u64 oldValue;
+    if (oldCount > 0)
+        readEntry(leaf, 0, &oldKey, &oldValue);
+    for (u64 i = 0; i < count; ++i) {
+        // as in BtreeCursorInsertEntry, new entry goes before existing equal keys
+        while (old < oldCount && oldKey < keys[i]) {
+            mergedKeys[merged] = oldKey;
+            mergedValues[merged++] = oldValue;
+            if (++old < oldCount)
+                readEntry(leaf, old, &oldKey, &oldValue);
+        }
+        // replaced entries are logged as removes of their values, which tell them from other entries of the key
+        if (upsert) {
+            if (merged > 0 && mergedKeys[merged - 1] == keys[i] && i > 0 && keys[i - 1] == keys[i]) {
+                // repeated key of the batch, the last value wins
+                logChange(WAL_RECORD_REMOVE, keys[i], mergedValues[merged - 1]);
+                *sequence = logChange(WAL_RECORD_INSERT, keys[i], values[i]);
+                mergedValues[merged - 1] = values[i];
+                continue;
+            }
+            if (old < oldCount && oldKey == keys[i]) {
+                logChange(WAL_RECORD_REMOVE, keys[i], oldValue);
+                *sequence = logChange(WAL_RECORD_INSERT, keys[i], values[i]);
+                mergedKeys[merged] = keys[i];
+                mergedValues[merged++] = values[i];
+                if (++old < oldCount)
+                    readEntry(leaf, old, &oldKey, &oldValue);
+                continue;
+            }
+        }
+        *sequence = logChange(WAL_RECORD_INSERT, keys[i], values[i]);
+        mergedKeys[merged] = keys[i];
+        mergedValues[merged++] = values[i];
+        ++inserted;
+    }
+    for (; old < oldCount; ++old) {
+        readEntry(leaf, old, mergedKeys + merged, mergedValues + merged);
+        ++merged;
+    }
+
+    u16 positionInParent = cursor->depth > 0 ? cursor->indices[cursor->depth - 1] : 0;
+    rewriteBatchNode(updates, cursor->depth, positionInParent, leaf, mergedKeys, mergedValues, merged);
+    delete [] mergedKeys;
+    delete [] mergedValues;
+
+    pagerReleasePageLock(leaf);
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    // the leaf stays unreachable for keys moved to new pages until the locked parent is rewritten
+    pagerReleaseWriteLock(leaf, 1);
+    if (next != nullptr)
+        pagerReleaseWriteLock(next, 1);
+#endif
+    return inserted;
+}
+
+u64 BtreeInsertBatch(Btree* tree, const u64* keys, const u64* values, u64 n, u1 upsert) {
+    // no operation around the whole batch, pins are released after every run
+    Cursor* cursor;
+    BtreeCreateCursor(tree, &cursor, 1);
+    if (tree->buffered) {
+        // rewrites would drop messages of the rewritten nodes, entries are queued one by one instead
+        // (and reach the leaves in batches anyway); upsert queues the removal of the existing entry first
+        u64 inserted = 0;
+        u64 sequence = 0;
+        for (u64 i = 0; i < n; ++i) {
+            PagerOperation operation;
+            u1 exists = 0;
+            if (upsert) {
+                BtreeCursorMoveTo(cursor, keys[i]);
+                u64 key;
+                u64 _;
+                exists = BtreeCursorReadData(cursor, &key, &_) == 0 && key == keys[i];
+            }
+            if (exists)
+                writeMessage(cursor, keys[i], 0, BTREE_MESSAGE_REMOVE);
+            else
+                ++inserted;
+            sequence = writeMessage(cursor, keys[i], values[i], BTREE_MESSAGE_INSERT);
+        }
+        BtreeDestroyCursor(tree, cursor);
+        // the whole batch is committed at once
+        walCommit(sequence);
+        return inserted;
+    }
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    pthread_mutex_lock(&tree->structureModificationLock);
+#endif
+#if BTREE_TRACK_OPEN_CURSORS
+    saveOtherCursors(cursor, 0, 0);
+#endif
+
+    BatchNodeUpdate updates[PAGER_MAX_TREE_DEPTH];
+    u8 updatesDepth = 0;
+    u64 inserted = 0;
+    u64 sequence = 0;
+    for (u64 from = 0; from < n;) {
+        // pins of the run are released at its end, rewritten pages are unpinned as soon as they are written
+        PagerOperation runOperation;
+        descendForBatch(cursor, keys[from]);
+
+        // nodes left behind won't get any more changes
+        u8 same = 0;
+        while (same < updatesDepth && same < cursor->depth && updates[same].pageIndex == cursor->pagePath[same])
+            ++same;
+        for (u8 depth = updatesDepth; depth > same; --depth)
+            flushBatchNode(updates, depth - 1);
+        for (u8 depth = same; depth < cursor->depth; ++depth) {
+            updates[depth].pageIndex = cursor->pagePath[depth];
+            updates[depth].positionInParent = depth > 0 ? cursor->indices[depth - 1] : 0;
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+            // readers wait here until the node and everything below it are consistent again
+            pagerLockPage(pagerGetReadPage(cursor->pagePath[depth]));
+#endif
+        }
+        updatesDepth = cursor->depth;
+
+        // keys up to the smallest separator of the path belong to the leaf
+        u1 bounded = 0;
+        u64 bound = 0;
+        for (u8 depth = 0; depth < cursor->depth; ++depth) {
+            Page* page = pagerGetReadPage(cursor->pagePath[depth]);
+            if (cursor->indices[depth] + 1 < page->nCellPointersCount) {
+                u64 separator;
+                u64 _;
+                readEntry(page, cursor->indices[depth], &separator, &_);
+                if (!bounded || separator < bound)
+                    bound = separator;
+                bounded = 1;
+            }
+            pagerReleasePageLock(page);
+        }
+        u64 to = from + 1;
+        while (to < n && (!bounded || keys[to] <= bound))
+            ++to;
+
+        inserted += insertLeafRun(cursor, updates, keys + from, values + from, to - from, upsert, &sequence);
+        from = to;
+    }
+    for (u8 depth = updatesDepth; depth > 0; --depth) {
+        PagerOperation flushOperation;
+        flushBatchNode(updates, depth - 1);
+    }
+
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    pthread_mutex_unlock(&tree->structureModificationLock);
+#endif
+#if BTREE_TRACK_OPEN_CURSORS
+    restoreOtherCursors(cursor);
+#endif
+    BtreeDestroyCursor(tree, cursor);
+    walCommit(sequence);
+    return inserted;
+}
+
+Btree* BtreeOpenTree(u1 buffered) {
+    PageIndex rootPageIdx;
+    if (!pagerGetRootPageIndex(&rootPageIdx))
+        return nullptr;
+    Btree* tree = new Btree;
+    // cursors keep the root by pointer, so it stays in the buffer pool
+    tree->pRoot = pagerPinPage(rootPageIdx);
+    tree->firstCursor = nullptr;
 
 #if BTREE_LOCK_GRANULARITY_EXCLUSIVE
     pthread_rwlock_init(&tree->lock, nullptr);
 #endif
+    tree->buffered = buffered;
+#if BTREE_LOCK_GRANULARITY_PER_PAGE || BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    pthread_rwlock_init(&tree->bufferLock, nullptr);
+#endif
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    pthread_mutex_init(&tree->structureModificationLock, nullptr);
+#endif
 
     return tree;
 }
 
+void collectStats(PageIndex pageIndex, u8 depth, BtreeStats* stats) {
+    Page* page = pagerGetReadPage(pageIndex);
+    if (depth + 1 > stats->depth)
+        stats->depth = depth + 1;
+    stats->usedBytes += calculatePageRelevantSize(page, 1);
+    if (page->PageType == PAGER_PAGE_TYPE_LEAF) {
+        ++stats->leafPages;
+        stats->entries += page->nCellPointersCount;
+    } else {
+        ++stats->innerPages;
+        if (page->prevLeafIndex != 0) {
+            u16 messages = messageCount(page);
+            stats->messages += messages;
+            stats->usedBytes += PAGER_PAGE_HEADER_SIZE + messages * (sizeof(u64) * 2 + sizeof(u8));
+        }
+        for (u16 i = 0; i < page->nCellPointersCount; ++i) {
+            u64 _;
+            u64 child;
+            readEntry(page, i, &_, &child);
+            collectStats(child, depth + 1, stats);
+        }
+    }
+    pagerReleasePageLock(page);
+    pagerUnpinPage(page);
+}
+void BtreeGetThreadEvents(BtreeEvents* events) {
+#if ENABLE_EVENT_COUNTERS
+    *events = threadEvents;
+#else
+    *events = {};
+#endif
+}
+
+void BtreeRecordLatencies(u1 record) {
+#if ENABLE_LATENCY_HISTOGRAMS
+    RecordLatencies.store(record, std::memory_order_relaxed);
+#endif
+}
+
+void BtreeResetLatencies() {
+#if ENABLE_LATENCY_HISTOGRAMS
+    for (u32 i = 0; i < BTREE_MAX_LATENCY_THREADS; ++i) {
+        LatencySlot* slot = LatencySlots[i].load(std::memory_order_acquire);
+        if (slot == nullptr)
+            break;
+        for (u8 structural = 0; structural < 2; ++structural) {
+            for (u8 operation = 0; operation < BTREE_LATENCY_OPERATIONS; ++operation) {
+                for (u16 bucket = 0; bucket < BTREE_LATENCY_BUCKETS; ++bucket)
+                    slot->counts[structural][operation][bucket].store(0, std::memory_order_relaxed);
+                slot->max[structural][operation].store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+#endif
+}
+
+void BtreeCollectLatencies(BtreeLatencies* latencies) {
+    memset(latencies, 0, sizeof(*latencies));
+#if ENABLE_LATENCY_HISTOGRAMS
+    for (u32 i = 0; i < BTREE_MAX_LATENCY_THREADS; ++i) {
+        LatencySlot* slot = LatencySlots[i].load(std::memory_order_acquire);
+        if (slot == nullptr)
+            break;
+        for (u8 structural = 0; structural < 2; ++structural) {
+            for (u8 operation = 0; operation < BTREE_LATENCY_OPERATIONS; ++operation) {
+                BtreeLatencyHistogram* histogram = &latencies->histograms[structural][operation];
+                for (u16 bucket = 0; bucket < BTREE_LATENCY_BUCKETS; ++bucket) {
+                    u64 count = slot->counts[structural][operation][bucket].load(std::memory_order_relaxed);
+                    histogram->counts[bucket] += count;
+                    histogram->total += count;
+                }
+                u64 max = slot->max[structural][operation].load(std::memory_order_relaxed);
+                histogram->max = std::max(histogram->max, max);
+            }
+        }
+    }
+#endif
+}
+
+// 16 buckets per power of two, so a bucket spans at most 1/16 of its values; values below 16 get a bucket each
+u16 BtreeLatencyBucket(u64 nanoseconds) {
+    if (nanoseconds < 16)
+        return nanoseconds;
+    u8 exponent = 63 - __builtin_clzll(nanoseconds);
+    return (exponent - 3) * 16 + ((nanoseconds >> (exponent - 4)) & 15);
+}
+
+u64 BtreeLatencyPercentile(const BtreeLatencyHistogram* histogram, double percentile) {
+    if (histogram->total == 0)
+        return 0;
+    u64 rank = (u64)(histogram->total * percentile / 100);
+    if (rank >= histogram->total)
+        rank = histogram->total - 1;
+    u64 seen = 0;
+    for (u16 bucket = 0; bucket < BTREE_LATENCY_BUCKETS; ++bucket) {
+        seen += histogram->counts[bucket];
+        if (seen <= rank)
+            continue;
+        if (bucket < 16)
+            return bucket;
+        // highest value of the bucket, but never above the largest one recorded
+        u8 exponent = bucket / 16 + 3;
+        u64 highest = ((16ULL + bucket % 16 + 1) << (exponent - 4)) - 1;
+        return std::min(highest, histogram->max);
+    }
+    return histogram->max;
+}
+
+void BtreeCollectStats(Btree* tree, BtreeStats* stats) {
+    PagerOperation operation;
+    *stats = {};
+    collectStats(tree->pRoot->pageIndex, 0, stats);
+}
 void BtreePrint(Page* root) {
+    PagerOperation operation;
 #if ENABLE_PRINT
     printf("[ ");
     u64 key;
     u64 value;
     for (u16 i = 0; i < root->nCellPointersCount; ++i) {
-        readPayload(root->cells + root->cellPointers[i], &key, &value);
+        readEntry(root, i, &key, &value);
         if (root->PageType == PAGER_PAGE_TYPE_LEAF) {
             printf("(%llu, %llu) ", key, value);
         } else {
@@ -888,6 +3409,7 @@ void BtreePrint(Page* root) {
             Page* child = pagerGetReadPage(value);
             BtreePrint(child);
             pagerReleasePageLock(child);
+            pagerUnpinPage(child);
             printf(" ");
         }
     }
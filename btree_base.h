@@ -11,7 +11,20 @@
 #define CURSOR_MOVE_STATUS_FOUND 1
 #define CURSOR_MOVE_STATUS_MISSED 2
 
+// cursors BtreeDestroyCursor keeps per thread for the next BtreeCreateCursor
+#define BTREE_CURSOR_CACHE_SIZE 4
+
+// without lock granularity several cursors of a tree can only be open in one thread, so only then the tree
+// keeps the list of open cursors and repositions them after a write through another cursor
+#define BTREE_TRACK_OPEN_CURSORS (!BTREE_LOCK_GRANULARITY_EXCLUSIVE && !BTREE_LOCK_GRANULARITY_PER_PAGE \
+                                  && !BTREE_LOCK_GRANULARITY_OPTIMISTIC)
+
+// kinds of pending changes kept by inner pages of a write buffered tree
+#define BTREE_MESSAGE_INSERT 1
+#define BTREE_MESSAGE_REMOVE 2
+
 struct Cursor {
+    struct Btree* tree;
     Page* pRoot;
     // array of page indices
     PageIndex pagePath[PAGER_MAX_TREE_DEPTH];
@@ -19,6 +32,33 @@ struct Cursor {
     u16 indices[PAGER_MAX_TREE_DEPTH];
     u8 depth;
     u1 write;
+    // cursor moved through leaf links, so pagePath holds only the actual leaf
+    u1 outdatedAncestors;
+    // cursor was moved since BtreeInitCursor or BtreeResetCursor
+    u1 positioned;
+#if BTREE_LOCK_GRANULARITY_EXCLUSIVE
+    // pager snapshot a snapshot cursor reads instead of holding the tree lock, 0 for other cursors
+    u64 snapshot;
+#endif
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    // versions of pages in pagePath observed during the last descent
+    u64 versions[PAGER_MAX_TREE_DEPTH];
+#endif
+    // key of the last BtreeCursorMoveTo call, used to restart the descent;
+    // with optimistic locking stepping to another entry sets it to the key of that entry
+    u64 key;
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    // key is the one of the entry the cursor is at: it was stepped to or found by BtreeCursorMoveTo
+    u1 keyFound;
+#endif
+    // newest pending message for the key met on the way down a buffered tree, 0 if there was none
+    u8 messageKind;
+    u64 messageValue;
+#if BTREE_TRACK_OPEN_CURSORS
+    // entry was saved before a write through another cursor, the cursor moves back to it after the write
+    u1 requiresSeek;
+#endif
+    // next open cursor of the tree, or next cached cursor of the thread
     struct Cursor* nextCursor;
 };
 typedef struct Cursor Cursor;
@@ -28,19 +68,129 @@ struct Btree {
     Cursor* firstCursor;
 #if BTREE_LOCK_GRANULARITY_EXCLUSIVE
     pthread_rwlock_t lock;
+#endif
+    // inner pages keep pending inserts and removes in message pages, which are flushed to children in batches
+    u1 buffered;
+#if BTREE_LOCK_GRANULARITY_PER_PAGE || BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    // messages of a buffered tree move between pages on every write, its writers exclude all other cursors
+    pthread_rwlock_t bufferLock;
+#endif
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    // writers changing more than a single leaf are serialized,
+    // so they can wait for page locks held by leaf-only writers without deadlocks
+    pthread_mutex_t structureModificationLock;
 #endif
 };
 typedef struct Btree Btree;
 
+struct BtreeStats {
+    u64 leafPages;
+    u64 innerPages;
+    u64 entries;
+    // page headers and live cells (or fixed slots), free space excluded
+    u64 usedBytes;
+    // pending inserts and removes of a buffered tree
+    u64 messages;
+    u8 depth;
+};
+typedef struct BtreeStats BtreeStats;
+
+// structure changes made by the calling thread in all trees, counted from the start of the thread
+struct BtreeEvents {
+    u64 splits; // pages split by inserts, pages added by batch inserts included
+    u64 merges;
+    u64 vacuums; // compactions of the cells of a page which moved out its free cells
+    u64 freeCellReuses; // inserted cells placed into a free cell of a removed one
+};
+typedef struct BtreeEvents BtreeEvents;
+
+// timed cursor operations
+#define BTREE_LATENCY_MOVE_TO 0
+#define BTREE_LATENCY_INSERT 1
+#define BTREE_LATENCY_REMOVE 2
+#define BTREE_LATENCY_OPERATIONS 3
+// log-linear buckets of nanoseconds, a bucket spans at most 1/16 of its values
+#define BTREE_LATENCY_BUCKETS 976
+
+struct BtreeLatencyHistogram {
+    u64 counts[BTREE_LATENCY_BUCKETS];
+    u64 total;
+    u64 max; // exact, in nanoseconds
+};
+typedef struct BtreeLatencyHistogram BtreeLatencyHistogram;
+
+struct BtreeLatencies {
+    // [0] - operations which changed at most a leaf, [1] - ones which split or merged pages
+    BtreeLatencyHistogram histograms[2][BTREE_LATENCY_OPERATIONS];
+};
+typedef struct BtreeLatencies BtreeLatencies;
+
+// takes a cursor from the thread cache (allocating only if it is empty), BtreeDestroyCursor puts it back
 void BtreeCreateCursor(Btree* tree, Cursor** cursor, u1 write, u64 dbgI = 0);
 void BtreeDestroyCursor(Btree* tree, Cursor* cursor, u64 dbgI = 0);
+// opens a caller owned cursor (e.g. on the stack) in place, BtreeReleaseCursor closes it without freeing
+void BtreeInitCursor(Btree* tree, Cursor* cursor, u1 write, u64 dbgI = 0);
+void BtreeReleaseCursor(Cursor* cursor, u64 dbgI = 0);
+// read cursors which see the tree as it was when they were opened, without keeping writers waiting; under exclusive
+// locking writers copy the pages they change meanwhile (in-memory pager only, with a page file the cursor holds the
+// read lock as any other). Other lock modes open a plain read cursor, their readers don't block writers for a scan
+void BtreeCreateSnapshotCursor(Btree* tree, Cursor** cursor);
+void BtreeInitSnapshotCursor(Btree* tree, Cursor* cursor);
+// closes the open cursor and opens it again for the given tree and mode
+void BtreeRebindCursor(Btree* tree, Cursor* cursor, u1 write, u64 dbgI = 0);
+// forgets the position, the cursor stays open
+void BtreeResetCursor(Cursor* cursor);
+// in a buffered tree the cursor also remembers the newest pending message for the key, BtreeCursorReadData returns it
 u8 BtreeCursorMoveTo(Cursor* cursor, u64 key);
+// scans of a buffered tree see only the leaves, BtreeFlushMessages applies pending messages beforehand
 void BtreeCursorFirstLeaf(Cursor* cursor);
 u1 BtreeCursorNextEntry(Cursor* cursor);
+u1 BtreeCursorPrevEntry(Cursor* cursor);
 u1 BtreeCursorReadData(const Cursor* cursor, u64 *key, u64 *value);
-Btree *BtreeCreateTree(u64 *pKeys, u64 *pValues, u64 size);
+// looks up n keys at once, sets found[i] and (for found keys) values[i], returns the amount of found keys;
+// random batches descend in interleaved groups, sorted batches reuse the path of the previous key
+u64 BtreeMultiGet(Btree* tree, const u64* keys, u64 n, u64* values, u1* found);
+// pageFormat is one of PAGER_PAGE_FORMAT_*, all pages of the tree share it;
+// fillFactor is the percent of every page filled, the rest is left for inserts;
+// threadsCount > 1 packs the leaves in parallel into a freshly reserved page range (free pages aren't reused);
+// buffered trees (B-epsilon trees) queue writes in message pages of inner pages and apply them to leaves in batches;
+// with size 0 the tree is a single empty leaf
+Btree *BtreeCreateTree(u64 *pKeys, u64 *pValues, u64 size, u8 pageFormat = PAGER_PAGE_FORMAT_CELLS,
+                       u8 fillFactor = 100, u16 threadsCount = 1, u1 buffered = 0);
+// opens the tree whose root is stored by the pager (BtreeCreateTree stores it), nullptr if there is none;
+// a tree created as buffered has to be opened as buffered
+Btree *BtreeOpenTree(u1 buffered = 0);
+// in a buffered tree the entry goes to the root message page and the cursor loses its position
 void BtreeCursorInsertEntry(Btree *tree, Cursor* cursor, u64 key, u64 value);
+// inserts n entries with keys in ascending order, every leaf and inner page is rewritten once per batch
+// (split into as many pages as needed); with upsert existing keys get the new value instead of a duplicate.
+// Returns the amount of new entries
+u64 BtreeInsertBatch(Btree* tree, const u64* keys, const u64* values, u64 n, u1 upsert = 0);
+// in a buffered tree queues the removal of the key BtreeCursorReadData returns, an entry with the key is removed
+// (if there still is one) when the message reaches the leaf
 u1 BtreeCursorRemoveEntry(Cursor *cursor);
+// removes all entries with keys in [lo, hi] and returns their amount; children of inner pages with all keys in the
+// range go back to the pager with their subtrees at once, only pages at the bounds of the range are rebalanced.
+// A buffered tree applies its pending messages first
+u64 BtreeDeleteRange(Btree* tree, u64 lo, u64 hi);
+// amount of entries with keys in [lo, hi]; leaves inside the range are counted by their headers. As scans,
+// it sees only the leaves of a buffered tree
+u64 BtreeCountRange(Btree* tree, u64 lo, u64 hi);
+// applies all pending messages of a buffered tree to the leaves
+void BtreeFlushMessages(Btree* tree);
 void BtreePrint(Page *root);
+// walks the whole tree, must not run concurrently with writers
+void BtreeCollectStats(Btree* tree, BtreeStats* stats);
+void BtreeGetThreadEvents(BtreeEvents* events);
+// latencies of BtreeCursorMoveTo, BtreeCursorInsertEntry and BtreeCursorRemoveEntry of all threads go to per-thread
+// histograms while recording is on (it's off by default and costs two clock reads per operation)
+void BtreeRecordLatencies(u1 record);
+// must not run concurrently with recorded operations
+void BtreeResetLatencies();
+void BtreeCollectLatencies(BtreeLatencies* latencies);
+// bucket of the latency, for histograms of other operations
+u16 BtreeLatencyBucket(u64 nanoseconds);
+// latency in nanoseconds below which percentile percent of the histogram lies, rounded up to its bucket
+u64 BtreeLatencyPercentile(const BtreeLatencyHistogram* histogram, double percentile);
 
 #endif //BTREE_BASE_H
@@ -8,4 +8,7 @@
 
 #g++ -std=c++17 runner.o lock_full_btree.o pager.o utils.o ../benchmark/libbenchmark.a ../benchmark/libbenchmark_main.a -o runner
 
-g++ -std=c++17 runner.cpp utils.cpp pager.cpp btree_base.cpp ../benchmark/libbenchmark.a ../benchmark/libbenchmark_main.a -o runner
\ No newline at end of file
+g++ -std=c++17 runner.cpp utils.cpp pager.cpp btree_base.cpp wal.cpp perf.cpp numa.cpp sharded_btree.cpp ../benchmark/libbenchmark.a ../benchmark/libbenchmark_main.a -o runner
+# lock granularity is selected at build time: BTREE_LOCK_GRANULARITY_EXCLUSIVE, BTREE_LOCK_GRANULARITY_PER_PAGE
+# or BTREE_LOCK_GRANULARITY_OPTIMISTIC (optimistic lock coupling with per-page versions), e.g.
+#g++ -std=c++17 -DBTREE_LOCK_GRANULARITY_OPTIMISTIC=1 runner.cpp utils.cpp pager.cpp btree_base.cpp wal.cpp perf.cpp numa.cpp sharded_btree.cpp ../benchmark/libbenchmark.a ../benchmark/libbenchmark_main.a -o runner_olc
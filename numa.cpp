@@ -0,0 +1,140 @@
+#include "types.h"
+#include "numa.h"
+
+#include <cstdio>
+#include <cstdlib>
+#if defined(__linux__)
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+struct NumaTopology {
+    u32 nodes;
+    u64 onlineNodes; // bit per node
+    // node of every CPU, -1 for CPUs the process can't run on
+    int cpuNode[NUMA_MAX_CPUS];
+#if defined(__linux__)
+    // affinity of the process when the topology was read, restored by numaUnpinThread
+    cpu_set_t allowed;
+#endif
+};
+
+#if defined(__linux__)
+// reads a sysfs list like "0-3,8,10-11" into members, returns 0 if the file can't be read or lists nothing
+static u1 readList(const char* path, u1* members, u32 maxMembers) {
+    FILE* file = fopen(path, "r");
+    if (file == nullptr)
+        return 0;
+    char text[4096];
+    size_t length = fread(text, 1, sizeof(text) - 1, file);
+    fclose(file);
+    text[length] = 0;
+    char* position = text;
+    u1 listed = 0;
+    while (*position >= '0' && *position <= '9') {
+        u32 first = strtoul(position, &position, 10);
+        u32 last = first;
+        if (*position == '-')
+            last = strtoul(position + 1, &position, 10);
+        for (u32 i = first; i <= last && i < maxMembers; ++i) {
+            members[i] = 1;
+            listed = 1;
+        }
+        if (*position != ',')
+            break;
+        ++position;
+    }
+    return listed;
+}
+#endif
+
+static NumaTopology* readTopology() {
+    NumaTopology* topology = new NumaTopology;
+    topology->nodes = 1;
+    topology->onlineNodes = 1;
+    for (u32 cpu = 0; cpu < NUMA_MAX_CPUS; ++cpu)
+        topology->cpuNode[cpu] = -1;
+#if defined(__linux__)
+    CPU_ZERO(&topology->allowed);
+    if (sched_getaffinity(0, sizeof(topology->allowed), &topology->allowed) != 0) {
+        for (u32 cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            CPU_SET(cpu, &topology->allowed);
+    }
+    for (u32 cpu = 0; cpu < NUMA_MAX_CPUS && cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &topology->allowed))
+            topology->cpuNode[cpu] = 0;
+    }
+    u1 online[NUMA_MAX_NODES] = {};
+    if (!readList("/sys/devices/system/node/online", online, NUMA_MAX_NODES))
+        return topology;
+    topology->onlineNodes = 0;
+    for (u32 node = 0; node < NUMA_MAX_NODES; ++node) {
+        if (!online[node])
+            continue;
+        topology->nodes = node + 1;
+        topology->onlineNodes |= 1ull << node;
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+        u1 cpus[NUMA_MAX_CPUS] = {};
+        if (!readList(path, cpus, NUMA_MAX_CPUS))
+            continue;
+        for (u32 cpu = 0; cpu < NUMA_MAX_CPUS; ++cpu) {
+            if (cpus[cpu] && topology->cpuNode[cpu] >= 0)
+                topology->cpuNode[cpu] = node;
+        }
+    }
+#endif
+    return topology;
+}
+
+static const NumaTopology* topology() {
+    static const NumaTopology* topology = readTopology();
+    return topology;
+}
+
+u32 numaNodes() {
+    return topology()->nodes;
+}
+
+u32 numaNodeCpus(u32 node, u32* cpus, u32 maxCpus) {
+    u32 count = 0;
+    for (u32 cpu = 0; cpu < NUMA_MAX_CPUS && count < maxCpus; ++cpu) {
+        if (topology()->cpuNode[cpu] == (int)node)
+            cpus[count++] = cpu;
+    }
+    return count;
+}
+
+u1 numaInterleave(void* memory, u64 bytes) {
+    if (topology()->nodes <= 1)
+        return 0;
+#if defined(__linux__)
+    unsigned long nodeMask = topology()->onlineNodes;
+    // the kernel reads maxnode - 1 bits of the mask
+    return syscall(SYS_mbind, memory, bytes, MPOL_INTERLEAVE, &nodeMask, NUMA_MAX_NODES + 1, 0) == 0;
+#else
+    return 0;
+#endif
+}
+
+u1 numaPinThread(u32 cpu) {
+#if defined(__linux__)
+    // the affinity to restore is taken before the first pinning
+    if (cpu >= CPU_SETSIZE || topology() == nullptr)
+        return 0;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    return 0;
+#endif
+}
+
+void numaUnpinThread() {
+#if defined(__linux__)
+    sched_setaffinity(0, sizeof(topology()->allowed), &topology()->allowed);
+#endif
+}
@@ -0,0 +1,22 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include "types.h"
+
+#define NUMA_MAX_NODES 64
+#define NUMA_MAX_CPUS 1024
+
+// amount of NUMA nodes, nodes are numbered from 0; 1 where the machine has no NUMA or its topology can't be read
+u32 numaNodes();
+// CPUs of the node in ascending order, returns their amount (at most maxCpus), 0 for nodes with memory only;
+// without NUMA all CPUs the process may run on belong to node 0
+u32 numaNodeCpus(u32 node, u32* cpus, u32 maxCpus);
+// places the pages of the memory round robin on all nodes as they are touched, memory has to be page aligned;
+// returns 0 if there is a single node or the kernel refused the policy
+u1 numaInterleave(void* memory, u64 bytes);
+// pins the calling thread to the CPU, returns 0 if it can't run there
+u1 numaPinThread(u32 cpu);
+// lets the calling thread run on all CPUs it could run on before it was first pinned
+void numaUnpinThread();
+
+#endif //NUMA_H
@@ -1,5 +1,18 @@
 #include "types.h"
 #include "pager.h"
+#include "numa.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <sched.h>
 
 #define ENABLE_PAGER_TRACE 0
 #if ENABLE_PAGER_TRACE
@@ -8,31 +21,546 @@
 #	define PAGER_TRACE(x)
 #endif
 
+static_assert(sizeof(Page) == PAGER_PAGE_BYTE_SIZE, "page must take exactly PAGER_PAGE_BYTE_SIZE bytes");
+
+#if BTREE_LOCK_GRANULARITY_EXCLUSIVE
+struct PageVersion;
+#endif
+
+// per page state kept out of the page, indexed by PageIndex in both pager modes
+struct PageMeta {
+#if BTREE_LOCK_GRANULARITY_PER_PAGE
+    pthread_rwlock_t lock;
+#endif
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+    // even value means unlocked, odd value means locked by a writer
+    // every unlock after modification moves the version forward
+    std::atomic<u64> version;
+#endif
+    // in-memory pager only, the content of free pages is returned to the OS; actually index + 1, 0 means no next page
+    std::atomic<PageIndex> nextFreePageIndex;
+#if BTREE_LOCK_GRANULARITY_EXCLUSIVE
+    // copies kept for open snapshots, newest first
+    std::atomic<PageVersion*> versions;
+    u64 preservedFor; // newest snapshot the current content is already copied (or not needed) for
+#endif
+
+    BTREE_MAYBE_PAGE_EXTRA_CONTENT
+};
+
 u1 inited = 0;
 Page* Pages;
-PageIndex FirstFreePageIndex;
-PageIndex PageCount;
-PageIndex ActivePages;
-#if BTREE_LOCK_GRANULARITY_PER_PAGE
-pthread_rwlock_t pageAllocationLock;
+PageMeta* PageMetas;
+u64 ReservedBytes;
+PageIndex ReservedPages;
+PageIndex FirstFreePageIndex; // file mode only, actually index + 1, 0 means no free pages
+std::atomic<PageIndex> PageCount;
+std::atomic<PageIndex> ActivePages;
+PageIndex RootPageIndex; // actually index + 1, 0 means no root stored
+u8 NumaPlacement = PAGER_NUMA_FIRST_TOUCH;
+u8 HugePages = PAGER_HUGE_PAGES_NONE; // requested for the next pagerInit
+u8 HugePagesBacking = PAGER_HUGE_PAGES_NONE; // what the current pages got
+
+// in-memory pager: every thread allocates from and frees to its own cache of free pages, caches are refilled from
+// (and spill half of their pages to) the free list shared by all threads, or take never used pages in chunks.
+// 0 makes every allocation and free go to the shared free list
+#define PAGER_THREAD_PAGE_CACHE_SIZE 64
+
+// low half is the first page of the shared free list (actually index + 1), high half is a tag changed by every push
+// and pop, so a pop never succeeds against a head which was popped and pushed back meanwhile
+std::atomic<u64> FreePagesHead;
+// pagerInit and pagerRestoreImage start a new generation, thread caches of earlier ones hold pages of a dropped
+// (or overwritten) pager
+std::atomic<u64> PagerGeneration;
+// counts pagerInit calls only, an image can be restored until the next one
+u64 PagerInitGeneration;
+std::atomic<u64> PageCacheRefills;
+std::atomic<u64> PageCacheSpills;
+std::atomic<u64> AllocationRetries;
+// the page file keeps its free list in the pages, which are accessed through the pool lock anyway
+pthread_mutex_t fileAllocationLock = PTHREAD_MUTEX_INITIALIZER;
+
+// in-memory pager: freed pages are retired and handed out again only after every thread which was inside an operation
+// at the time of the free has left it, so optimistic readers and cursors in the middle of a descent never read a page
+// which was reused meanwhile. The outermost operation of a thread announces the global epoch, the epoch moves forward
+// once all threads inside operations announced it, and pages retired in epoch e are reclaimed when it reaches e + 2.
+// Exclusive lock and single thread modes never read a page being freed, they reuse freed pages at once
+#if BTREE_LOCK_GRANULARITY_PER_PAGE || BTREE_LOCK_GRANULARITY_OPTIMISTIC
+#	define PAGER_EPOCH_RECLAMATION 1
+#else
+#	define PAGER_EPOCH_RECLAMATION 0
 #endif
+#define PAGER_MAX_EPOCH_THREADS 256
 
-void pagerInit(PageIndex totalPages) {
-    if (inited) {
-        delete [] Pages;
-#if BTREE_LOCK_GRANULARITY_PER_PAGE
-		pthread_rwlock_destroy(&pageAllocationLock);
+struct alignas(64) EpochSlot {
+    std::atomic<u64> epoch; // announced epoch, 0 outside of operations
+#if BTREE_LOCK_GRANULARITY_EXCLUSIVE
+    std::atomic<u64> snapshotReads; // odd while the thread reads a snapshot
 #endif
+    std::atomic<u8> used;
+};
+
+std::atomic<u64> GlobalEpoch(1);
+EpochSlot EpochSlots[PAGER_MAX_EPOCH_THREADS];
+std::atomic<u32> EpochSlotsCount; // slots ever taken, the rest is never scanned
+// retired pages by epoch % 3, chained through nextFreePageIndex
+std::atomic<PageIndex> RetiredPages[3];
+std::atomic<PageIndex> RetiredPagesCount;
+std::atomic<u64> EpochAdvances;
+
+thread_local EpochSlot* epochSlot = nullptr;
+
+// gives the slot of an exiting thread to the next one
+struct EpochSlotOwner {
+    ~EpochSlotOwner() {
+        if (epochSlot == nullptr)
+            return;
+        epochSlot->epoch.store(0, std::memory_order_release);
+        epochSlot->used.store(0, std::memory_order_release);
     }
-    Pages = new Page[totalPages];
+};
+
+thread_local EpochSlotOwner epochSlotOwner;
+
+#if BTREE_LOCK_GRANULARITY_EXCLUSIVE
+// in-memory pager: while snapshots are open, a writer copies every page it accesses for the first time since the newest
+// one was opened (writers hold the tree lock, so the copy is what the snapshots saw); reads of a snapshot take the
+// oldest copy made after it was opened, or the page itself if there is none. Snapshot reads are announced in the
+// epoch slots, a writer waits for the reads running when it made a copy before it changes the page
+#define PAGER_MAX_OPEN_SNAPSHOTS 256
+
+struct PageVersion {
+    Page page;
+    u64 snapshot; // newest snapshot when the copy was made, the copy serves it and older ones
+    PageIndex pageIndex;
+    std::atomic<PageVersion*> next; // older copy of the page
+    PageVersion* nextCopied; // copy made after this one, of any page
+};
+
+pthread_mutex_t snapshotLock = PTHREAD_MUTEX_INITIALIZER;
+std::atomic<u64> NewestSnapshot; // snapshot ids grow, 0 means no snapshot
+std::atomic<u32> OpenSnapshotsCount;
+u64 OpenSnapshots[PAGER_MAX_OPEN_SNAPSHOTS];
+// all copies in the order they were made, so ones no open snapshot needs are at the front
+PageVersion* FirstCopied;
+PageVersion* LastCopied;
+std::atomic<PageIndex> SnapshotPages;
+
+thread_local u64 readSnapshot = 0;
+thread_local u16 snapshotReadsDepth = 0;
+thread_local u16 writesDepth = 0;
+#endif
+
+// file mode: page i is stored at file offset (i + 1) * PAGER_PAGE_BYTE_SIZE, the first file page is the header
+#define PAGER_FILE_MAGIC 0x31454c4946455254ULL
+#define PAGER_MAX_PINNED_PAGES 64
+#define PAGER_FRAME_DIRTY 1
+#define PAGER_FRAME_REFERENCED 2
+
+struct PagerFileHeader {
+    u64 magic;
+    u32 pageByteSize;
+    PageIndex pageCount;
+    PageIndex firstFreePageIndex;
+    PageIndex activePages;
+    PageIndex rootPageIndex;
+};
+
+int PagerFile = -1;
+Page* PoolFrames;
+PageIndex PoolSize;
+PageIndex PoolHand;
+PageIndex PoolUsedFrames;
+u32* FramePins;
+u8* FrameFlags;
+PageIndex* PageFrames; // frame of every page, actually frame index + 1, 0 means page isn't in the pool
+u64 PoolHits;
+u64 PoolMisses;
+u64 PoolWrites;
+pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+
+// frames pinned by the current thread until the end of the current tree operation
+thread_local PageIndex pinnedFrames[PAGER_MAX_PINNED_PAGES];
+thread_local u16 pinnedFramesCount = 0;
+thread_local u16 operationsDepth = 0;
+
+static void enterEpoch();
+static void leaveEpoch();
+
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+#define PAGER_MAX_LOCKED_PAGES 64
+
+#if defined(__x86_64__) || defined(__i386__)
+#	define PAGER_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#	define PAGER_CPU_RELAX() asm volatile("yield")
+#else
+#	define PAGER_CPU_RELAX()
+#endif
+
+// pages locked by the current thread, with versions they had before locking
+thread_local Page* lockedPages[PAGER_MAX_LOCKED_PAGES];
+thread_local u64 lockedVersions[PAGER_MAX_LOCKED_PAGES];
+thread_local u16 lockedPagesCount = 0;
+#endif
+
+static void* reserveMemory(u64 bytes) {
+    void* reserved = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED) {
+        fprintf(stderr, "pager: can't reserve %llu bytes\n", bytes);
+        abort();
+    }
+    return reserved;
+}
+
+// the page array of the in-memory pager, backed by huge pages if they were asked for and can be had;
+// huge pages are PAGER_HUGE_PAGE_SIZE aligned, so no page straddles two of them
+static void* reservePageMemory(u64 bytes) {
+    HugePagesBacking = PAGER_HUGE_PAGES_NONE;
+    if (HugePages == PAGER_HUGE_PAGES_NONE)
+        return reserveMemory(bytes);
+#if defined(MAP_HUGETLB)
+    if (HugePages == PAGER_HUGE_PAGES_EXPLICIT) {
+        // without MAP_NORESERVE the huge pages are taken from the pool up front, so a short pool fails here
+        // instead of killing the process by SIGBUS on a later touch
+        void* reserved = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (reserved != MAP_FAILED) {
+            HugePagesBacking = PAGER_HUGE_PAGES_EXPLICIT;
+            return reserved;
+        }
+    }
+#endif
+    // transparent huge pages only cover aligned ranges, the unaligned ends of a larger reservation are given back
+    u8* reserved = (u8*)reserveMemory(bytes + PAGER_HUGE_PAGE_SIZE);
+    u8* aligned = (u8*)(((uintptr_t)reserved + PAGER_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(PAGER_HUGE_PAGE_SIZE - 1));
+    if (aligned > reserved)
+        munmap(reserved, aligned - reserved);
+    munmap(aligned + bytes, reserved + PAGER_HUGE_PAGE_SIZE - aligned);
+#if defined(MADV_HUGEPAGE)
+    if (madvise(aligned, bytes, MADV_HUGEPAGE) == 0)
+        HugePagesBacking = PAGER_HUGE_PAGES_TRANSPARENT;
+#endif
+    return aligned;
+}
+
+#if BTREE_LOCK_GRANULARITY_PER_PAGE || BTREE_LOCK_GRANULARITY_OPTIMISTIC
+static PageIndex pageIndexOf(const Page* page) {
+    // in memory pageIndex of a free page is gone with its content
+    return PagerFile >= 0 ? page->pageIndex : (PageIndex)(page - Pages);
+}
+
+// lock and version of the page
+static PageMeta* pageMeta(const Page* page) {
+    return PageMetas + pageIndexOf(page);
+}
+#endif
+
+void pagerInit(PageIndex maxPages) {
+    if (PagerFile >= 0)
+        pagerClose();
+    if (inited) {
+        munmap(Pages, ReservedBytes);
+        munmap(PageMetas, (u64)ReservedPages * sizeof(PageMeta));
+    }
+    // pages never move, so Page* stays valid while the pager grows
+    ReservedBytes = (u64)maxPages * sizeof(Page) + PAGER_PAGE_READ_PADDING;
+    // huge page mappings are unmapped in whole huge pages
+    if (HugePages != PAGER_HUGE_PAGES_NONE)
+        ReservedBytes = (ReservedBytes + PAGER_HUGE_PAGE_SIZE - 1) & ~(PAGER_HUGE_PAGE_SIZE - 1);
+    Pages = (Page*)reservePageMemory(ReservedBytes);
+    PageMetas = (PageMeta*)reserveMemory((u64)maxPages * sizeof(PageMeta));
+    if (NumaPlacement == PAGER_NUMA_INTERLEAVE) {
+        // a single node keeps the first touch placement
+        numaInterleave(Pages, ReservedBytes);
+        numaInterleave(PageMetas, (u64)maxPages * sizeof(PageMeta));
+    }
+    ReservedPages = maxPages;
+    RootPageIndex = 0;
     FirstFreePageIndex = 0;
+    FreePagesHead = 0;
     PageCount = 0;
     ActivePages = 0;
+    PageCacheRefills = PageCacheSpills = AllocationRetries = 0;
+    for (u8 i = 0; i < 3; ++i)
+        RetiredPages[i] = 0;
+    RetiredPagesCount = 0;
+    EpochAdvances = 0;
+#if BTREE_LOCK_GRANULARITY_EXCLUSIVE
+    while (FirstCopied != nullptr) {
+        PageVersion* next = FirstCopied->nextCopied;
+        delete FirstCopied;
+        FirstCopied = next;
+    }
+    LastCopied = nullptr;
+    // NewestSnapshot keeps growing, preservedFor of pages isn't reset
+    OpenSnapshotsCount = 0;
+    SnapshotPages = 0;
+#endif
+    ++PagerGeneration;
+    ++PagerInitGeneration;
     inited = 1;
+}
+
+void pagerSetNumaPlacement(u8 placement) {
+    NumaPlacement = placement;
+}
+
+void pagerSetHugePages(u8 hugePages) {
+    HugePages = hugePages;
+}
 
+void pagerGetStats(PagerStats* stats) {
+    stats->reservedPages = ReservedPages;
+    stats->committedPages = PageCount;
+    stats->activePages = ActivePages;
+    stats->freePages = PageCount - ActivePages;
+    stats->poolPages = PagerFile >= 0 ? PoolSize : 0;
+    stats->poolHits = PoolHits;
+    stats->poolMisses = PoolMisses;
+    stats->poolWrites = PoolWrites;
+    stats->pageCacheRefills = PageCacheRefills;
+    stats->pageCacheSpills = PageCacheSpills;
+    stats->allocationRetries = AllocationRetries;
+    stats->retiredPages = RetiredPagesCount;
+    stats->epochAdvances = EpochAdvances;
+    stats->hugePages = HugePagesBacking;
+#if BTREE_LOCK_GRANULARITY_EXCLUSIVE
+    stats->snapshotPages = SnapshotPages;
+#else
+    stats->snapshotPages = 0;
+#endif
+}
+
+// returns the page memory to the OS, it reads as zeroes afterwards; pages on huge pages keep their memory,
+// as giving back a part of a transparent huge page splits it and explicit ones can't be split at all
+static void releasePageMemory(Page* page) {
+    if (HugePagesBacking != PAGER_HUGE_PAGES_NONE)
+        return;
+    static const uintptr_t osPageSize = sysconf(_SC_PAGESIZE);
+    uintptr_t from = ((uintptr_t)page + osPageSize - 1) & ~(osPageSize - 1);
+    uintptr_t to = (uintptr_t)(page + 1) & ~(osPageSize - 1);
+    if (from < to)
+        madvise((void*)from, to - from, MADV_DONTNEED);
+}
+
+static void poolWriteFrame(PageIndex frame) {
+    Page* page = PoolFrames + frame;
+    if (pwrite(PagerFile, page, PAGER_PAGE_BYTE_SIZE, ((off_t)page->pageIndex + 1) * PAGER_PAGE_BYTE_SIZE) != PAGER_PAGE_BYTE_SIZE) {
+        perror("pager: page write failed");
+        abort();
+    }
+    FrameFlags[frame] &= ~PAGER_FRAME_DIRTY;
+    ++PoolWrites;
+}
+
+// clock eviction, returns an unused frame
+static PageIndex poolFindFrame() {
+    if (PoolUsedFrames < PoolSize)
+        return PoolUsedFrames++;
+    // two full turns clear all referenced bits, after that only pinned frames are left
+    for (u64 step = 0; step < (u64)PoolSize * 3; ++step) {
+        PageIndex frame = PoolHand;
+        PoolHand = PoolHand + 1 == PoolSize ? 0 : PoolHand + 1;
+        if (FramePins[frame] > 0)
+            continue;
+        if (FrameFlags[frame] & PAGER_FRAME_REFERENCED) {
+            FrameFlags[frame] &= ~PAGER_FRAME_REFERENCED;
+            continue;
+        }
+        Page* victim = PoolFrames + frame;
+        PAGER_TRACE(("pager: evict page %u from frame %u\n", victim->pageIndex, frame));
+        if (FrameFlags[frame] & PAGER_FRAME_DIRTY)
+            poolWriteFrame(frame);
+        PageFrames[victim->pageIndex] = 0;
+        return frame;
+    }
+    fprintf(stderr, "pager: all %u pool frames are pinned\n", PoolSize);
+    abort();
+}
+
+// returns the page pinned until the end of the operation, reads it from the file if load is set
+static Page* poolPinPage(PageIndex pageIndex, u1 load, u1 dirty) {
+    pthread_mutex_lock(&poolLock);
+    PageIndex frame;
+    if (PageFrames[pageIndex] != 0) {
+        frame = PageFrames[pageIndex] - 1;
+        ++PoolHits;
+    } else {
+        frame = poolFindFrame();
+        Page* page = PoolFrames + frame;
+        if (load && pread(PagerFile, page, PAGER_PAGE_BYTE_SIZE, ((off_t)pageIndex + 1) * PAGER_PAGE_BYTE_SIZE) != PAGER_PAGE_BYTE_SIZE) {
+            perror("pager: page read failed");
+            abort();
+        }
+        page->pageIndex = pageIndex;
 #if BTREE_LOCK_GRANULARITY_PER_PAGE
-	pthread_rwlock_init(&pageAllocationLock, nullptr);
+        // nobody holds the lock of a page which isn't in the pool
+        pthread_rwlock_init(&PageMetas[pageIndex].lock, nullptr);
 #endif
+        FrameFlags[frame] = 0;
+        PageFrames[pageIndex] = frame + 1;
+        ++PoolMisses;
+    }
+    FrameFlags[frame] |= PAGER_FRAME_REFERENCED | (dirty ? PAGER_FRAME_DIRTY : 0);
+
+    u1 pinned = 0;
+    for (u16 i = 0; i < pinnedFramesCount && !pinned; ++i)
+        pinned = pinnedFrames[i] == frame;
+    if (!pinned) {
+        if (pinnedFramesCount == PAGER_MAX_PINNED_PAGES) {
+            fprintf(stderr, "pager: more than %u pages pinned by one operation\n", PAGER_MAX_PINNED_PAGES);
+            abort();
+        }
+        pinnedFrames[pinnedFramesCount++] = frame;
+        ++FramePins[frame];
+    }
+    pthread_mutex_unlock(&poolLock);
+    return PoolFrames + frame;
+}
+
+static void writeFileHeader() {
+    u8 buffer[PAGER_PAGE_BYTE_SIZE] = {};
+    PagerFileHeader header;
+    header.magic = PAGER_FILE_MAGIC;
+    header.pageByteSize = PAGER_PAGE_BYTE_SIZE;
+    header.pageCount = PageCount;
+    header.firstFreePageIndex = FirstFreePageIndex;
+    header.activePages = ActivePages;
+    header.rootPageIndex = RootPageIndex;
+    memcpy(buffer, &header, sizeof(header));
+    if (pwrite(PagerFile, buffer, PAGER_PAGE_BYTE_SIZE, 0) != PAGER_PAGE_BYTE_SIZE) {
+        perror("pager: header write failed");
+        abort();
+    }
+}
+
+u1 pagerOpen(const char* path, PageIndex poolPages) {
+    if (PagerFile >= 0)
+        pagerClose();
+    int file = open(path, O_RDWR | O_CREAT, 0644);
+    if (file < 0)
+        return 0;
+
+    struct stat fileStat;
+    fstat(file, &fileStat);
+    PagerFileHeader header = {};
+    if (fileStat.st_size >= PAGER_PAGE_BYTE_SIZE) {
+        if (pread(file, &header, sizeof(header), 0) != sizeof(header)
+            || header.magic != PAGER_FILE_MAGIC || header.pageByteSize != PAGER_PAGE_BYTE_SIZE) {
+            close(file);
+            return 0;
+        }
+    }
+
+    if (inited) {
+        munmap(Pages, ReservedBytes);
+        munmap(PageMetas, (u64)ReservedPages * sizeof(PageMeta));
+        inited = 0;
+        HugePagesBacking = PAGER_HUGE_PAGES_NONE;
+    }
+    PagerFile = file;
+    FirstFreePageIndex = header.firstFreePageIndex;
+    PageCount = header.pageCount;
+    ActivePages = header.activePages;
+    RootPageIndex = header.rootPageIndex;
+    ReservedPages = PAGER_DEFAULT_MAX_PAGES;
+
+    PoolSize = poolPages;
+    PoolHand = 0;
+    PoolUsedFrames = 0;
+    PoolHits = PoolMisses = PoolWrites = 0;
+    PoolFrames = (Page*)reserveMemory((u64)poolPages * sizeof(Page) + PAGER_PAGE_READ_PADDING);
+    PageFrames = (PageIndex*)reserveMemory((u64)ReservedPages * sizeof(PageIndex));
+    PageMetas = (PageMeta*)reserveMemory((u64)ReservedPages * sizeof(PageMeta));
+    FramePins = new u32[poolPages]();
+    FrameFlags = new u8[poolPages]();
+    PageCacheRefills = PageCacheSpills = AllocationRetries = 0;
+    return 1;
+}
+
+void pagerFlush() {
+    if (PagerFile < 0)
+        return;
+    pthread_mutex_lock(&poolLock);
+    for (PageIndex frame = 0; frame < PoolUsedFrames; ++frame) {
+        if (FrameFlags[frame] & PAGER_FRAME_DIRTY)
+            poolWriteFrame(frame);
+    }
+    writeFileHeader();
+    fdatasync(PagerFile);
+    pthread_mutex_unlock(&poolLock);
+}
+
+void pagerClose() {
+    if (PagerFile < 0)
+        return;
+    pagerFlush();
+    close(PagerFile);
+    PagerFile = -1;
+    pinnedFramesCount = 0;
+    munmap(PoolFrames, (u64)PoolSize * sizeof(Page) + PAGER_PAGE_READ_PADDING);
+    munmap(PageFrames, (u64)ReservedPages * sizeof(PageIndex));
+    munmap(PageMetas, (u64)ReservedPages * sizeof(PageMeta));
+    delete [] FramePins;
+    delete [] FrameFlags;
+}
+
+void pagerBeginOperation() {
+    if (operationsDepth++ == 0 && PAGER_EPOCH_RECLAMATION && PagerFile < 0)
+        enterEpoch();
+}
+
+void pagerEndOperation() {
+    if (--operationsDepth > 0)
+        return;
+    if (PagerFile < 0) {
+        if (PAGER_EPOCH_RECLAMATION)
+            leaveEpoch();
+        return;
+    }
+    if (pinnedFramesCount == 0)
+        return;
+    pthread_mutex_lock(&poolLock);
+    for (u16 i = 0; i < pinnedFramesCount; ++i)
+        --FramePins[pinnedFrames[i]];
+    pinnedFramesCount = 0;
+    pthread_mutex_unlock(&poolLock);
+}
+
+void pagerUnpinPage(Page* page) {
+    if (PagerFile < 0)
+        return;
+    PageIndex frame = page - PoolFrames;
+    pthread_mutex_lock(&poolLock);
+    for (u16 i = 0; i < pinnedFramesCount; ++i) {
+        if (pinnedFrames[i] == frame) {
+            --FramePins[frame];
+            pinnedFrames[i] = pinnedFrames[--pinnedFramesCount];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&poolLock);
+}
+
+Page* pagerPinPage(PageIndex pageIndex) {
+    if (PagerFile < 0)
+        return Pages + pageIndex;
+    Page* page = poolPinPage(pageIndex, 1, 0);
+    pthread_mutex_lock(&poolLock);
+    ++FramePins[page - PoolFrames];
+    pthread_mutex_unlock(&poolLock);
+    return page;
+}
+
+void pagerSetRootPageIndex(PageIndex pageIndex) {
+    RootPageIndex = pageIndex + 1;
+}
+
+u1 pagerGetRootPageIndex(PageIndex* pageIndex) {
+    if (RootPageIndex == 0)
+        return 0;
+    *pageIndex = RootPageIndex - 1;
+    return 1;
 }
 
 #if !BTREE_LOCK_GRANULARITY_PER_PAGE
@@ -42,75 +570,647 @@ Page* pagerGetPage(PageIndex pageIndex) {
 }
 #endif
 
-Page* pagerCreateNewPage(u8 pageType) {
+static void initNewPage(Page* newPage, u8 pageType, u8 pageFormat) {
+    newPage->PageType = pageType;
+    newPage->PageFormat = pageFormat;
+    newPage->nCellPointersCount = 0;
+    newPage->nCellsTotalSize = 0;
+    newPage->firstFreeCellIndex = 0;
+    newPage->nFreeCellsTotalSize = 0;
+    newPage->packedKeyWidth = 0;
+    newPage->packedValueWidth = 0;
+    newPage->prevLeafIndex = 0;
+    newPage->nextLeafIndex = 0;
+
+#if BTREE_LOCK_GRANULARITY_PER_PAGE
+    // pool frames keep their locks while the pager is open
+    if (PagerFile < 0)
+        pthread_rwlock_init(&pageMeta(newPage)->lock, nullptr);
+#endif
+}
+
+// pages are linked through nextFreePageIndex from first to last before the push
+static void pushFreePages(PageIndex firstPageIndex, PageIndex lastPageIndex) {
+    u64 head = FreePagesHead.load(std::memory_order_relaxed);
+    while (1) {
+        PageMetas[lastPageIndex].nextFreePageIndex.store((PageIndex)head, std::memory_order_relaxed);
+        u64 newHead = (((head >> 32) + 1) << 32) | (firstPageIndex + 1);
+        if (FreePagesHead.compare_exchange_strong(head, newHead, std::memory_order_release, std::memory_order_relaxed))
+            return;
+        ++AllocationRetries;
+    }
+}
+
+// returns the first page of the shared free list, actually index + 1, 0 if the list is empty
+static PageIndex popFreePage() {
+    u64 head = FreePagesHead.load(std::memory_order_acquire);
+    while ((PageIndex)head != 0) {
+        // link of a page popped by another thread meanwhile may be stale, the tag makes the swap fail then
+        PageIndex next = PageMetas[(PageIndex)head - 1].nextFreePageIndex.load(std::memory_order_relaxed);
+        u64 newHead = (((head >> 32) + 1) << 32) | next;
+        if (FreePagesHead.compare_exchange_strong(head, newHead, std::memory_order_acquire, std::memory_order_acquire))
+            return (PageIndex)head;
+        ++AllocationRetries;
+    }
+    return 0;
+}
+
+// takes up to count never used pages (at least one), returns the first index and sets count to the amount taken
+static PageIndex takeUnusedPages(PageIndex* count) {
+    PageIndex first = PageCount.load(std::memory_order_relaxed);
+    while (1) {
+        if (first >= ReservedPages) {
+            fprintf(stderr, "pagerCreateNewPage: all %u reserved pages are in use\n", ReservedPages);
+            abort();
+        }
+        PageIndex taken = ReservedPages - first < *count ? ReservedPages - first : *count;
+        if (PageCount.compare_exchange_strong(first, first + taken)) {
+            *count = taken;
+            return first;
+        }
+        ++AllocationRetries;
+    }
+}
+
+struct ThreadPageCache {
+    u64 generation;
+    u32 count;
+    PageIndex pages[PAGER_THREAD_PAGE_CACHE_SIZE > 0 ? PAGER_THREAD_PAGE_CACHE_SIZE : 1];
+
+    // pages of an exiting thread go back to the shared list
+    ~ThreadPageCache() {
+        if (count == 0 || generation != PagerGeneration.load() || PagerFile >= 0)
+            return;
+        for (u32 i = 0; i + 1 < count; ++i)
+            PageMetas[pages[i]].nextFreePageIndex.store(pages[i + 1] + 1, std::memory_order_relaxed);
+        pushFreePages(pages[0], pages[count - 1]);
+    }
+};
+
+thread_local ThreadPageCache pageCache = {};
+
+static ThreadPageCache* threadPageCache() {
+    u64 generation = PagerGeneration.load(std::memory_order_relaxed);
+    if (pageCache.generation != generation) {
+        pageCache.generation = generation;
+        pageCache.count = 0;
+    }
+    return &pageCache;
+}
+
+// in-memory pager only, returns the index of a free page taken from the thread cache
+static PageIndex allocatePage() {
+    if (PAGER_THREAD_PAGE_CACHE_SIZE == 0) {
+        PageIndex freePageIndex = popFreePage();
+        if (freePageIndex != 0)
+            return freePageIndex - 1;
+        PageIndex count = 1;
+        return takeUnusedPages(&count);
+    }
+    ThreadPageCache* cache = threadPageCache();
+    if (cache->count == 0) {
+        // half of the cache is refilled, so a thread which allocates and frees in turns rarely gets here
+        ++PageCacheRefills;
+        PageIndex wanted = PAGER_THREAD_PAGE_CACHE_SIZE / 2 > 0 ? PAGER_THREAD_PAGE_CACHE_SIZE / 2 : 1;
+        while (cache->count < wanted) {
+            PageIndex freePageIndex = popFreePage();
+            if (freePageIndex == 0)
+                break;
+            cache->pages[cache->count++] = freePageIndex - 1;
+        }
+        if (cache->count == 0) {
+            PageIndex first = takeUnusedPages(&wanted);
+            // pages are taken from the back, so never used ones are handed out in ascending order
+            for (PageIndex i = wanted; i > 0; --i)
+                cache->pages[cache->count++] = first + i - 1;
+        }
+    }
+    return cache->pages[--cache->count];
+}
+
+// in-memory pager only, puts the page to the thread cache
+static void deallocatePage(PageIndex pageIndex) {
+    if (PAGER_THREAD_PAGE_CACHE_SIZE == 0) {
+        pushFreePages(pageIndex, pageIndex);
+        return;
+    }
+    ThreadPageCache* cache = threadPageCache();
+    if (cache->count == PAGER_THREAD_PAGE_CACHE_SIZE) {
+        // the older half goes to the shared list as one chain
+        ++PageCacheSpills;
+        u32 spilled = cache->count / 2 > 0 ? cache->count / 2 : 1;
+        for (u32 i = 0; i + 1 < spilled; ++i)
+            PageMetas[cache->pages[i]].nextFreePageIndex.store(cache->pages[i + 1] + 1, std::memory_order_relaxed);
+        pushFreePages(cache->pages[0], cache->pages[spilled - 1]);
+        memmove(cache->pages, cache->pages + spilled, (cache->count - spilled) * sizeof(PageIndex));
+        cache->count -= spilled;
+    }
+    cache->pages[cache->count++] = pageIndex;
+}
+
+static void takeEpochSlot() {
+    for (u32 i = 0; i < PAGER_MAX_EPOCH_THREADS; ++i) {
+        u8 used = 0;
+        if (EpochSlots[i].used.load(std::memory_order_relaxed) != 0
+            || !EpochSlots[i].used.compare_exchange_strong(used, 1, std::memory_order_acquire))
+            continue;
+        u32 count = EpochSlotsCount.load(std::memory_order_relaxed);
+        while (count < i + 1 && !EpochSlotsCount.compare_exchange_weak(count, i + 1));
+        epochSlot = EpochSlots + i;
+        (void)&epochSlotOwner; // registers the destructor
+        return;
+    }
+    fprintf(stderr, "pager: more than %u threads run operations\n", PAGER_MAX_EPOCH_THREADS);
+    abort();
+}
+
+static void enterEpoch() {
+    if (epochSlot == nullptr)
+        takeEpochSlot();
+    // the announcement must be visible before any page of the operation is read, a locked exchange is cheaper
+    // than a store followed by a full fence
+    epochSlot->epoch.exchange(GlobalEpoch.load(std::memory_order_relaxed), std::memory_order_seq_cst);
+}
+
+// the retired page becomes a free page
+static void reclaimPage(PageIndex pageIndex) {
 #if BTREE_LOCK_GRANULARITY_PER_PAGE
-	pthread_rwlock_wrlock(&pageAllocationLock);
+    pthread_rwlock_destroy(&PageMetas[pageIndex].lock);
 #endif
+    // in memory the content of free pages is released, it reads as a free page
+    Page* page = Pages + pageIndex;
+    page->nCellPointersCount = 1;
+    page->nCellsTotalSize = 0;
+    page->PageType = PAGER_PAGE_TYPE_FREE;
+    releasePageMemory(page);
+    deallocatePage(pageIndex);
+}
+
+// moves the epoch forward if every thread inside an operation announced the current one,
+// then reclaims the pages retired two epochs before the new one
+static void tryAdvanceEpoch() {
+    u64 epoch = GlobalEpoch.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    u32 slotsCount = EpochSlotsCount.load(std::memory_order_acquire);
+    for (u32 i = 0; i < slotsCount; ++i) {
+        u64 announced = EpochSlots[i].epoch.load(std::memory_order_acquire);
+        if (announced != 0 && announced != epoch)
+            return;
+    }
+    if (!GlobalEpoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_acq_rel))
+        return;
+    ++EpochAdvances;
+    // nobody retires into the list of epoch - 1 anymore, it is reused by epoch + 2
+    PageIndex next = RetiredPages[(epoch + 2) % 3].exchange(0, std::memory_order_acquire);
+    while (next != 0) {
+        PageIndex pageIndex = next - 1;
+        next = PageMetas[pageIndex].nextFreePageIndex.load(std::memory_order_relaxed);
+        reclaimPage(pageIndex);
+        --RetiredPagesCount;
+    }
+}
+
+static void leaveEpoch() {
+    epochSlot->epoch.store(0, std::memory_order_release);
+    if (RetiredPagesCount.load(std::memory_order_relaxed) != 0)
+        tryAdvanceEpoch();
+}
+
+static void retirePage(PageIndex pageIndex) {
+    // a free outside of operations is one by itself, so the epoch can't move past it while the page is pushed
+    u1 outside = operationsDepth == 0;
+    if (outside)
+        pagerBeginOperation();
+    ++RetiredPagesCount;
+    std::atomic<PageIndex>* retired = RetiredPages + GlobalEpoch.load(std::memory_order_acquire) % 3;
+    PageIndex head = retired->load(std::memory_order_relaxed);
+    do {
+        PageMetas[pageIndex].nextFreePageIndex.store(head, std::memory_order_relaxed);
+    } while (!retired->compare_exchange_weak(head, pageIndex + 1, std::memory_order_release, std::memory_order_relaxed));
+    if (outside)
+        pagerEndOperation();
+}
+
+struct PagerImage {
+    Page* base; // Pages of the pager the image was saved from
+    u64 generation; // generation of the pager, reinitializing it starts a new one
+    Page* pages;
+    PageMeta* metas;
+    PageIndex pageCount;
+    PageIndex activePages;
+    PageIndex rootPageIndex;
+    u64 freePagesHead;
+};
+
+PagerImage* pagerSaveImage() {
+    if (PagerFile >= 0) {
+        fprintf(stderr, "pagerSaveImage: images are taken of the in-memory pager only\n");
+        abort();
+    }
+    // nothing runs, so retired pages can't be read anymore; they are saved as free pages
+    for (u8 i = 0; i < 3; ++i) {
+        PageIndex next = RetiredPages[i].exchange(0);
+        while (next != 0) {
+            PageIndex pageIndex = next - 1;
+            next = PageMetas[pageIndex].nextFreePageIndex.load(std::memory_order_relaxed);
+            reclaimPage(pageIndex);
+            --RetiredPagesCount;
+        }
+    }
+    // free pages of the calling thread go to the shared list, which is a part of the image
+    ThreadPageCache* cache = threadPageCache();
+    if (cache->count > 0) {
+        for (u32 i = 0; i + 1 < cache->count; ++i)
+            PageMetas[cache->pages[i]].nextFreePageIndex.store(cache->pages[i + 1] + 1, std::memory_order_relaxed);
+        pushFreePages(cache->pages[0], cache->pages[cache->count - 1]);
+        cache->count = 0;
+    }
+
+    PagerImage* image = new PagerImage;
+    image->base = Pages;
+    image->generation = PagerInitGeneration;
+    image->pageCount = PageCount;
+    image->activePages = ActivePages;
+    image->rootPageIndex = RootPageIndex;
+    image->freePagesHead = FreePagesHead;
+    image->pages = (Page*)reserveMemory((u64)image->pageCount * sizeof(Page));
+    image->metas = (PageMeta*)reserveMemory((u64)image->pageCount * sizeof(PageMeta));
+    memcpy(image->pages, Pages, (u64)image->pageCount * sizeof(Page));
+    memcpy((void*)image->metas, (void*)PageMetas, (u64)image->pageCount * sizeof(PageMeta));
+    return image;
+}
+
+void pagerRestoreImage(const PagerImage* image) {
+    if (PagerFile >= 0 || image->base != Pages || image->generation != PagerInitGeneration) {
+        fprintf(stderr, "pagerRestoreImage: the image was saved from another pager\n");
+        abort();
+    }
+    PageIndex pageCount = PageCount;
+    if (pageCount > image->pageCount) {
+        // pages taken after saving are forgotten, and their memory given back
+        madvise(Pages + image->pageCount, (u64)(pageCount - image->pageCount) * sizeof(Page), MADV_DONTNEED);
+        memset((void*)(PageMetas + image->pageCount), 0, (u64)(pageCount - image->pageCount) * sizeof(PageMeta));
+    }
+    memcpy(Pages, image->pages, (u64)image->pageCount * sizeof(Page));
+    memcpy((void*)PageMetas, (void*)image->metas, (u64)image->pageCount * sizeof(PageMeta));
+    PageCount = image->pageCount;
+    ActivePages = image->activePages;
+    RootPageIndex = image->rootPageIndex;
+    FreePagesHead = image->freePagesHead;
+    for (u8 i = 0; i < 3; ++i)
+        RetiredPages[i] = 0;
+    RetiredPagesCount = 0;
+#if BTREE_LOCK_GRANULARITY_EXCLUSIVE
+    while (FirstCopied != nullptr) {
+        PageVersion* next = FirstCopied->nextCopied;
+        delete FirstCopied;
+        FirstCopied = next;
+    }
+    LastCopied = nullptr;
+    SnapshotPages = 0;
+#endif
+    // thread caches hold pages of the state before restoring
+    ++PagerGeneration;
+}
+
+void pagerFreeImage(PagerImage* image) {
+    munmap(image->pages, (u64)image->pageCount * sizeof(Page));
+    munmap(image->metas, (u64)image->pageCount * sizeof(PageMeta));
+    delete image;
+}
+
+#if BTREE_LOCK_GRANULARITY_EXCLUSIVE
+// waits until the snapshot reads running now have ended
+static void waitForSnapshotReads() {
+    u32 slotsCount = EpochSlotsCount.load(std::memory_order_acquire);
+    for (u32 i = 0; i < slotsCount; ++i) {
+        u64 reads = EpochSlots[i].snapshotReads.load(std::memory_order_seq_cst);
+        if (reads % 2 == 0)
+            continue;
+        while (EpochSlots[i].snapshotReads.load(std::memory_order_acquire) == reads)
+            sched_yield();
+    }
+}
+
+u64 pagerOpenSnapshot() {
+    if (PagerFile >= 0)
+        return 0;
+    pthread_mutex_lock(&snapshotLock);
+    u32 count = OpenSnapshotsCount.load(std::memory_order_relaxed);
+    if (count == PAGER_MAX_OPEN_SNAPSHOTS) {
+        fprintf(stderr, "pager: more than %u open snapshots\n", PAGER_MAX_OPEN_SNAPSHOTS);
+        abort();
+    }
+    u64 snapshot = NewestSnapshot.load(std::memory_order_relaxed) + 1;
+    OpenSnapshots[count] = snapshot;
+    OpenSnapshotsCount.store(count + 1, std::memory_order_release);
+    NewestSnapshot.store(snapshot, std::memory_order_release);
+    pthread_mutex_unlock(&snapshotLock);
+    return snapshot;
+}
+
+void pagerCloseSnapshot(u64 snapshot) {
+    if (snapshot == 0)
+        return;
+    pthread_mutex_lock(&snapshotLock);
+    u32 count = OpenSnapshotsCount.load(std::memory_order_relaxed);
+    u64 oldest = ~0ULL;
+    for (u32 i = 0; i < count; ++i) {
+        if (OpenSnapshots[i] == snapshot) {
+            OpenSnapshots[i--] = OpenSnapshots[--count];
+            continue;
+        }
+        if (OpenSnapshots[i] < oldest)
+            oldest = OpenSnapshots[i];
+    }
+    OpenSnapshotsCount.store(count, std::memory_order_release);
+
+    // copies made before the oldest open snapshot are at the front, older copies of the same page were cut off
+    // from its list before, so every copy is the last one of its page when it is dropped
+    PageVersion* dropped = nullptr;
+    while (FirstCopied != nullptr && FirstCopied->snapshot < oldest) {
+        PageVersion* version = FirstCopied;
+        FirstCopied = version->nextCopied;
+        std::atomic<PageVersion*>* link = &PageMetas[version->pageIndex].versions;
+        while (link->load(std::memory_order_relaxed) != version)
+            link = &link->load(std::memory_order_relaxed)->next;
+        link->store(nullptr, std::memory_order_seq_cst);
+        version->nextCopied = dropped;
+        dropped = version;
+    }
+    if (FirstCopied == nullptr)
+        LastCopied = nullptr;
+    pthread_mutex_unlock(&snapshotLock);
+
+    // reads which found the copies before they were cut off may still use them
+    if (dropped != nullptr)
+        waitForSnapshotReads();
+    while (dropped != nullptr) {
+        PageVersion* next = dropped->nextCopied;
+        delete dropped;
+        --SnapshotPages;
+        dropped = next;
+    }
+}
 
+void pagerBeginSnapshotRead(u64 snapshot) {
+    if (snapshotReadsDepth++ > 0)
+        return;
+    readSnapshot = snapshot;
+    if (epochSlot == nullptr)
+        takeEpochSlot();
+    // announced before any copy is looked at, so a writer copying a page meanwhile waits for the read to end
+    epochSlot->snapshotReads.exchange(epochSlot->snapshotReads.load(std::memory_order_relaxed) + 1,
+                                      std::memory_order_seq_cst);
+}
+
+void pagerEndSnapshotRead() {
+    if (--snapshotReadsDepth > 0)
+        return;
+    epochSlot->snapshotReads.store(epochSlot->snapshotReads.load(std::memory_order_relaxed) + 1,
+                                   std::memory_order_release);
+    readSnapshot = 0;
+}
+
+void pagerBeginWrites() {
+    ++writesDepth;
+}
+
+void pagerEndWrites() {
+    --writesDepth;
+}
+
+// the page as the snapshot of the current read sees it
+static Page* snapshotPage(PageIndex pageIndex) {
+    PageVersion* kept = nullptr;
+    for (PageVersion* version = PageMetas[pageIndex].versions.load(std::memory_order_seq_cst);
+         version != nullptr && version->snapshot >= readSnapshot; version = version->next.load(std::memory_order_acquire))
+        kept = version;
+    return kept != nullptr ? &kept->page : Pages + pageIndex;
+}
+
+// copies the page for open snapshots which don't have it yet, before the current writer changes it
+static void preservePage(PageIndex pageIndex) {
+    if (OpenSnapshotsCount.load(std::memory_order_acquire) == 0 || PagerFile >= 0)
+        return;
+    PageMeta* meta = PageMetas + pageIndex;
+    u64 newest = NewestSnapshot.load(std::memory_order_acquire);
+    if (meta->preservedFor >= newest)
+        return;
+    PageVersion* version = new PageVersion;
+    memcpy(&version->page, Pages + pageIndex, sizeof(Page));
+    version->snapshot = newest;
+    version->pageIndex = pageIndex;
+    version->nextCopied = nullptr;
+    pthread_mutex_lock(&snapshotLock);
+    version->next.store(meta->versions.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    meta->versions.store(version, std::memory_order_seq_cst);
+    if (LastCopied == nullptr)
+        FirstCopied = version;
+    else
+        LastCopied->nextCopied = version;
+    LastCopied = version;
+    pthread_mutex_unlock(&snapshotLock);
+    meta->preservedFor = newest;
+    ++SnapshotPages;
+    // reads which found no copy use the page itself
+    waitForSnapshotReads();
+}
+#endif
+
+Page* pagerCreateNewPage(u8 pageType, u8 pageFormat) {
     Page* newPage;
-    if(FirstFreePageIndex == 0) {
-        PAGER_TRACE(("pagerCreateNewPage: extend pages %u\n", PageCount));
-        newPage = Pages + PageCount;
-        newPage->pageIndex = PageCount;
-        ++PageCount;
+    if (PagerFile >= 0) {
+        pthread_mutex_lock(&fileAllocationLock);
+        if (FirstFreePageIndex == 0) {
+            PAGER_TRACE(("pagerCreateNewPage: extend pages %u\n", PageCount.load()));
+            PageIndex count = 1;
+            newPage = poolPinPage(takeUnusedPages(&count), 0, 1);
+        } else {
+            PAGER_TRACE(("pagerCreateNewPage: use free page %u\n", FirstFreePageIndex - 1));
+            newPage = poolPinPage(FirstFreePageIndex - 1, 1, 1);
+            FirstFreePageIndex = newPage->nextLeafIndex;
+        }
+        pthread_mutex_unlock(&fileAllocationLock);
     } else {
-        PAGER_TRACE(("pagerCreateNewPage: use free page %u\n", FirstFreePageIndex - 1));
-        newPage = Pages + FirstFreePageIndex - 1;
-        FirstFreePageIndex = newPage->cellPointers[0];
+        PageIndex pageIndex = allocatePage();
+        newPage = Pages + pageIndex;
+        // pageIndex is wiped by releasePageMemory
+        newPage->pageIndex = pageIndex;
+#if BTREE_LOCK_GRANULARITY_EXCLUSIVE
+        // open snapshots don't reach a page which was free, a copy made when it was freed is kept
+        PageMetas[pageIndex].preservedFor = NewestSnapshot.load(std::memory_order_relaxed);
+#endif
     }
 
     ++ActivePages;
-    newPage->PageType = pageType;
-    newPage->nCellsTotalSize = 0;
-    newPage->firstFreeCellIndex = 0;
-    newPage->nFreeCellsTotalSize = 0;
+    initNewPage(newPage, pageType, pageFormat);
+    return newPage;
+}
 
-#if BTREE_LOCK_GRANULARITY_PER_PAGE
-	pthread_rwlock_init(&newPage->lock, nullptr);
-	pthread_rwlock_unlock(&pageAllocationLock);
-#endif
+PageIndex pagerReservePages(PageIndex count) {
+    PAGER_TRACE(("pagerReservePages: reserve %u pages from %u\n", count, PageCount.load()));
+    PageIndex firstPageIndex = PageCount.load(std::memory_order_relaxed);
+    while (1) {
+        if ((u64)firstPageIndex + count > ReservedPages) {
+            fprintf(stderr, "pagerReservePages: %u pages don't fit, %u of %u reserved pages are in use\n", count,
+                    firstPageIndex, ReservedPages);
+            abort();
+        }
+        if (PageCount.compare_exchange_strong(firstPageIndex, firstPageIndex + count))
+            break;
+        ++AllocationRetries;
+    }
+    ActivePages += count;
+    return firstPageIndex;
+}
 
+Page* pagerCreateReservedPage(PageIndex pageIndex, u8 pageType, u8 pageFormat) {
+    Page* newPage;
+    if (PagerFile >= 0) {
+        newPage = poolPinPage(pageIndex, 0, 1);
+    } else {
+        newPage = Pages + pageIndex;
+        newPage->pageIndex = pageIndex;
+    }
+    initNewPage(newPage, pageType, pageFormat);
     return newPage;
 }
 
 void pagerFreePage(PageIndex pageIndex) {
-#if BTREE_LOCK_GRANULARITY_PER_PAGE
-    pthread_rwlock_wrlock(&pageAllocationLock);
-#endif
-    PAGER_TRACE(("pagerFreePage: dealloc page %u, ActivePages = %u\n", pageIndex, ActivePages - 1));
+    PAGER_TRACE(("pagerFreePage: dealloc page %u, ActivePages = %u\n", pageIndex, ActivePages.load() - 1));
 
-    Page* deallocatedPage = Pages + pageIndex;
-    deallocatedPage->nCellPointersCount = 1;
-    deallocatedPage->nCellsTotalSize = 0;
-    deallocatedPage->cellPointers[0] = FirstFreePageIndex;
-    deallocatedPage->PageType = PAGER_PAGE_TYPE_FREE;
-    FirstFreePageIndex = pageIndex + 1;
-    --ActivePages;
-#if BTREE_LOCK_GRANULARITY_PER_PAGE
-	pthread_rwlock_destroy(&deallocatedPage->lock);
-    pthread_rwlock_unlock(&pageAllocationLock);
+    if (PagerFile >= 0) {
+        pthread_mutex_lock(&fileAllocationLock);
+        // page file keeps the free list in the pages
+        Page* deallocatedPage = poolPinPage(pageIndex, 1, 1);
+        deallocatedPage->nCellPointersCount = 1;
+        deallocatedPage->nCellsTotalSize = 0;
+        deallocatedPage->nextLeafIndex = FirstFreePageIndex;
+        deallocatedPage->PageType = PAGER_PAGE_TYPE_FREE;
+        FirstFreePageIndex = pageIndex + 1;
+        pthread_mutex_unlock(&fileAllocationLock);
+    } else {
+#if BTREE_LOCK_GRANULARITY_EXCLUSIVE
+        preservePage(pageIndex);
 #endif
-
+        // lock and the rest of the content stay untouched until no thread can still read the page,
+        // but it reads as a free page right away, as it does in the file
+        if (PAGER_EPOCH_RECLAMATION) {
+            Pages[pageIndex].PageType = PAGER_PAGE_TYPE_FREE;
+            retirePage(pageIndex);
+        } else {
+            reclaimPage(pageIndex);
+        }
+    }
+    --ActivePages;
 }
 
 Page* pagerGetReadPage(PageIndex pageIndex) {
-    Page* result = Pages + pageIndex;
+    Page* result = PagerFile >= 0 ? poolPinPage(pageIndex, 1, 0) : Pages + pageIndex;
 #if BTREE_LOCK_GRANULARITY_PER_PAGE
-    pthread_rwlock_rdlock(&result->lock);
+    pthread_rwlock_rdlock(&pageMeta(result)->lock);
+#endif
+#if BTREE_LOCK_GRANULARITY_EXCLUSIVE
+    if (readSnapshot != 0)
+        return snapshotPage(pageIndex);
+    // writers change pages they got for reading as well
+    if (writesDepth > 0)
+        preservePage(pageIndex);
 #endif
 	return result;
 }
 
 Page* pagerGetWritePage(PageIndex pageIndex) {
-    Page* result = Pages + pageIndex;
+    Page* result = PagerFile >= 0 ? poolPinPage(pageIndex, 1, 1) : Pages + pageIndex;
 #if BTREE_LOCK_GRANULARITY_PER_PAGE
-    pthread_rwlock_wrlock(&result->lock);
+    pthread_rwlock_wrlock(&pageMeta(result)->lock);
+#endif
+#if BTREE_LOCK_GRANULARITY_EXCLUSIVE
+    if (writesDepth > 0)
+        preservePage(pageIndex);
 #endif
     return result;
 }
 
+void pagerPrefetchPage(PageIndex pageIndex) {
+    if (PagerFile >= 0)
+        return;
+    const Page* page = Pages + pageIndex;
+    // first probe of the binary search: the middle cell pointers, the middle fixed key
+    // or the middle packed delta of a page which is half deltas and half values
+    __builtin_prefetch(page);
+    __builtin_prefetch(page->cellPointers + PAGER_PAGE_CONTENT_SIZE / 32);
+    __builtin_prefetch(page->fixedKeys + PAGER_FIXED_PAGE_CAPACITY / 2);
+    __builtin_prefetch(page->packedArea + PAGER_PACKED_PAGE_AREA_SIZE / 4);
+}
+
 #if BTREE_LOCK_GRANULARITY_PER_PAGE
+pthread_rwlock_t* pagerGetPageLock(const Page* page) {
+    return &pageMeta(page)->lock;
+}
+
 void pagerReleasePageLock(Page* page) {
-	pthread_rwlock_unlock(&page->lock);
+	pthread_rwlock_unlock(&pageMeta(page)->lock);
+}
+#endif
+
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+u64 pagerReadPageVersion(const Page* page) {
+    const PageMeta* meta = pageMeta(page);
+    u64 version = meta->version.load(std::memory_order_acquire);
+    while (version & 1) {
+        PAGER_CPU_RELAX();
+        version = meta->version.load(std::memory_order_acquire);
+    }
+    return version;
 }
-#endif
\ No newline at end of file
+
+u1 pagerValidatePageVersion(const Page* page, u64 version) {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return pageMeta(page)->version.load(std::memory_order_relaxed) == version;
+}
+
+u1 pagerTryLockPage(Page* page, u64 version) {
+    if (version & 1)
+        return 0;
+    if (!pageMeta(page)->version.compare_exchange_strong(version, version + 1, std::memory_order_acquire))
+        return 0;
+    lockedPages[lockedPagesCount] = page;
+    lockedVersions[lockedPagesCount++] = version;
+    return 1;
+}
+
+u64 pagerLockPage(Page* page) {
+    for (u16 i = 0; i < lockedPagesCount; ++i) {
+        if (lockedPages[i] == page)
+            return lockedVersions[i];
+    }
+    while (1) {
+        u64 version = pagerReadPageVersion(page);
+        if (pagerTryLockPage(page, version))
+            return version;
+        PAGER_CPU_RELAX();
+    }
+}
+
+void pagerReleaseWriteLocks(u1 modified) {
+    for (u16 i = 0; i < lockedPagesCount; ++i) {
+        // unmodified pages get their previous version back, so concurrent readers don't restart
+        pageMeta(lockedPages[i])->version.store(lockedVersions[i] + (modified ? 2 : 0), std::memory_order_release);
+    }
+    lockedPagesCount = 0;
+}
+
+void pagerReleaseWriteLock(Page* page, u1 modified) {
+    for (u16 i = 0; i < lockedPagesCount; ++i) {
+        if (lockedPages[i] != page)
+            continue;
+        pageMeta(page)->version.store(lockedVersions[i] + (modified ? 2 : 0), std::memory_order_release);
+        --lockedPagesCount;
+        lockedPages[i] = lockedPages[lockedPagesCount];
+        lockedVersions[i] = lockedVersions[lockedPagesCount];
+        return;
+    }
+}
+#endif
@@ -8,41 +8,197 @@
 
 #define PAGER_PAGE_BYTE_SIZE 4096
 
+// address space reserved by default, pages are committed by the OS only when touched
+#define PAGER_DEFAULT_MAX_PAGES (1u << 22)
+
 #define PAGER_PAGE_TYPE_FREE 0
 #define PAGER_PAGE_TYPE_LEAF 1
 #define PAGER_PAGE_TYPE_PARENT 2
+// pending inserts and removes of an inner page of a write buffered tree
+#define PAGER_PAGE_TYPE_MESSAGES 3
+
+// variable-length cells with pointers to them, compact for small keys and values
+#define PAGER_PAGE_FORMAT_CELLS 0
+// dense sorted array of u64 keys followed by array of u64 values, fast to search
+#define PAGER_PAGE_FORMAT_FIXED 1
+// keys as fixed width deltas from the page base key and values of a fixed width, both as narrow as the page allows
+#define PAGER_PAGE_FORMAT_PACKED 2
+
+#define PAGER_PAGE_HEADER_SIZE 24
+
+//const u16 PAGER_PAGE_HEADER_SIZE = sizeof(u8) + sizeof(u8) + sizeof(u16) * 5 + sizeof(PageIndex) * 3;
+
+// slots and cells share the content area: cell pointers grow from the front, cells from the back
+#define PAGER_PAGE_CONTENT_SIZE (PAGER_PAGE_BYTE_SIZE - PAGER_PAGE_HEADER_SIZE)
 
-#define PAGER_PAGE_HEADER_SIZE 9
+#define PAGER_FIXED_PAGE_CAPACITY (PAGER_PAGE_CONTENT_SIZE / (sizeof(u64) * 2))
 
-//const u16 PAGER_PAGE_HEADER_SIZE = sizeof(u8) + sizeof(u16) + sizeof(u16) + sizeof(u16) + sizeof(u16);
+// packed entries follow the base key, deltas grow from the front and values from the back
+#define PAGER_PACKED_PAGE_AREA_SIZE (PAGER_PAGE_CONTENT_SIZE - sizeof(u64))
 
+// messages are kept sorted by key as three parallel arrays: keys, values and kinds
+#define PAGER_MESSAGE_PAGE_CAPACITY (PAGER_PAGE_CONTENT_SIZE / (sizeof(u64) * 2 + sizeof(u8)))
+
+// bytes readable after the last page, cells are decoded with whole word loads
+#define PAGER_PAGE_READ_PADDING 8
+
+// page is exactly PAGER_PAGE_BYTE_SIZE bytes, locks and versions are kept by the pager separately
 struct Page {
     u8 PageType;
-    u16 nCellPointersCount;
-    u16 nCellsTotalSize;
+    u8 PageFormat;
+    u16 nCellPointersCount; // amount of entries for any page format
+    u16 nCellsTotalSize; // cells take last nCellsTotalSize bytes of the content
     u16 firstFreeCellIndex; // actually index + 1, 0 means no free cells
     u16 nFreeCellsTotalSize; // amount of free cells
-    u16 cellPointers[(PAGER_PAGE_BYTE_SIZE - PAGER_PAGE_HEADER_SIZE) / sizeof(u16)];
-    u8 cells[(PAGER_PAGE_BYTE_SIZE - PAGER_PAGE_HEADER_SIZE) / sizeof(u8)];
+    u8 packedKeyWidth; // packed pages only, bytes of every key delta, 0 while the page is empty
+    u8 packedValueWidth; // packed pages only, bytes of every value
+    PageIndex prevLeafIndex; // leaf pages only, actually index + 1, 0 means no sibling; message page for inner pages
+    PageIndex nextLeafIndex; // leaf pages only, actually index + 1, 0 means no sibling; next free page for free pages in the file
     PageIndex pageIndex;
-#if BTREE_LOCK_GRANULARITY_PER_PAGE
-    pthread_rwlock_t lock;
-#endif
-
-    BTREE_MAYBE_PAGE_EXTRA_CONTENT
+    union {
+        u16 cellPointers[PAGER_PAGE_CONTENT_SIZE / sizeof(u16)];
+        // cell pointers are offsets from the start of the content, as cellPointers and cells start at the same byte
+        u8 cells[PAGER_PAGE_CONTENT_SIZE];
+        struct {
+            u64 fixedKeys[PAGER_FIXED_PAGE_CAPACITY];
+            u64 fixedValues[PAGER_FIXED_PAGE_CAPACITY];
+        };
+        struct {
+            u64 packedBase;
+            // value i ends (PAGER_PACKED_PAGE_AREA_SIZE - i * packedValueWidth) bytes into the area
+            u8 packedArea[PAGER_PACKED_PAGE_AREA_SIZE];
+        };
+        struct {
+            u64 messageKeys[PAGER_MESSAGE_PAGE_CAPACITY];
+            u64 messageValues[PAGER_MESSAGE_PAGE_CAPACITY];
+            u8 messageKinds[PAGER_MESSAGE_PAGE_CAPACITY];
+        };
+    };
 };
 typedef struct Page Page;
 
-void pagerInit(PageIndex totalPages);
-Page* pagerCreateNewPage(u8 pageType);
+struct PagerStats {
+    PageIndex reservedPages; // pages which fit into the reserved address space
+    PageIndex committedPages; // pages ever handed out, freed ones included
+    PageIndex activePages; // pages in use
+    PageIndex freePages; // pages in the free lists and thread page caches, their content is returned to the OS
+                         // unless the pages are on huge pages
+    PageIndex poolPages; // buffer pool frames, 0 for the in-memory pager
+    u64 poolHits;
+    u64 poolMisses; // pages read from the file or created
+    u64 poolWrites; // dirty pages written back to the file
+    // in-memory pager: allocations which found the thread page cache empty and frees which found it full,
+    // both go to the free list shared by all threads
+    u64 pageCacheRefills;
+    u64 pageCacheSpills;
+    u64 allocationRetries; // lost compare-and-swaps on the shared free list and page count, a measure of contention
+    // in-memory pager: freed pages which may still be read by operations of other threads, counted as free
+    PageIndex retiredPages;
+    u64 epochAdvances;
+    PageIndex snapshotPages; // copies of changed pages kept for open snapshots
+    u8 hugePages; // PAGER_HUGE_PAGES_* the in-memory pages actually got
+};
+typedef struct PagerStats PagerStats;
+
+// reserves address space for maxPages pages, previous pages (if any) are dropped
+void pagerInit(PageIndex maxPages = PAGER_DEFAULT_MAX_PAGES);
+// in-memory pager: placement of the pages on NUMA nodes, takes effect with the next pagerInit;
+// machines with a single node always place pages on it
+#define PAGER_NUMA_FIRST_TOUCH 0 // on the node of the thread which touches a page first, the default;
+                                 // freed pages lose their memory, so threads pinned to a node keep the pages they
+                                 // allocate on it, while a bulk loaded tree stays where its builders ran
+#define PAGER_NUMA_INTERLEAVE 1 // round robin over all nodes, every thread sees the same share of remote pages
+void pagerSetNumaPlacement(u8 placement);
+// in-memory pager: backing of the page array, takes effect with the next pagerInit. Lookups in large trees touch
+// a few random pages each, huge pages let the TLB cover far more of them
+#define PAGER_HUGE_PAGE_SIZE (2ull << 20)
+#define PAGER_HUGE_PAGES_NONE 0
+#define PAGER_HUGE_PAGES_TRANSPARENT 1 // asks the kernel to back the pages by transparent huge pages (MADV_HUGEPAGE)
+// MAP_HUGETLB pages of the default huge page size taken from the pool for the whole reserved size
+// (see /proc/sys/vm/nr_hugepages and the maxPages of pagerInit), transparent ones if the pool is too small
+#define PAGER_HUGE_PAGES_EXPLICIT 2
+void pagerSetHugePages(u8 hugePages);
+void pagerGetStats(PagerStats* stats);
+
+// in-memory pager: copy of the used pages and the allocation state, e.g. of a freshly built tree, restoring it brings
+// back every page (trees keep their roots, which never move) at the cost of a copy. Both have to run while no
+// operation runs and no snapshot is open; pages in the caches of other threads at the time of saving are lost
+// to the image. Restoring to a pager reinitialized since saving aborts
+struct PagerImage;
+PagerImage* pagerSaveImage();
+void pagerRestoreImage(const PagerImage* image);
+void pagerFreeImage(PagerImage* image);
+
+// file mode: pages live in the file and are cached by a pool of poolPages frames with clock eviction,
+// returns 0 if the file can't be opened or isn't a page file; replaces the in-memory pager
+u1 pagerOpen(const char* path, PageIndex poolPages);
+// writes dirty pages and the header (page counts, free list, root) to the file
+void pagerFlush();
+// flushes and closes the file, pagerInit or pagerOpen has to be called before the next use
+void pagerClose();
+// in file mode every page returned by pagerGet*Page or pagerCreateNewPage stays pinned in the pool
+// until the outermost operation of the current thread ends, operations may nest; with per-page or optimistic
+// locking in-memory pages freed by any thread aren't reused before the current operation ends
+void pagerBeginOperation();
+void pagerEndOperation();
+// drops the operation pin of a single page, for operations which walk a lot of pages
+void pagerUnpinPage(Page* page);
+// pins page until pagerClose, for pages referenced by pointer between operations (tree roots)
+Page* pagerPinPage(PageIndex pageIndex);
+// root index stored in the file header, so a tree can be opened again after restart
+void pagerSetRootPageIndex(PageIndex pageIndex);
+u1 pagerGetRootPageIndex(PageIndex* pageIndex);
+
+// pages may be created and freed from any thread, the in-memory pager doesn't lock for that
+Page* pagerCreateNewPage(u8 pageType, u8 pageFormat = PAGER_PAGE_FORMAT_CELLS);
+// reserves count never used pages with consecutive indices (free pages aren't reused), returns the first index;
+// reserved pages are counted as active and have to be initialized by pagerCreateReservedPage
+PageIndex pagerReservePages(PageIndex count);
+// initializes a page reserved by pagerReservePages, different pages may be created concurrently
+Page* pagerCreateReservedPage(PageIndex pageIndex, u8 pageType, u8 pageFormat = PAGER_PAGE_FORMAT_CELLS);
+// with per-page or optimistic locking an in-memory page is reused once all operations running at the time of the free
+// have ended, otherwise at once; cursors keeping pages between operations still have to check versions or locks
 void pagerFreePage(PageIndex pageIndex);
 
 Page* pagerGetReadPage(PageIndex pageIndex);
 Page* pagerGetWritePage(PageIndex pageIndex);
+// hints the CPU to start loading the page header and the middle of its key area, doesn't pin or lock;
+// no-op in file mode, where the page may not be in the pool
+void pagerPrefetchPage(PageIndex pageIndex);
 #if BTREE_LOCK_GRANULARITY_PER_PAGE
+pthread_rwlock_t* pagerGetPageLock(const Page* page);
 void pagerReleasePageLock(Page* page);
 #else
 #   define pagerReleasePageLock(x)
 #endif
 
+#if BTREE_LOCK_GRANULARITY_EXCLUSIVE
+// snapshots of the in-memory pager, returns 0 in file mode; has to be opened while no writer runs. Until the snapshot
+// is closed, pages accessed by writers are copied before they change
+u64 pagerOpenSnapshot();
+// drops copies no open snapshot needs anymore
+void pagerCloseSnapshot(u64 snapshot);
+// pages the current thread gets until the outermost pagerEndSnapshotRead are the ones the snapshot saw
+void pagerBeginSnapshotRead(u64 snapshot);
+void pagerEndSnapshotRead();
+// pages the current thread gets until pagerEndWrites may be changed by it
+void pagerBeginWrites();
+void pagerEndWrites();
+#endif
+
+#if BTREE_LOCK_GRANULARITY_OPTIMISTIC
+// waits until the page isn't locked by a writer and returns its version
+u64 pagerReadPageVersion(const Page* page);
+// checks that the page wasn't modified since the version was read
+u1 pagerValidatePageVersion(const Page* page, u64 version);
+// locks page only if it still has the given version, never waits
+u1 pagerTryLockPage(Page* page, u64 version);
+// waits for the page lock, returns version which page had before locking
+u64 pagerLockPage(Page* page);
+// unlocks all pages locked by the current thread, bumping their versions if they were modified
+void pagerReleaseWriteLocks(u1 modified);
+// unlocks one page locked by the current thread, others stay locked
+void pagerReleaseWriteLock(Page* page, u1 modified);
+#endif
+
 #endif //PAGER_H
@@ -0,0 +1,118 @@
+#include "types.h"
+#include "perf.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#endif
+
+static const char* perfEventNames[PERF_EVENTS_COUNT] = {
+    "cycles", "instructions", "l1d_misses", "llc_misses", "dtlb_misses", "branch_misses"
+};
+
+#if defined(__linux__)
+static void describeEvent(u8 event, perf_event_attr* attr) {
+    u64 readMiss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    switch (event) {
+        case PERF_EVENT_CYCLES:
+            attr->type = PERF_TYPE_HARDWARE;
+            attr->config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case PERF_EVENT_INSTRUCTIONS:
+            attr->type = PERF_TYPE_HARDWARE;
+            attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case PERF_EVENT_L1D_MISSES:
+            attr->type = PERF_TYPE_HW_CACHE;
+            attr->config = PERF_COUNT_HW_CACHE_L1D | readMiss;
+            break;
+        case PERF_EVENT_LLC_MISSES:
+            attr->type = PERF_TYPE_HARDWARE;
+            attr->config = PERF_COUNT_HW_CACHE_MISSES;
+            break;
+        case PERF_EVENT_DTLB_MISSES:
+            attr->type = PERF_TYPE_HW_CACHE;
+            attr->config = PERF_COUNT_HW_CACHE_DTLB | readMiss;
+            break;
+        default:
+            attr->type = PERF_TYPE_HARDWARE;
+            attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+    }
+}
+#endif
+
+u8 perfOpen(PerfCounters* counters) {
+    u8 opened = 0;
+    counters->running = 0;
+    for (u8 i = 0; i < PERF_EVENTS_COUNT; ++i) {
+        counters->fds[i] = -1;
+        counters->values[i] = 0;
+#if defined(__linux__)
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        describeEvent(i, &attr);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // events are opened one by one rather than as a group, so a missing one doesn't take the others down;
+        // the times tell how long the kernel actually counted an event it had to share the PMU for
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        counters->fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counters->fds[i] >= 0)
+            ++opened;
+#endif
+    }
+    return opened;
+}
+
+void perfStart(PerfCounters* counters) {
+#if defined(__linux__)
+    for (u8 i = 0; i < PERF_EVENTS_COUNT; ++i) {
+        if (counters->fds[i] >= 0)
+            ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+    counters->running = 1;
+}
+
+void perfStop(PerfCounters* counters) {
+    if (!counters->running)
+        return;
+    counters->running = 0;
+#if defined(__linux__)
+    for (u8 i = 0; i < PERF_EVENTS_COUNT; ++i) {
+        if (counters->fds[i] < 0)
+            continue;
+        ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        // value and times keep growing over all enabled intervals, so the scaled total replaces the previous one
+        u64 data[3];
+        if (read(counters->fds[i], data, sizeof(data)) != sizeof(data))
+            continue;
+        counters->values[i] = data[2] == 0 ? 0 : (u64)((double)data[0] * data[1] / data[2]);
+    }
+#endif
+}
+
+void perfClose(PerfCounters* counters) {
+    perfStop(counters);
+#if defined(__linux__)
+    for (u8 i = 0; i < PERF_EVENTS_COUNT; ++i) {
+        if (counters->fds[i] >= 0)
+            close(counters->fds[i]);
+        counters->fds[i] = -1;
+    }
+#endif
+}
+
+u1 perfAvailable(const PerfCounters* counters, u8 event) {
+    return counters->fds[event] >= 0;
+}
+
+const char* perfEventName(u8 event) {
+    return perfEventNames[event];
+}
@@ -0,0 +1,35 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include "types.h"
+
+// hardware events counted by perf_event_open for the calling thread, user space only
+#define PERF_EVENT_CYCLES 0
+#define PERF_EVENT_INSTRUCTIONS 1
+#define PERF_EVENT_L1D_MISSES 2 // L1 data cache read misses
+#define PERF_EVENT_LLC_MISSES 3 // last level cache misses
+#define PERF_EVENT_DTLB_MISSES 4 // data TLB read misses
+#define PERF_EVENT_BRANCH_MISSES 5
+#define PERF_EVENTS_COUNT 6
+
+struct PerfCounters {
+    // -1 for events the kernel refused to count (no PMU in a VM, perf_event_paranoid, unsupported event)
+    int fds[PERF_EVENTS_COUNT];
+    // counts of all closed start/stop intervals, scaled up when the kernel multiplexed the event
+    u64 values[PERF_EVENTS_COUNT];
+    u1 running;
+};
+typedef struct PerfCounters PerfCounters;
+
+// opens the events for the calling thread stopped and zeroed, returns the amount of events which can be counted;
+// counters can only be started, stopped and read by the thread which opened them
+u8 perfOpen(PerfCounters* counters);
+void perfStart(PerfCounters* counters);
+// adds the counts since perfStart to values
+void perfStop(PerfCounters* counters);
+void perfClose(PerfCounters* counters);
+u1 perfAvailable(const PerfCounters* counters, u8 event);
+// short name of the event, used for benchmark counters
+const char* perfEventName(u8 event);
+
+#endif //PERF_H
@@ -1,4 +1,19 @@
 #define USE_CUSTOM_COMPILED_BENCHMARK 0
+// benchmarks which count per thread report hardware events and tree structure changes per operation
+#define USE_THREAD_COUNTERS 1
+// benchmarks of cursor operations report latency percentiles, off by default as two clock reads per operation
+// slow the operations down noticeably
+#define USE_LATENCY_HISTOGRAMS 0
+// benchmark threads are pinned to CPUs: BENCHMARK_PIN_SPREAD puts thread i on node i % nodes,
+// BENCHMARK_PIN_COMPACT fills the CPUs of a node before the next one; pinned threads report their throughput per node
+#define BENCHMARK_PIN_NONE 0
+#define BENCHMARK_PIN_SPREAD 1
+#define BENCHMARK_PIN_COMPACT 2
+#define PIN_BENCHMARK_THREADS BENCHMARK_PIN_NONE
+// PAGER_NUMA_* placement of the pages of the trees the benchmarks build
+#define BENCHMARK_NUMA_PLACEMENT PAGER_NUMA_FIRST_TOUCH
+// PAGER_HUGE_PAGES_* backing of the pages of the trees the benchmarks build, BM_LookupHugePages compares them
+#define BENCHMARK_HUGE_PAGES PAGER_HUGE_PAGES_NONE
 
 
 #if USE_CUSTOM_COMPILED_BENCHMARK
@@ -9,11 +24,21 @@
 #include "types.h"
 #include "btree_base.h"
 #include "pager.h"
+#include "utils.h"
+#include "wal.h"
+#include "perf.h"
+#include "numa.h"
+#include "sharded_btree.h"
 #include <iostream>
 #include <pthread.h>
 #include <chrono>
 #include <random>
 #include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cmath>
+#include <thread>
 
 #define BENCHMARK_SHARED_SETTINGS \
     ->Unit(benchmark::kMillisecond) \
@@ -21,48 +46,292 @@
 	->MeasureProcessCPUTime() \
 	->UseRealTime()
 
+// benchmarks which prepare every iteration report its time measured by hand, from the start of all threads
+// to the end of the last one
+#define BENCHMARK_ITERATION_SETTINGS \
+    ->Unit(benchmark::kMillisecond) \
+    ->ThreadRange(1, 8) \
+	->MeasureProcessCPUTime() \
+	->UseManualTime()
+
+// thread 0 prepares unpinned, so the threads it starts (e.g. to bulk load a tree) aren't stuck to its CPU
 #define SINGLE_THREAD_PREPARATION(x) \
     if(state.thread_index() == 0) { \
+        unpinBenchmarkThread(); \
+        pagerSetNumaPlacement(BENCHMARK_NUMA_PLACEMENT); \
+        pagerSetHugePages(BENCHMARK_HUGE_PAGES); \
         x \
-        pthread_rwlock_init(&generatorLock, nullptr); \
-        pthread_rwlock_init(&runningLock, nullptr); \
+        pthread_barrier_init(&iterationBarrier, nullptr, state.threads()); \
+        preparationSeconds = 0; \
     } \
-    u64 iterationIdx = 0; \
-    u64 lastPreparationIdx = 0;
+    pinBenchmarkThread(state);
 
+// thread 0 runs preparationCode (usually RESTORE_TREE_IMAGE) while the others wait, then all threads start
+// the iteration together
 #define THREAD_PREPARE_ITERATION(preparationCode) \
     state.PauseTiming(); \
-    ++iterationIdx; \
-    if(lastPreparationIdx < iterationIdx) { \
-        pthread_rwlock_wrlock(&generatorLock); \
-        if (lastPreparationIdx < iterationIdx) { \
-            pthread_rwlock_wrlock(&runningLock); \
-            preparationCode; \
-            lastPreparationIdx = iterationIdx; \
-            pthread_rwlock_unlock(&runningLock); \
-        } \
-        pthread_rwlock_unlock(&generatorLock); \
+    pauseThreadCounters(); \
+    pthread_barrier_wait(&iterationBarrier); \
+    if (state.thread_index() == 0) { \
+        u64 preparationStart = harnessNow(); \
+        preparationCode; \
+        preparationSeconds += (harnessNow() - preparationStart) / 1e9; \
+        iterationEnd = 0; \
     } \
-    pthread_rwlock_rdlock(&runningLock); \
+    pthread_barrier_wait(&iterationBarrier); \
+    if (state.thread_index() == 0) \
+        iterationStart = harnessNow(); \
+    resumeThreadCounters(); \
     state.ResumeTiming();
 
+// the iteration lasts until the last thread completes it
 #define THREAD_COMPLETE_ITERATION(cleanupCode) \
+    { \
+        u64 threadEnd = harnessNow(); \
+        u64 lastEnd = iterationEnd.load(); \
+        while (threadEnd > lastEnd && !iterationEnd.compare_exchange_weak(lastEnd, threadEnd)); \
+    } \
     state.PauseTiming(); \
-    pthread_rwlock_unlock(&runningLock); \
+    pauseThreadCounters(); \
+    pthread_barrier_wait(&iterationBarrier); \
+    state.SetIterationTime((iterationEnd.load() - iterationStart) / 1e9); \
     cleanupCode \
+    resumeThreadCounters(); \
     state.ResumeTiming();
 
 #define SINGLE_THREAD_CLEANUP(x) \
     if(state.thread_index() == 0) { \
         x \
-        pthread_rwlock_destroy(&generatorLock); \
-        pthread_rwlock_destroy(&runningLock); \
+        reportTreeImage(state); \
+        pthread_barrier_destroy(&iterationBarrier); \
+    }
+
+// in SINGLE_THREAD_PREPARATION: builds the tree on a fresh pager once per run and saves the pager image,
+// which the iterations restore instead of building the tree again; the build time is reported apart
+#define BUILD_TREE_IMAGE(buildCode) \
+    { \
+        u64 buildStart = harnessNow(); \
+        pagerInit(); \
+        buildCode; \
+        treeBuildSeconds = (harnessNow() - buildStart) / 1e9; \
+        treeImage = pagerSaveImage(); \
     }
 
+#define RESTORE_TREE_IMAGE() pagerRestoreImage(treeImage)
+
 #define SEED 1832923
 
+// trees built for a run are bulk loaded in parallel to keep the untimed part short
+#define PREPARATION_BULK_LOAD_THREADS 4
+
 using namespace std;
 
+pthread_barrier_t iterationBarrier;
+// steady clock nanoseconds of the start of the current iteration and of the end of its last thread
+u64 iterationStart;
+std::atomic<u64> iterationEnd;
+double preparationSeconds;
+PagerImage* treeImage;
+double treeBuildSeconds;
+
+static u64 harnessNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// node the benchmark thread is pinned to, -1 if it isn't pinned
+thread_local int benchmarkThreadNode = -1;
+
+static void pinBenchmarkThread(benchmark::State &state) {
+#if PIN_BENCHMARK_THREADS != BENCHMARK_PIN_NONE
+    u32 cpus[NUMA_MAX_CPUS];
+    // nodes with memory only are skipped
+    u32 nodes[NUMA_MAX_NODES];
+    u32 nodesCount = 0;
+    u32 cpusTotal = 0;
+    for (u32 node = 0; node < numaNodes(); ++node) {
+        u32 count = numaNodeCpus(node, cpus, NUMA_MAX_CPUS);
+        if (count > 0)
+            nodes[nodesCount++] = node;
+        cpusTotal += count;
+    }
+    if (nodesCount == 0)
+        return;
+    u32 thread = state.thread_index();
+    u32 node = nodes[0];
+    u32 slot = 0;
+#if PIN_BENCHMARK_THREADS == BENCHMARK_PIN_SPREAD
+    node = nodes[thread % nodesCount];
+    slot = thread / nodesCount;
+#else
+    slot = thread % cpusTotal;
+    for (u32 i = 0; i < nodesCount; ++i) {
+        u32 count = numaNodeCpus(nodes[i], cpus, NUMA_MAX_CPUS);
+        if (slot < count) {
+            node = nodes[i];
+            break;
+        }
+        slot -= count;
+    }
+#endif
+    // more threads than CPUs share them
+    u32 count = numaNodeCpus(node, cpus, NUMA_MAX_CPUS);
+    if (numaPinThread(cpus[slot % count]))
+        benchmarkThreadNode = node;
+#else
+    (void)state;
+#endif
+}
+
+static void unpinBenchmarkThread() {
+    if (benchmarkThreadNode < 0)
+        return;
+    numaUnpinThread();
+    benchmarkThreadNode = -1;
+}
+
+// build time and average iteration preparation time of the run, the image is dropped
+static void reportTreeImage(benchmark::State &state) {
+    if (treeImage == nullptr)
+        return;
+    state.counters["build_ms"] = treeBuildSeconds * 1000;
+    state.counters["preparation_ms"] = state.iterations() > 0 ? preparationSeconds * 1000 / state.iterations() : 0;
+    pagerFreeImage(treeImage);
+    treeImage = nullptr;
+}
+
+// counters of the benchmark thread between startThreadCounters and reportThreadCounters,
+// the untimed parts of iterations are left out
+struct ThreadCounters {
+    PerfCounters perf;
+    BtreeEvents events;
+    BtreeEvents eventsAtResume;
+    u1 active;
+};
+thread_local ThreadCounters threadCounters;
+std::atomic<u1> perfUnavailableReported(0);
+
+static void pauseThreadCounters() {
+    if (!threadCounters.active)
+        return;
+    perfStop(&threadCounters.perf);
+    BtreeEvents now;
+    BtreeGetThreadEvents(&now);
+    threadCounters.events.splits += now.splits - threadCounters.eventsAtResume.splits;
+    threadCounters.events.merges += now.merges - threadCounters.eventsAtResume.merges;
+    threadCounters.events.vacuums += now.vacuums - threadCounters.eventsAtResume.vacuums;
+    threadCounters.events.freeCellReuses += now.freeCellReuses - threadCounters.eventsAtResume.freeCellReuses;
+}
+
+static void resumeThreadCounters() {
+    if (!threadCounters.active)
+        return;
+    BtreeGetThreadEvents(&threadCounters.eventsAtResume);
+    perfStart(&threadCounters.perf);
+}
+
+// called by every thread of the benchmark right before its loop
+static void startThreadCounters() {
+#if USE_THREAD_COUNTERS
+    if (perfOpen(&threadCounters.perf) < PERF_EVENTS_COUNT && !perfUnavailableReported.exchange(1)) {
+        fprintf(stderr, "some hardware counters can't be opened (no PMU or perf_event_paranoid > 2?), "
+                        "they aren't reported\n");
+    }
+    threadCounters.events = {};
+    threadCounters.active = 1;
+    resumeThreadCounters();
+#endif
+}
+
+// operations is the amount done by the calling thread, every counter is reported per operation
+// and averaged over the threads
+static void reportThreadCounters(benchmark::State &state, u64 operations) {
+    if (!threadCounters.active)
+        return;
+    pauseThreadCounters();
+    threadCounters.active = 0;
+    double divisor = operations > 0 ? operations : 1;
+    auto perOperation = [&](const char* name, u64 value) {
+        state.counters[name] = benchmark::Counter(value / divisor, benchmark::Counter::kAvgThreads);
+    };
+    for (u8 i = 0; i < PERF_EVENTS_COUNT; ++i) {
+        if (perfAvailable(&threadCounters.perf, i))
+            perOperation(perfEventName(i), threadCounters.perf.values[i]);
+    }
+    if (perfAvailable(&threadCounters.perf, PERF_EVENT_CYCLES)
+        && perfAvailable(&threadCounters.perf, PERF_EVENT_INSTRUCTIONS)
+        && threadCounters.perf.values[PERF_EVENT_CYCLES] > 0) {
+        state.counters["ipc"] = benchmark::Counter((double)threadCounters.perf.values[PERF_EVENT_INSTRUCTIONS]
+                                                   / threadCounters.perf.values[PERF_EVENT_CYCLES],
+                                                   benchmark::Counter::kAvgThreads);
+    }
+    perfClose(&threadCounters.perf);
+    perOperation("splits", threadCounters.events.splits);
+    perOperation("merges", threadCounters.events.merges);
+    perOperation("vacuums", threadCounters.events.vacuums);
+    perOperation("free_cell_reuses", threadCounters.events.freeCellReuses);
+    if (benchmarkThreadNode >= 0) {
+        // summed over the threads of the node
+        string node = "node" + to_string(benchmarkThreadNode);
+        state.counters[node + "_items"] = benchmark::Counter(operations, benchmark::Counter::kIsRate);
+        state.counters[node + "_threads"] = 1;
+    }
+}
+
+// called by every thread of the benchmark right before its loop, only thread 0 starts recording
+// (other threads can't pass the start of the loop before it)
+static void startLatencyRecording(benchmark::State &state) {
+#if USE_LATENCY_HISTOGRAMS
+    if (state.thread_index() != 0)
+        return;
+    BtreeResetLatencies();
+    BtreeRecordLatencies(1);
+#else
+    (void)state;
+#endif
+}
+
+#if USE_LATENCY_HISTOGRAMS
+static const char* latencyOperationNames[BTREE_LATENCY_OPERATIONS] = { "move_to", "insert", "remove" };
+#endif
+
+// percentiles in nanoseconds of the operations of all threads, operations which split or merged pages
+// (structure modifications) are reported apart as <operation>_smo_*
+static void reportLatencies(benchmark::State &state) {
+#if USE_LATENCY_HISTOGRAMS
+    if (state.thread_index() != 0)
+        return;
+    BtreeRecordLatencies(0);
+    BtreeLatencies* latencies = new BtreeLatencies;
+    BtreeCollectLatencies(latencies);
+    for (u8 structural = 0; structural < 2; ++structural) {
+        for (u8 operation = 0; operation < BTREE_LATENCY_OPERATIONS; ++operation) {
+            const BtreeLatencyHistogram* histogram = &latencies->histograms[structural][operation];
+            if (histogram->total == 0)
+                continue;
+            string prefix = string(latencyOperationNames[operation]) + (structural ? "_smo" : "");
+            state.counters[prefix + "_p50"] = BtreeLatencyPercentile(histogram, 50);
+            state.counters[prefix + "_p99"] = BtreeLatencyPercentile(histogram, 99);
+            state.counters[prefix + "_p999"] = BtreeLatencyPercentile(histogram, 99.9);
+            state.counters[prefix + "_max"] = histogram->max;
+        }
+    }
+    delete latencies;
+#else
+    (void)state;
+#endif
+}
+
+// levels from the root to the leaves, all leaves are at the same one
+static u8 treeDepth(Btree* tree) {
+    Cursor cursor;
+    BtreeInitCursor(tree, &cursor, 0);
+    BtreeCursorMoveTo(&cursor, 0);
+    u8 depth = cursor.depth + 1;
+    BtreeReleaseCursor(&cursor);
+    return depth;
+}
+
 static void generateData(u64 *keys, u64 *values, u64 dataSize, u64 keyDensity) {
     for (u64 i = 0; i < dataSize; ++i) {
         keys[i] = i * keyDensity;
@@ -70,7 +339,7 @@ static void generateData(u64 *keys, u64 *values, u64 dataSize, u64 keyDensity) {
     }
 }
 
-static int generateData2_weightedValue(mt19937_64 &rng) {
+static u64 generateData2_weightedValue(mt19937_64 &rng) {
 	u64 bytes = rng();
     bytes %= 100000;
     if(bytes < 4460) {
@@ -111,51 +380,55 @@ static void generateData2(u64 *keys, u64 *values, u64 dataSize, u64 keyDensity)
 
 Btree *seqWriteBtree;
 u64 generatedBtreeVersion;
-pthread_rwlock_t generatorLock, runningLock;
 u64 *keys, *values;
 
-static void BM_DbWorkload(benchmark::State& state) {
+// buffered runs the same operations against a write buffered tree
+static void runDbWorkload(benchmark::State& state, u1 buffered) {
 	u64 dataSize = state.range(0);
     SINGLE_THREAD_PREPARATION(
         keys = new u64[dataSize];
         values = new u64[dataSize];
         generateData2(keys, values, dataSize, 10);
         std::sort(keys, keys + dataSize);
+        BUILD_TREE_IMAGE(
+            delete seqWriteBtree;
+            seqWriteBtree = BtreeCreateTree(keys, values, dataSize, PAGER_PAGE_FORMAT_CELLS, 100, PREPARATION_BULK_LOAD_THREADS,
+                                            buffered);
+        )
     );
 
     u64 offset = state.thread_index() % 10 + 1;
     auto start = std::chrono::high_resolution_clock::now();
     auto end = std::chrono::high_resolution_clock::now();
     u64 iters = 0;
+    startThreadCounters();
+    startLatencyRecording(state);
     for (auto _ : state) {
-        THREAD_PREPARE_ITERATION(
-        	delete seqWriteBtree;
-            pagerInit(100000);
-            seqWriteBtree = BtreeCreateTree(keys, values, dataSize);
-        )
+        THREAD_PREPARE_ITERATION(RESTORE_TREE_IMAGE())
 
         ++iters;
-        Cursor* cursor;
+        // one cursor on the stack is rebound for every operation, nothing is allocated in the loop
+        Cursor cursor;
+        BtreeInitCursor(seqWriteBtree, &cursor, 0, offset - 1);
 
         for(u64 i = 0; i < dataSize / 10; ++i) {
 			u64 opCode = ((i + offset) * (i + offset) % 1000007) % 3;
         	u1 isWriteCursor = opCode != 0 ? 1 : 0;
 
-        	BtreeCreateCursor(seqWriteBtree, &cursor, isWriteCursor, offset - 1);
+        	BtreeRebindCursor(seqWriteBtree, &cursor, isWriteCursor, offset - 1);
         	u64 trueIdx = dataSize / 10 * offset + i;
 
-            BtreeCursorMoveTo(cursor, keys[trueIdx]);
+            BtreeCursorMoveTo(&cursor, keys[trueIdx]);
 
             TRACE(("opCode %llu", opCode));
 
             if(opCode == 1) {
-                BtreeCursorInsertEntry(seqWriteBtree, cursor, keys[trueIdx] + offset, 42);
+                BtreeCursorInsertEntry(seqWriteBtree, &cursor, keys[trueIdx] + offset, 42);
             } else if(opCode == 2) {
-            	BtreeCursorRemoveEntry(cursor);
+            	BtreeCursorRemoveEntry(&cursor);
             }
-
-            BtreeDestroyCursor(seqWriteBtree, cursor, offset - 1);
         }
+        BtreeReleaseCursor(&cursor, offset - 1);
 
         end = std::chrono::high_resolution_clock::now();
         THREAD_COMPLETE_ITERATION()
@@ -164,17 +437,39 @@ static void BM_DbWorkload(benchmark::State& state) {
     auto elapsed_seconds = std::chrono::duration_cast<std::chrono::duration<double>>(end - start);
 
     printf("TOTAL %f (%llu) %llu\n", elapsed_seconds.count(), offset, iters);
+    reportThreadCounters(state, iters * (dataSize / 10));
+    reportLatencies(state);
+
+    if (buffered && state.thread_index() == 0) {
+        BtreeStats stats;
+        BtreeCollectStats(seqWriteBtree, &stats);
+        state.counters["pending_messages"] = stats.messages;
+    }
 
     SINGLE_THREAD_CLEANUP(
+        state.counters["depth"] = treeDepth(seqWriteBtree);
     	delete[] keys;
         delete[] values;
     )
 }
+
+static void BM_DbWorkload(benchmark::State& state) {
+    runDbWorkload(state, 0);
+}
 BENCHMARK(BM_DbWorkload)
     ->RangeMultiplier(10)
     ->Range(1000, 10000000L) // 1k - 10mln
     //->Iterations(10)
-    BENCHMARK_SHARED_SETTINGS;
+    BENCHMARK_ITERATION_SETTINGS;
+
+// same mix against a tree whose inner pages buffer the writes
+static void BM_BufferedDbWorkload(benchmark::State& state) {
+    runDbWorkload(state, 1);
+}
+BENCHMARK(BM_BufferedDbWorkload)
+    ->RangeMultiplier(10)
+    ->Range(1000, 10000000L) // 1k - 10mln
+    BENCHMARK_ITERATION_SETTINGS;
 
 static void BM_RemoveOnly(benchmark::State& state) {
     u64 dataSize = state.range(0);
@@ -182,18 +477,20 @@ static void BM_RemoveOnly(benchmark::State& state) {
         keys = new u64[dataSize];
         values = new u64[dataSize];
         generateData(keys, values, dataSize, 10);
+        BUILD_TREE_IMAGE(
+            delete seqWriteBtree;
+            seqWriteBtree = BtreeCreateTree(keys, values, dataSize, PAGER_PAGE_FORMAT_CELLS, 100, PREPARATION_BULK_LOAD_THREADS);
+        )
     );
 
     u64 offset = state.thread_index() % 10 + 1;
     auto start = std::chrono::high_resolution_clock::now();
     auto end = std::chrono::high_resolution_clock::now();
     u64 iters = 0;
+    startThreadCounters();
+    startLatencyRecording(state);
     for (auto _ : state) {
-        THREAD_PREPARE_ITERATION(
-        	delete seqWriteBtree;
-            pagerInit(100000);
-            seqWriteBtree = BtreeCreateTree(keys, values, dataSize);
-        )
+        THREAD_PREPARE_ITERATION(RESTORE_TREE_IMAGE())
 
     	++iters;
         Cursor* cursor;
@@ -222,8 +519,11 @@ static void BM_RemoveOnly(benchmark::State& state) {
     auto elapsed_seconds = std::chrono::duration_cast<std::chrono::duration<double>>(end - start);
 
     printf("TOTAL %f (%llu) %llu\n", elapsed_seconds.count(), offset, iters);
+    reportThreadCounters(state, iters * (dataSize / 10));
+    reportLatencies(state);
 
     SINGLE_THREAD_CLEANUP(
+        state.counters["depth"] = treeDepth(seqWriteBtree);
     	delete[] keys;
         delete[] values;
     )
@@ -232,7 +532,273 @@ BENCHMARK(BM_RemoveOnly)
     ->RangeMultiplier(10)
     ->Range(1000, 10000000L) // 1k - 10mln
     //->Iterations(10)
-    BENCHMARK_SHARED_SETTINGS;
+    BENCHMARK_ITERATION_SETTINGS;
+
+Btree *rangeDeleteBtree;
+
+// removes a contiguous range of range(1) percent of the entries from the middle of a freshly built tree, entry by
+// entry through a write cursor (range(2) == 0) or with one BtreeDeleteRange call (range(2) == 1)
+static void BM_DeleteRange(benchmark::State& state) {
+    u64 dataSize = state.range(0);
+    u64 rangeSize = dataSize * state.range(1) / 100;
+    u1 ranged = state.range(2);
+    SINGLE_THREAD_PREPARATION(
+        keys = new u64[dataSize];
+        values = new u64[dataSize];
+        generateData(keys, values, dataSize, 10);
+        BUILD_TREE_IMAGE(
+            rangeDeleteBtree = BtreeCreateTree(keys, values, dataSize, PAGER_PAGE_FORMAT_CELLS, 100,
+                                               PREPARATION_BULK_LOAD_THREADS);
+        )
+    )
+
+    u64 from = (dataSize - rangeSize) / 2;
+    u64 removed = 0;
+    for (auto _ : state) {
+        THREAD_PREPARE_ITERATION(RESTORE_TREE_IMAGE())
+        if (ranged) {
+            removed = BtreeDeleteRange(rangeDeleteBtree, keys[from], keys[from + rangeSize - 1]);
+        } else {
+            Cursor cursor;
+            BtreeInitCursor(rangeDeleteBtree, &cursor, 1);
+            removed = 0;
+            for (u64 i = from; i < from + rangeSize; ++i) {
+                BtreeCursorMoveTo(&cursor, keys[i]);
+                removed += BtreeCursorRemoveEntry(&cursor);
+            }
+            BtreeReleaseCursor(&cursor);
+        }
+        THREAD_COMPLETE_ITERATION()
+    }
+    state.SetItemsProcessed(state.iterations() * rangeSize);
+
+    SINGLE_THREAD_CLEANUP(
+        PagerStats pagerStats;
+        pagerGetStats(&pagerStats);
+        state.counters["removed"] = removed;
+        state.counters["active_pages"] = pagerStats.activePages;
+        delete rangeDeleteBtree;
+        delete[] keys;
+        delete[] values;
+    )
+}
+BENCHMARK(BM_DeleteRange)
+    ->ArgsProduct({{100000, 1000000, 10000000}, {1, 10, 50}, {0, 1}})
+    ->ArgNames({"size", "percent", "ranged"})
+    ->Unit(benchmark::kMillisecond)
+    ->Threads(1)
+    ->MeasureProcessCPUTime()
+    ->UseManualTime();
+
+Btree *rangeCountBtree;
+
+// counts a contiguous range of range(1) percent of the entries by scanning it with a cursor (range(2) == 0)
+// or with BtreeCountRange (range(2) == 1)
+static void BM_CountRange(benchmark::State& state) {
+    u64 dataSize = state.range(0);
+    u64 rangeSize = dataSize * state.range(1) / 100;
+    u1 counted = state.range(2);
+    const u64 keyDensity = 10;
+    SINGLE_THREAD_PREPARATION(
+        keys = new u64[dataSize];
+        values = new u64[dataSize];
+        generateData(keys, values, dataSize, keyDensity);
+        pagerInit();
+        rangeCountBtree = BtreeCreateTree(keys, values, dataSize);
+    )
+
+    // other threads may get here before thread 0 generates keys, the bounds follow the layout of generateData
+    u64 from = (dataSize - rangeSize) / 2;
+    u64 lo = from * keyDensity;
+    u64 hi = (from + rangeSize - 1) * keyDensity;
+    u64 count = 0;
+    for (auto _ : state) {
+        if (counted) {
+            count = BtreeCountRange(rangeCountBtree, lo, hi);
+        } else {
+            Cursor cursor;
+            BtreeInitCursor(rangeCountBtree, &cursor, 0);
+            BtreeCursorMoveTo(&cursor, lo);
+            count = 0;
+            u64 key;
+            u64 value;
+            while (BtreeCursorReadData(&cursor, &key, &value) == 0 && key <= hi) {
+                ++count;
+                if (!BtreeCursorNextEntry(&cursor))
+                    break;
+            }
+            BtreeReleaseCursor(&cursor);
+        }
+        benchmark::DoNotOptimize(count);
+    }
+    state.SetItemsProcessed(state.iterations() * rangeSize);
+
+    SINGLE_THREAD_CLEANUP(
+        state.counters["count"] = count;
+        delete rangeCountBtree;
+        delete[] keys;
+        delete[] values;
+    )
+}
+BENCHMARK(BM_CountRange)
+    ->ArgsProduct({{100000, 1000000, 10000000}, {1, 10, 50}, {0, 1}})
+    ->ArgNames({"size", "percent", "counted"})
+    ->Unit(benchmark::kMicrosecond)
+    ->ThreadRange(1, 8)
+    ->MeasureProcessCPUTime()
+    ->UseRealTime();
+
+Btree *reclaimBtree;
+std::atomic<u64> reclaimOrderErrors;
+
+// even threads remove 90% of their slice of the keys and insert them back, freeing and reusing pages, while odd
+// threads scan the whole tree; a scan which sees keys out of order counts an error
+static void BM_RemoveUnderScans(benchmark::State& state) {
+    u64 dataSize = state.range(0);
+    SINGLE_THREAD_PREPARATION(
+        keys = new u64[dataSize];
+        values = new u64[dataSize];
+        generateData(keys, values, dataSize, 10);
+        pagerInit();
+        reclaimBtree = BtreeCreateTree(keys, values, dataSize);
+        reclaimOrderErrors = 0;
+    )
+
+    u64 idx = state.thread_index();
+    u1 writer = idx % 2 == 0;
+    u64 writers = (state.threads() + 1) / 2;
+    u64 from = dataSize * (idx / 2) / writers;
+    u64 to = dataSize * (idx / 2 + 1) / writers;
+    u64 operations = 0;
+    for (auto _ : state) {
+        Cursor cursor;
+        BtreeInitCursor(reclaimBtree, &cursor, writer, idx);
+        if (writer) {
+            for (u64 i = from; i < to; ++i) {
+                if (i % 10 == 0)
+                    continue;
+                BtreeCursorMoveTo(&cursor, keys[i]);
+                BtreeCursorRemoveEntry(&cursor);
+            }
+            for (u64 i = from; i < to; ++i) {
+                if (i % 10 == 0)
+                    continue;
+                BtreeCursorMoveTo(&cursor, keys[i]);
+                BtreeCursorInsertEntry(reclaimBtree, &cursor, keys[i], values[i]);
+            }
+            operations += (to - from) * 2;
+        } else {
+            u64 key, value, previous = 0;
+            BtreeCursorFirstLeaf(&cursor);
+            do {
+                BtreeCursorReadData(&cursor, &key, &value);
+                if (key < previous)
+                    ++reclaimOrderErrors;
+                previous = key;
+                ++operations;
+            } while (BtreeCursorNextEntry(&cursor));
+        }
+        BtreeReleaseCursor(&cursor, idx);
+    }
+    state.SetItemsProcessed(operations);
+
+    SINGLE_THREAD_CLEANUP(
+        PagerStats pagerStats;
+        pagerGetStats(&pagerStats);
+        state.counters["order_errors"] = reclaimOrderErrors.load();
+        state.counters["epoch_advances"] = pagerStats.epochAdvances;
+        state.counters["retired_pages"] = pagerStats.retiredPages;
+        delete reclaimBtree;
+        delete[] keys;
+        delete[] values;
+    )
+}
+BENCHMARK(BM_RemoveUnderScans)
+    ->RangeMultiplier(10)
+    ->Range(10000, 1000000L)
+    ->Unit(benchmark::kMillisecond)
+    ->ThreadRange(2, 8)
+    ->MeasureProcessCPUTime()
+    ->UseRealTime();
+
+Btree *scanWritersBtree;
+std::atomic<u64> scanWritersScanned;
+std::atomic<u64> scanWritersWrites;
+std::atomic<u64> scanWritersRounds;
+
+// an iteration is a scan of the whole tree by thread 0 through a read cursor (range(1) == 0) or a snapshot cursor
+// (range(1) == 1); until it ends the other threads remove and insert back keys of their slice, 16 changes per write
+// cursor. Under exclusive locking a read cursor keeps the writers waiting for the whole scan, a snapshot cursor lets
+// them copy the pages they change
+static void BM_ScanWithWriters(benchmark::State& state) {
+    u64 dataSize = state.range(0);
+    u1 snapshot = state.range(1);
+    SINGLE_THREAD_PREPARATION(
+        keys = new u64[dataSize];
+        values = new u64[dataSize];
+        generateData(keys, values, dataSize, 10);
+        pagerInit();
+        scanWritersBtree = BtreeCreateTree(keys, values, dataSize);
+        scanWritersScanned = 0;
+        scanWritersWrites = 0;
+        scanWritersRounds = 0;
+    )
+
+    u64 idx = state.thread_index();
+    u64 writers = state.threads() - 1;
+    u64 from = writers == 0 ? 0 : dataSize * (idx - 1) / writers;
+    u64 to = writers == 0 ? 0 : dataSize * idx / writers;
+    u64 next = from;
+    u64 round = 0;
+    for (auto _ : state) {
+        Cursor cursor;
+        if (idx == 0) {
+            if (snapshot)
+                BtreeInitSnapshotCursor(scanWritersBtree, &cursor);
+            else
+                BtreeInitCursor(scanWritersBtree, &cursor, 0, idx);
+            u64 key, value, scanned = 0;
+            BtreeCursorFirstLeaf(&cursor);
+            do {
+                BtreeCursorReadData(&cursor, &key, &value);
+                ++scanned;
+            } while (BtreeCursorNextEntry(&cursor));
+            BtreeReleaseCursor(&cursor, idx);
+            scanWritersScanned += scanned;
+            ++scanWritersRounds;
+            continue;
+        }
+        u64 writes = 0;
+        while (scanWritersRounds.load() <= round) {
+            BtreeInitCursor(scanWritersBtree, &cursor, 1, idx);
+            for (u8 i = 0; i < 16; i += 2) {
+                BtreeCursorMoveTo(&cursor, keys[next]);
+                BtreeCursorRemoveEntry(&cursor);
+                BtreeCursorMoveTo(&cursor, keys[next]);
+                BtreeCursorInsertEntry(scanWritersBtree, &cursor, keys[next], values[next]);
+                next = next + 1 == to ? from : next + 1;
+            }
+            BtreeReleaseCursor(&cursor, idx);
+            writes += 16;
+        }
+        scanWritersWrites += writes;
+        ++round;
+    }
+
+    SINGLE_THREAD_CLEANUP(
+        state.counters["scanned"] = benchmark::Counter(scanWritersScanned.load(), benchmark::Counter::kIsRate);
+        state.counters["writes"] = benchmark::Counter(scanWritersWrites.load(), benchmark::Counter::kIsRate);
+        delete scanWritersBtree;
+        delete[] keys;
+        delete[] values;
+    )
+}
+BENCHMARK(BM_ScanWithWriters)
+    ->ArgsProduct({{100000, 1000000}, {0, 1}})
+    ->ArgNames({"size", "snapshot"})
+    ->ThreadRange(2, 8)
+    ->MinTime(1)
+    ->UseRealTime();
 
 static void BM_InsertOnly(benchmark::State &state) {
     u64 dataSize = state.range(0);
@@ -241,6 +807,10 @@ static void BM_InsertOnly(benchmark::State &state) {
         values = new u64[dataSize];
         generateData2(keys, values, dataSize, 10);
         std::sort(keys, keys + dataSize);
+        BUILD_TREE_IMAGE(
+            delete seqWriteBtree;
+            seqWriteBtree = BtreeCreateTree(keys, values, dataSize, PAGER_PAGE_FORMAT_CELLS, 100, PREPARATION_BULK_LOAD_THREADS);
+        )
     )
 
     u64 offset = state.thread_index() % 10 + 1;
@@ -248,12 +818,10 @@ static void BM_InsertOnly(benchmark::State &state) {
     auto start = std::chrono::high_resolution_clock::now();
     auto end = std::chrono::high_resolution_clock::now();
     u64 iters = 0;
+    startThreadCounters();
+    startLatencyRecording(state);
     for (auto _ : state) {
-        THREAD_PREPARE_ITERATION(
-            delete seqWriteBtree;
-            pagerInit(100000);
-            seqWriteBtree = BtreeCreateTree(keys, values, dataSize);
-        )
+        THREAD_PREPARE_ITERATION(RESTORE_TREE_IMAGE())
         //auto start = std::chrono::high_resolution_clock::now();
 
         ++iters;
@@ -282,8 +850,17 @@ static void BM_InsertOnly(benchmark::State &state) {
     auto elapsed_seconds = std::chrono::duration_cast<std::chrono::duration<double>>(end - start);
 //    cout << "TOTAL: " << elapsed_seconds.count() << " (" << state.thread_index() << ") " << iters << endl;
     printf("TOTAL %f (%llu) %llu\n", elapsed_seconds.count(), offset - 1, iters);
+    reportThreadCounters(state, iters * (dataSize / 10));
+    reportLatencies(state);
 
     SINGLE_THREAD_CLEANUP(
+        state.counters["depth"] = treeDepth(seqWriteBtree);
+        // page allocation of the last iteration, retries are failed CAS on the shared free list
+        PagerStats pagerStats;
+        pagerGetStats(&pagerStats);
+        state.counters["allocation_retries"] = pagerStats.allocationRetries;
+        state.counters["page_cache_refills"] = pagerStats.pageCacheRefills;
+        state.counters["page_cache_spills"] = pagerStats.pageCacheSpills;
     	delete[] keys;
     	delete[] values;
     )
@@ -292,7 +869,194 @@ BENCHMARK(BM_InsertOnly)
     ->RangeMultiplier(10)
     ->Range(1000, 10000000L) // 1k - 10mln
     //->Iterations(10)
-    BENCHMARK_SHARED_SETTINGS;
+    BENCHMARK_ITERATION_SETTINGS;
+
+ShardedBtree* shardedBtree;
+
+// BM_InsertOnly against a tree split into independent shards, second argument is the amount of shards
+static void BM_ShardedInsertOnly(benchmark::State &state) {
+    u64 dataSize = state.range(0);
+    SINGLE_THREAD_PREPARATION(
+        keys = new u64[dataSize];
+        values = new u64[dataSize];
+        generateData2(keys, values, dataSize, 10);
+        std::sort(keys, keys + dataSize);
+        BUILD_TREE_IMAGE(
+            if (shardedBtree != nullptr)
+                ShardedBtreeDestroy(shardedBtree);
+            shardedBtree = ShardedBtreeCreate(keys, values, dataSize, state.range(1), state.range(2),
+                                              PAGER_PAGE_FORMAT_CELLS, 100, PREPARATION_BULK_LOAD_THREADS);
+        )
+    )
+
+    u64 offset = state.thread_index() % 10 + 1;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    auto end = std::chrono::high_resolution_clock::now();
+    u64 iters = 0;
+    startThreadCounters();
+    startLatencyRecording(state);
+    for (auto _ : state) {
+        THREAD_PREPARE_ITERATION(RESTORE_TREE_IMAGE())
+
+        ++iters;
+        ShardedCursor cursor;
+        ShardedBtreeInitCursor(shardedBtree, &cursor, 1);
+
+        // 10% modification
+        for (u64 i = 0; i < dataSize / 10; i++) {
+            u64 trueIdx = dataSize / 10 * offset + i;
+            ShardedCursorMoveTo(&cursor, keys[trueIdx]);
+            ShardedCursorInsertEntry(&cursor, keys[trueIdx] + offset, 42);
+        }
+
+        ShardedBtreeReleaseCursor(&cursor);
+        end = std::chrono::high_resolution_clock::now();
+
+        THREAD_COMPLETE_ITERATION()
+    }
+
+    auto elapsed_seconds = std::chrono::duration_cast<std::chrono::duration<double>>(end - start);
+    printf("TOTAL %f (%llu) %llu\n", elapsed_seconds.count(), offset - 1, iters);
+    reportThreadCounters(state, iters * (dataSize / 10));
+    reportLatencies(state);
+
+    SINGLE_THREAD_CLEANUP(
+        BtreeStats stats;
+        ShardedBtreeCollectStats(shardedBtree, &stats);
+        state.counters["depth"] = stats.depth;
+        delete[] keys;
+        delete[] values;
+    )
+}
+BENCHMARK(BM_ShardedInsertOnly)
+    ->ArgsProduct({{1000000, 10000000}, {1, 4, 16}, {SHARDED_BTREE_RANGE, SHARDED_BTREE_HASH}})
+    ->ArgNames({"size", "shards", "partitioning"})
+    BENCHMARK_ITERATION_SETTINGS;
+
+// BM_DbWorkload against a tree split into independent shards
+static void BM_ShardedDbWorkload(benchmark::State& state) {
+    u64 dataSize = state.range(0);
+    SINGLE_THREAD_PREPARATION(
+        keys = new u64[dataSize];
+        values = new u64[dataSize];
+        generateData2(keys, values, dataSize, 10);
+        std::sort(keys, keys + dataSize);
+        BUILD_TREE_IMAGE(
+            if (shardedBtree != nullptr)
+                ShardedBtreeDestroy(shardedBtree);
+            shardedBtree = ShardedBtreeCreate(keys, values, dataSize, state.range(1), state.range(2),
+                                              PAGER_PAGE_FORMAT_CELLS, 100, PREPARATION_BULK_LOAD_THREADS);
+        )
+    );
+
+    u64 offset = state.thread_index() % 10 + 1;
+    auto start = std::chrono::high_resolution_clock::now();
+    auto end = std::chrono::high_resolution_clock::now();
+    u64 iters = 0;
+    startThreadCounters();
+    startLatencyRecording(state);
+    for (auto _ : state) {
+        THREAD_PREPARE_ITERATION(RESTORE_TREE_IMAGE())
+
+        ++iters;
+        ShardedCursor cursor;
+        ShardedBtreeInitCursor(shardedBtree, &cursor, 0);
+
+        for (u64 i = 0; i < dataSize / 10; ++i) {
+            u64 opCode = ((i + offset) * (i + offset) % 1000007) % 3;
+            ShardedBtreeRebindCursor(&cursor, opCode != 0 ? 1 : 0);
+            u64 trueIdx = dataSize / 10 * offset + i;
+
+            ShardedCursorMoveTo(&cursor, keys[trueIdx]);
+            if (opCode == 1) {
+                ShardedCursorInsertEntry(&cursor, keys[trueIdx] + offset, 42);
+            } else if (opCode == 2) {
+                ShardedCursorRemoveEntry(&cursor);
+            }
+        }
+        ShardedBtreeReleaseCursor(&cursor);
+
+        end = std::chrono::high_resolution_clock::now();
+        THREAD_COMPLETE_ITERATION()
+    }
+
+    auto elapsed_seconds = std::chrono::duration_cast<std::chrono::duration<double>>(end - start);
+    printf("TOTAL %f (%llu) %llu\n", elapsed_seconds.count(), offset, iters);
+    reportThreadCounters(state, iters * (dataSize / 10));
+    reportLatencies(state);
+
+    SINGLE_THREAD_CLEANUP(
+        BtreeStats stats;
+        ShardedBtreeCollectStats(shardedBtree, &stats);
+        state.counters["depth"] = stats.depth;
+        delete[] keys;
+        delete[] values;
+    )
+}
+BENCHMARK(BM_ShardedDbWorkload)
+    ->ArgsProduct({{1000000, 10000000}, {1, 4, 16}, {SHARDED_BTREE_RANGE, SHARDED_BTREE_HASH}})
+    ->ArgNames({"size", "shards", "partitioning"})
+    BENCHMARK_ITERATION_SETTINGS;
+
+// the same 10% modification as BM_InsertOnly through BtreeInsertBatch, second argument is the batch size
+static void BM_InsertBatch(benchmark::State &state) {
+    u64 dataSize = state.range(0);
+    u64 batchSize = state.range(1);
+    SINGLE_THREAD_PREPARATION(
+        keys = new u64[dataSize];
+        values = new u64[dataSize];
+        generateData2(keys, values, dataSize, 10);
+        std::sort(keys, keys + dataSize);
+        BUILD_TREE_IMAGE(
+            delete seqWriteBtree;
+            seqWriteBtree = BtreeCreateTree(keys, values, dataSize, PAGER_PAGE_FORMAT_CELLS, 100, PREPARATION_BULK_LOAD_THREADS);
+        )
+    )
+
+    u64 offset = state.thread_index() % 10 + 1;
+    u64 sliceSize = dataSize / 10;
+    u64 *batchKeys = new u64[sliceSize];
+    u64 *batchValues = new u64[sliceSize];
+    u1 batchFilled = 0;
+
+    startThreadCounters();
+    for (auto _ : state) {
+        if (!batchFilled) {
+            // threads enter the loop together, so thread 0 has generated keys by now
+            state.PauseTiming();
+            pauseThreadCounters();
+            for (u64 i = 0; i < sliceSize; i++) {
+                batchKeys[i] = keys[sliceSize * offset + i] + offset;
+                batchValues[i] = 42;
+            }
+            batchFilled = 1;
+            resumeThreadCounters();
+            state.ResumeTiming();
+        }
+        THREAD_PREPARE_ITERATION(RESTORE_TREE_IMAGE())
+
+        for (u64 from = 0; from < sliceSize; from += batchSize) {
+            u64 count = std::min(batchSize, sliceSize - from);
+            BtreeInsertBatch(seqWriteBtree, batchKeys + from, batchValues + from, count);
+        }
+
+        THREAD_COMPLETE_ITERATION()
+    }
+    state.SetItemsProcessed(state.iterations() * sliceSize);
+    reportThreadCounters(state, state.iterations() * sliceSize);
+
+    delete[] batchKeys;
+    delete[] batchValues;
+    SINGLE_THREAD_CLEANUP(
+        state.counters["depth"] = treeDepth(seqWriteBtree);
+    	delete[] keys;
+    	delete[] values;
+    )
+}
+BENCHMARK(BM_InsertBatch)
+    ->ArgsProduct({ { 1000, 100000, 1000000, 10000000 }, { 64, 1024, 1000000 } })
+    BENCHMARK_ITERATION_SETTINGS;
 
 Btree *seqReadBtree;
 static void BM_SequentialRead(benchmark::State &state) {
@@ -302,7 +1066,7 @@ static void BM_SequentialRead(benchmark::State &state) {
     	values = new u64[dataSize];
         generateData2(keys, values, dataSize, 10);
         std::sort(keys, keys + dataSize);
-        pagerInit(60000);
+        pagerInit();
         seqReadBtree = BtreeCreateTree(keys, values, dataSize);
     )
 
@@ -313,6 +1077,8 @@ static void BM_SequentialRead(benchmark::State &state) {
     auto start = std::chrono::high_resolution_clock::now();
     auto end = std::chrono::high_resolution_clock::now();
     u64 iters = 0;
+    startThreadCounters();
+    startLatencyRecording(state);
     for(auto _: state) {
 		++iters;
 
@@ -332,8 +1098,11 @@ static void BM_SequentialRead(benchmark::State &state) {
     auto elapsed_seconds = std::chrono::duration_cast<std::chrono::duration<double>>(end - start);
 //    cout << "TOTAL: " << elapsed_seconds.count() << " (" << state.thread_index() << ") " << iters << endl;
     printf("TOTAL %f (%llu) %llu\n", elapsed_seconds.count(), idx, iters);
+    reportThreadCounters(state, iters * dataSize);
+    reportLatencies(state);
 
 	SINGLE_THREAD_CLEANUP(
+        state.counters["depth"] = treeDepth(seqReadBtree);
         delete seqReadBtree;
     	delete[] keys;
     	delete[] values;
@@ -346,4 +1115,797 @@ BENCHMARK(BM_SequentialRead)
     //->Iterations(10)
     BENCHMARK_SHARED_SETTINGS;
 
+Btree *rangeScanBtree;
+static void BM_RangeScan(benchmark::State &state) {
+    u64 dataSize = state.range(0);
+    SINGLE_THREAD_PREPARATION(
+    	keys = new u64[dataSize];
+    	values = new u64[dataSize];
+        generateData2(keys, values, dataSize, 10);
+        std::sort(keys, keys + dataSize);
+        pagerInit();
+        rangeScanBtree = BtreeCreateTree(keys, values, dataSize);
+    )
+
+    u64 idx = state.thread_index();
+    u64 __, ___;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    auto end = std::chrono::high_resolution_clock::now();
+    u64 iters = 0;
+    u64 entries = 0;
+    for(auto _: state) {
+		++iters;
+
+        Cursor* cursor;
+        BtreeCreateCursor(rangeScanBtree, &cursor, 0, idx);
+        BtreeCursorFirstLeaf(cursor);
+        do {
+            BtreeCursorReadData(cursor, &__, &___);
+            ++entries;
+        } while (BtreeCursorNextEntry(cursor));
+        BtreeDestroyCursor(rangeScanBtree, cursor, idx);
+        end = std::chrono::high_resolution_clock::now();
+    }
+    state.SetItemsProcessed(entries);
+
+    auto elapsed_seconds = std::chrono::duration_cast<std::chrono::duration<double>>(end - start);
+    printf("TOTAL %f (%llu) %llu\n", elapsed_seconds.count(), idx, iters);
+
+	SINGLE_THREAD_CLEANUP(
+        delete rangeScanBtree;
+    	delete[] keys;
+    	delete[] values;
+	)
+}
+BENCHMARK(BM_RangeScan)
+    ->RangeMultiplier(10)
+    ->Range(1000, 10000000L) // 1k - 10mln
+    BENCHMARK_SHARED_SETTINGS;
+
+Btree *pageFormatBtree;
+// resident set size of the whole process in MiB, read from /proc/self/statm
+static double residentMemoryMb() {
+    unsigned long size = 0, resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%lu %lu", &size, &resident) != 2)
+            resident = 0;
+        fclose(statm);
+    }
+    return (double)resident * sysconf(_SC_PAGESIZE) / (1024 * 1024);
+}
+
+u64 *lookupOrder;
+// point lookups in random order, second argument is the page format of the tree
+static void BM_LookupPageFormat(benchmark::State &state) {
+    u64 dataSize = state.range(0);
+    u8 pageFormat = state.range(1);
+    SINGLE_THREAD_PREPARATION(
+    	keys = new u64[dataSize];
+    	values = new u64[dataSize];
+        lookupOrder = new u64[dataSize];
+        generateData(keys, values, dataSize, 10);
+        for (u64 i = 0; i < dataSize; ++i)
+            lookupOrder[i] = keys[i];
+        mt19937_64 rng(SEED);
+        std::shuffle(lookupOrder, lookupOrder + dataSize, rng);
+        pagerInit();
+        pageFormatBtree = BtreeCreateTree(keys, values, dataSize, pageFormat);
+    )
+
+    u64 idx = state.thread_index();
+    u64 __, ___;
+
+    u64 lookups = 0;
+    startThreadCounters();
+    startLatencyRecording(state);
+    for(auto _: state) {
+        Cursor* cursor;
+        BtreeCreateCursor(pageFormatBtree, &cursor, 0, idx);
+        for (u64 i = 0; i < dataSize; i++) {
+            BtreeCursorMoveTo(cursor, lookupOrder[i]);
+            BtreeCursorReadData(cursor, &__, &___);
+        }
+        BtreeDestroyCursor(pageFormatBtree, cursor, idx);
+        lookups += dataSize;
+    }
+    state.SetItemsProcessed(lookups);
+    reportThreadCounters(state, lookups);
+    reportLatencies(state);
+
+    if (state.thread_index() == 0) {
+        BtreeStats stats;
+        BtreeCollectStats(pageFormatBtree, &stats);
+        state.counters["bytes_per_entry"] = (double)stats.usedBytes / stats.entries;
+        state.counters["entries_per_leaf"] = (double)stats.entries / stats.leafPages;
+        state.counters["depth"] = stats.depth;
+
+        PagerStats pagerStats;
+        pagerGetStats(&pagerStats);
+        state.counters["pages_mb"] = (double)pagerStats.committedPages * PAGER_PAGE_BYTE_SIZE / (1024 * 1024);
+        state.counters["rss_mb"] = residentMemoryMb();
+    }
+
+	SINGLE_THREAD_CLEANUP(
+        delete pageFormatBtree;
+    	delete[] keys;
+    	delete[] values;
+        delete[] lookupOrder;
+	)
+}
+BENCHMARK(BM_LookupPageFormat)
+    ->ArgsProduct({ { 1000, 100000, 1000000 }, { PAGER_PAGE_FORMAT_CELLS, PAGER_PAGE_FORMAT_FIXED, PAGER_PAGE_FORMAT_PACKED } })
+    BENCHMARK_SHARED_SETTINGS;
+
+Btree *hugePagesBtree;
+// random lookups in a tree whose pages are backed as the second argument (PAGER_HUGE_PAGES_*) asks,
+// dtlb_misses per lookup shows what huge pages save; huge_pages is the backing the pager actually got
+static void BM_LookupHugePages(benchmark::State &state) {
+    u64 dataSize = state.range(0);
+    SINGLE_THREAD_PREPARATION(
+        keys = new u64[dataSize];
+        values = new u64[dataSize];
+        lookupOrder = new u64[dataSize];
+        generateData(keys, values, dataSize, 10);
+        for (u64 i = 0; i < dataSize; ++i)
+            lookupOrder[i] = keys[i];
+        mt19937_64 rng(SEED);
+        std::shuffle(lookupOrder, lookupOrder + dataSize, rng);
+        pagerSetHugePages(state.range(1));
+        pagerInit();
+        hugePagesBtree = BtreeCreateTree(keys, values, dataSize, PAGER_PAGE_FORMAT_CELLS, 100,
+                                         PREPARATION_BULK_LOAD_THREADS);
+    )
+
+    u64 idx = state.thread_index();
+    u64 key, value;
+
+    u64 lookups = 0;
+    startThreadCounters();
+    for (auto _ : state) {
+        Cursor* cursor;
+        BtreeCreateCursor(hugePagesBtree, &cursor, 0, idx);
+        for (u64 i = 0; i < dataSize; i++) {
+            BtreeCursorMoveTo(cursor, lookupOrder[i]);
+            BtreeCursorReadData(cursor, &key, &value);
+        }
+        BtreeDestroyCursor(hugePagesBtree, cursor, idx);
+        lookups += dataSize;
+    }
+    state.SetItemsProcessed(lookups);
+    reportThreadCounters(state, lookups);
+
+    SINGLE_THREAD_CLEANUP(
+        PagerStats pagerStats;
+        pagerGetStats(&pagerStats);
+        state.counters["huge_pages"] = pagerStats.hugePages;
+        state.counters["pages_mb"] = (double)pagerStats.committedPages * PAGER_PAGE_BYTE_SIZE / (1024 * 1024);
+        delete hugePagesBtree;
+        delete[] keys;
+        delete[] values;
+        delete[] lookupOrder;
+    )
+}
+BENCHMARK(BM_LookupHugePages)
+    ->ArgsProduct({ { 1000000, 10000000 },
+                    { PAGER_HUGE_PAGES_NONE, PAGER_HUGE_PAGES_TRANSPARENT, PAGER_HUGE_PAGES_EXPLICIT } })
+    ->ArgNames({ "size", "huge_pages" })
+    BENCHMARK_SHARED_SETTINGS;
+
+#define LOOKUP_BATCH_SIZE 1024
+#define LOOKUP_BATCH_RANDOM 0
+#define LOOKUP_BATCH_SORTED 1
+
+Btree *batchLookupBtree;
+u64 *batchLookupKeys;
+// lookups in batches of LOOKUP_BATCH_SIZE random keys, arguments are data size, LOOKUP_BATCH_* order of keys
+// within a batch and the method: 0 - MoveTo and ReadData per key as in BM_SequentialRead, 1 - BtreeMultiGet
+static void BM_BatchLookup(benchmark::State &state) {
+    u64 dataSize = state.range(0);
+    u8 batchOrder = state.range(1);
+    u1 multiGet = state.range(2);
+    SINGLE_THREAD_PREPARATION(
+    	keys = new u64[dataSize];
+    	values = new u64[dataSize];
+        batchLookupKeys = new u64[dataSize];
+        generateData(keys, values, dataSize, 10);
+        mt19937_64 rng(SEED);
+        for (u64 i = 0; i < dataSize; ++i)
+            batchLookupKeys[i] = keys[rng() % dataSize];
+        if (batchOrder == LOOKUP_BATCH_SORTED) {
+            for (u64 i = 0; i < dataSize; i += LOOKUP_BATCH_SIZE)
+                std::sort(batchLookupKeys + i, batchLookupKeys + std::min(i + LOOKUP_BATCH_SIZE, dataSize));
+        }
+        pagerInit();
+        batchLookupBtree = BtreeCreateTree(keys, values, dataSize);
+    )
+
+    u64 idx = state.thread_index();
+    u64 batchValues[LOOKUP_BATCH_SIZE];
+    u1 batchFound[LOOKUP_BATCH_SIZE];
+    u64 __;
+
+    u64 lookups = 0;
+    for(auto _: state) {
+        for (u64 from = 0; from < dataSize; from += LOOKUP_BATCH_SIZE) {
+            u64 count = std::min((u64)LOOKUP_BATCH_SIZE, dataSize - from);
+            if (multiGet) {
+                BtreeMultiGet(batchLookupBtree, batchLookupKeys + from, count, batchValues, batchFound);
+                continue;
+            }
+            Cursor* cursor;
+            BtreeCreateCursor(batchLookupBtree, &cursor, 0, idx);
+            for (u64 i = 0; i < count; i++) {
+                BtreeCursorMoveTo(cursor, batchLookupKeys[from + i]);
+                BtreeCursorReadData(cursor, &__, batchValues + i);
+            }
+            BtreeDestroyCursor(batchLookupBtree, cursor, idx);
+        }
+        lookups += dataSize;
+    }
+    state.SetItemsProcessed(lookups);
+
+	SINGLE_THREAD_CLEANUP(
+        delete batchLookupBtree;
+    	delete[] keys;
+    	delete[] values;
+        delete[] batchLookupKeys;
+	)
+}
+BENCHMARK(BM_BatchLookup)
+    ->ArgsProduct({ { 100000, 1000000, 10000000 }, { LOOKUP_BATCH_RANDOM, LOOKUP_BATCH_SORTED }, { 0, 1 } })
+    BENCHMARK_SHARED_SETTINGS;
+
+// bulk load of sorted data, arguments are data size, amount of loading threads and page fill factor
+static void BM_BulkLoad(benchmark::State &state) {
+    u64 dataSize = state.range(0);
+    u16 threadsCount = state.range(1);
+    u8 fillFactor = state.range(2);
+    keys = new u64[dataSize];
+    values = new u64[dataSize];
+    generateData(keys, values, dataSize, 10);
+
+    BtreeStats stats = {};
+    for (auto _ : state) {
+        state.PauseTiming();
+        pagerInit();
+        state.ResumeTiming();
+
+        Btree* tree = BtreeCreateTree(keys, values, dataSize, PAGER_PAGE_FORMAT_CELLS, fillFactor, threadsCount);
+
+        state.PauseTiming();
+        BtreeCollectStats(tree, &stats);
+        delete tree;
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * dataSize);
+    state.counters["leaf_pages"] = stats.leafPages;
+    state.counters["bytes_per_entry"] = (double)stats.usedBytes / stats.entries;
+
+    delete[] keys;
+    delete[] values;
+}
+BENCHMARK(BM_BulkLoad)
+    ->ArgsProduct({ { 1000000, 10000000 }, { 1, 2, 4, 8 }, { 100, 70 } })
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+#define BENCHMARK_PAGE_FILE "btree_benchmark.db"
+
+// builds the page file for the file pager benchmarks and shuffles lookup keys
+static void prepareFileLookups(u64 dataSize) {
+    keys = new u64[dataSize];
+    values = new u64[dataSize];
+    lookupOrder = new u64[dataSize];
+    generateData(keys, values, dataSize, 10);
+    for (u64 i = 0; i < dataSize; ++i)
+        lookupOrder[i] = keys[i];
+    mt19937_64 rng(SEED);
+    std::shuffle(lookupOrder, lookupOrder + dataSize, rng);
+
+    unlink(BENCHMARK_PAGE_FILE);
+    pagerOpen(BENCHMARK_PAGE_FILE, 1024);
+    delete BtreeCreateTree(keys, values, dataSize);
+    pagerClose();
+}
+
+static void lookupKeys(Btree* tree, u64 from, u64 amount) {
+    u64 __, ___;
+    Cursor* cursor;
+    BtreeCreateCursor(tree, &cursor, 0);
+    for (u64 i = from; i < from + amount; i++) {
+        BtreeCursorMoveTo(cursor, lookupOrder[i]);
+        BtreeCursorReadData(cursor, &__, &___);
+    }
+    BtreeDestroyCursor(tree, cursor);
+}
+
+static void reportPoolCounters(benchmark::State &state) {
+    PagerStats stats;
+    pagerGetStats(&stats);
+    state.counters["pool_hit_rate"] = (double)stats.poolHits / (stats.poolHits + stats.poolMisses);
+    state.counters["file_pages"] = stats.committedPages;
+}
+
+// every iteration opens the page file with an empty buffer pool, OS page cache is dropped as well
+static void BM_FileLookupCold(benchmark::State &state) {
+    u64 dataSize = state.range(0);
+    PageIndex poolPages = state.range(1);
+    u64 lookups = dataSize / 10;
+    prepareFileLookups(dataSize);
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        int file = open(BENCHMARK_PAGE_FILE, O_RDONLY);
+        posix_fadvise(file, 0, 0, POSIX_FADV_DONTNEED);
+        close(file);
+        state.ResumeTiming();
+
+        pagerOpen(BENCHMARK_PAGE_FILE, poolPages);
+        Btree* tree = BtreeOpenTree();
+        lookupKeys(tree, 0, lookups);
+
+        state.PauseTiming();
+        reportPoolCounters(state);
+        delete tree;
+        pagerClose();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * lookups);
+
+    delete[] keys;
+    delete[] values;
+    delete[] lookupOrder;
+    unlink(BENCHMARK_PAGE_FILE);
+}
+BENCHMARK(BM_FileLookupCold)
+    ->ArgsProduct({ { 100000, 1000000 }, { 64, 256 } })
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+Btree *fileLookupBtree;
+// pool is warmed up by one pass over the keys, it's still smaller than the data set
+static void BM_FileLookupWarm(benchmark::State &state) {
+    u64 dataSize = state.range(0);
+    PageIndex poolPages = state.range(1);
+    SINGLE_THREAD_PREPARATION(
+        prepareFileLookups(dataSize);
+        pagerOpen(BENCHMARK_PAGE_FILE, poolPages);
+        fileLookupBtree = BtreeOpenTree();
+        lookupKeys(fileLookupBtree, 0, dataSize);
+    )
+
+    u64 lookups = dataSize / 10;
+    u64 from = state.thread_index() * lookups % (dataSize - lookups + 1);
+    for (auto _ : state) {
+        lookupKeys(fileLookupBtree, from, lookups);
+    }
+    state.SetItemsProcessed(state.iterations() * lookups);
+
+    SINGLE_THREAD_CLEANUP(
+        reportPoolCounters(state);
+        delete fileLookupBtree;
+        pagerClose();
+    	delete[] keys;
+    	delete[] values;
+        delete[] lookupOrder;
+        unlink(BENCHMARK_PAGE_FILE);
+    )
+}
+BENCHMARK(BM_FileLookupWarm)
+    ->ArgsProduct({ { 100000, 1000000 }, { 64, 256 } })
+    BENCHMARK_SHARED_SETTINGS;
+
+#define BENCHMARK_LOG_FILE "btree_benchmark.wal"
+
+Btree *walInsertBtree;
+// the 10% modification of BM_InsertOnly with every insert committed to the log before it returns
+// (except in async mode), second argument is one of WAL_SYNC_*
+static void BM_WalInsert(benchmark::State &state) {
+    u64 dataSize = state.range(0);
+    u8 syncMode = state.range(1);
+    SINGLE_THREAD_PREPARATION(
+        keys = new u64[dataSize];
+        values = new u64[dataSize];
+        generateData2(keys, values, dataSize, 10);
+        std::sort(keys, keys + dataSize);
+        BUILD_TREE_IMAGE(
+            delete walInsertBtree;
+            walInsertBtree = BtreeCreateTree(keys, values, dataSize, PAGER_PAGE_FORMAT_CELLS, 100, PREPARATION_BULK_LOAD_THREADS);
+        )
+    )
+
+    u64 offset = state.thread_index() % 10 + 1;
+    for (auto _ : state) {
+        THREAD_PREPARE_ITERATION(
+            walClose();
+            RESTORE_TREE_IMAGE();
+            unlink(BENCHMARK_LOG_FILE);
+            walOpen(BENCHMARK_LOG_FILE, syncMode);
+        )
+
+        Cursor* cursor;
+        BtreeCreateCursor(walInsertBtree, &cursor, 1, offset - 1);
+        for (u64 i = 0; i < dataSize / 10; i++) {
+            u64 trueIdx = dataSize / 10 * offset + i;
+            BtreeCursorMoveTo(cursor, keys[trueIdx]);
+            BtreeCursorInsertEntry(walInsertBtree, cursor, keys[trueIdx] + offset, 42);
+        }
+        BtreeDestroyCursor(walInsertBtree, cursor, offset - 1);
+
+        THREAD_COMPLETE_ITERATION()
+    }
+    state.SetItemsProcessed(state.iterations() * (dataSize / 10));
+
+    SINGLE_THREAD_CLEANUP(
+        // counters of the last iteration, group commit shows how many commits share one sync
+        WalStats stats;
+        walGetStats(&stats);
+        state.counters["syncs"] = stats.syncs;
+        state.counters["records_per_sync"] = stats.syncs > 0 ? (double)stats.records / stats.syncs : 0;
+        walClose();
+        unlink(BENCHMARK_LOG_FILE);
+        delete walInsertBtree;
+        walInsertBtree = nullptr;
+    	delete[] keys;
+    	delete[] values;
+    )
+}
+BENCHMARK(BM_WalInsert)
+    ->ArgsProduct({ { 100000 }, { WAL_SYNC_EVERY_COMMIT, WAL_SYNC_GROUP, WAL_SYNC_ASYNC } })
+    BENCHMARK_ITERATION_SETTINGS;
+
+// YCSB core workloads: A - 50% reads, 50% updates; B - 95% reads, 5% updates; C - reads only;
+// D - 95% reads of the latest records, 5% inserts; E - 95% short scans, 5% inserts; F - 50% reads, 50% read-modify-writes
+#define YCSB_WORKLOAD_A 0
+#define YCSB_WORKLOAD_B 1
+#define YCSB_WORKLOAD_C 2
+#define YCSB_WORKLOAD_D 3
+#define YCSB_WORKLOAD_E 4
+#define YCSB_WORKLOAD_F 5
+
+// how records are picked: zipfian over the key space (the hot records are scattered by a hash), uniformly,
+// zipfian over the insertion order from the newest record back, or YCSB_HOTSPOT_OPERATIONS percent of operations
+// to the first YCSB_HOTSPOT_RECORDS percent of records
+#define YCSB_DISTRIBUTION_ZIPFIAN 0
+#define YCSB_DISTRIBUTION_UNIFORM 1
+#define YCSB_DISTRIBUTION_LATEST 2
+#define YCSB_DISTRIBUTION_HOTSPOT 3
+
+#define YCSB_ZIPFIAN_CONSTANT 0.99
+#define YCSB_HOTSPOT_RECORDS 20
+#define YCSB_HOTSPOT_OPERATIONS 80
+#define YCSB_MAX_SCAN_LENGTH 100
+// value length argument meaning the byte lengths of generateData2, others are fixed lengths of 1 - 8 bytes
+#define YCSB_VALUE_LENGTH_WEIGHTED 0
+#define YCSB_OPERATIONS_PER_ITERATION 1000
+// records are keyed by their insertion number times the density, as with generateData
+#define YCSB_KEY_DENSITY 10
+// open-loop threads sleep until this long before the scheduled start of an operation
+#define YCSB_SLEEP_SLACK_US 100
+
+#define YCSB_OPERATION_READ 0
+#define YCSB_OPERATION_UPDATE 1
+#define YCSB_OPERATION_INSERT 2
+#define YCSB_OPERATION_SCAN 3
+#define YCSB_OPERATION_READ_MODIFY_WRITE 4
+
+// percent of reads, updates, inserts, scans and read-modify-writes of every workload
+static const u8 ycsbMixes[6][5] = {
+    { 50, 50, 0, 0, 0 },
+    { 95, 5, 0, 0, 0 },
+    { 100, 0, 0, 0, 0 },
+    { 95, 0, 5, 0, 0 },
+    { 0, 0, 5, 95, 0 },
+    { 50, 0, 0, 0, 50 },
+};
+
+// zipfian ranks as generated by YCSB (Gray et al., "Quickly generating billion-record synthetic databases"),
+// rank 0 is the most popular; zeta of the item count is summed once per count
+struct ZipfianGenerator {
+    u64 items;
+    double zetan;
+    double alpha;
+    double eta;
+    double threshold; // ranks 0 and 1 are returned without pow
+};
+
+static void zipfianInit(ZipfianGenerator* zipfian, u64 items) {
+    double zeta2 = 1 + pow(0.5, YCSB_ZIPFIAN_CONSTANT);
+    if (zipfian->items != items) {
+        zipfian->zetan = 0;
+        for (u64 i = 1; i <= items; ++i)
+            zipfian->zetan += 1 / pow((double)i, YCSB_ZIPFIAN_CONSTANT);
+        zipfian->items = items;
+    }
+    zipfian->alpha = 1 / (1 - YCSB_ZIPFIAN_CONSTANT);
+    zipfian->eta = (1 - pow(2.0 / items, 1 - YCSB_ZIPFIAN_CONSTANT)) / (1 - zeta2 / zipfian->zetan);
+    zipfian->threshold = 1 + pow(0.5, YCSB_ZIPFIAN_CONSTANT);
+}
+
+static u64 zipfianNext(const ZipfianGenerator* zipfian, double uniform) {
+    double uz = uniform * zipfian->zetan;
+    if (uz < 1)
+        return 0;
+    if (uz < zipfian->threshold)
+        return 1;
+    u64 rank = (u64)(zipfian->items * pow(zipfian->eta * uniform - zipfian->eta + 1, zipfian->alpha));
+    return std::min(rank, zipfian->items - 1);
+}
+
+// FNV-1a over the bytes of the rank, spreads the popular ranks over the key space
+static u64 scrambleRank(u64 rank) {
+    u64 hash = 0xcbf29ce484222325ULL;
+    for (u8 i = 0; i < 8; ++i) {
+        hash ^= (rank >> (8 * i)) & 0xff;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static u64 ycsbValue(mt19937_64 &rng, u8 valueLength) {
+    if (valueLength == YCSB_VALUE_LENGTH_WEIGHTED)
+        return generateData2_weightedValue(rng);
+    u64 top = 1ULL << (8 * valueLength - 1);
+    return (rng() & (top - 1)) | top;
+}
+
+Btree *ycsbBtree;
+ZipfianGenerator ycsbZipfian;
+// records inserted so far, the initial ones included; an insert takes its number before the entry is in the tree
+std::atomic<u64> ycsbRecords;
+// response times of open-loop runs, measured from the intended start of every operation
+std::atomic<u64> ycsbResponseCounts[BTREE_LATENCY_BUCKETS];
+std::atomic<u64> ycsbResponseMax;
+
+// record number for a read, update or scan start
+static u64 ycsbPickRecord(mt19937_64 &rng, u8 distribution, u64 initialRecords) {
+    u64 records = ycsbRecords.load(std::memory_order_relaxed);
+    double uniform = std::uniform_real_distribution<double>(0, 1)(rng);
+    switch (distribution) {
+        case YCSB_DISTRIBUTION_ZIPFIAN:
+            return scrambleRank(zipfianNext(&ycsbZipfian, uniform)) % records;
+        case YCSB_DISTRIBUTION_LATEST: {
+            u64 back = zipfianNext(&ycsbZipfian, uniform);
+            return back < records ? records - 1 - back : 0;
+        }
+        case YCSB_DISTRIBUTION_HOTSPOT: {
+            u64 hotRecords = std::max<u64>(initialRecords * YCSB_HOTSPOT_RECORDS / 100, 1);
+            if (rng() % 100 < YCSB_HOTSPOT_OPERATIONS)
+                return rng() % hotRecords;
+            return records > hotRecords ? hotRecords + rng() % (records - hotRecords) : rng() % records;
+        }
+        default:
+            return rng() % records;
+    }
+}
+
+// arguments: initial records, YCSB_WORKLOAD_*, YCSB_DISTRIBUTION_*, value length (1 - 8 bytes or
+// YCSB_VALUE_LENGTH_WEIGHTED), target rate in operations per second of all threads (0 runs closed-loop, every thread
+// issues the next operation when the last one is done) and whether the tree buffers writes. Open-loop threads issue
+// operations on a fixed schedule and report response times from the scheduled start, so a slow operation delays
+// the ones queued behind it as it would with independent clients
+static void BM_Ycsb(benchmark::State &state) {
+    u64 initialRecords = state.range(0);
+    u8 workload = state.range(1);
+    u8 distribution = state.range(2);
+    u8 valueLength = state.range(3);
+    u64 targetRate = state.range(4);
+    u1 buffered = state.range(5);
+    SINGLE_THREAD_PREPARATION(
+        keys = new u64[initialRecords];
+        values = new u64[initialRecords];
+        mt19937_64 rng(SEED);
+        for (u64 i = 0; i < initialRecords; ++i) {
+            keys[i] = i * YCSB_KEY_DENSITY;
+            values[i] = ycsbValue(rng, valueLength);
+        }
+        pagerInit();
+        ycsbBtree = BtreeCreateTree(keys, values, initialRecords, PAGER_PAGE_FORMAT_CELLS, 100,
+                                    PREPARATION_BULK_LOAD_THREADS, buffered);
+        ycsbRecords.store(initialRecords);
+        zipfianInit(&ycsbZipfian, initialRecords);
+        for (u32 i = 0; i < BTREE_LATENCY_BUCKETS; ++i)
+            ycsbResponseCounts[i].store(0, std::memory_order_relaxed);
+        ycsbResponseMax.store(0);
+    )
+
+    mt19937_64 rng(SEED + state.thread_index());
+    const u8* mix = ycsbMixes[workload];
+    double interval = targetRate > 0 ? 1e9 * state.threads() / targetRate : 0;
+    u64 issued = 0;
+    u64 lookups = 0;
+    u64 found = 0;
+    u64 key;
+    u64 value;
+    std::chrono::steady_clock::time_point scheduleStart;
+    startThreadCounters();
+    startLatencyRecording(state);
+    for (auto _ : state) {
+        // the schedule starts with the first operation, as threads pass the start of the loop one by one
+        if (issued == 0)
+            scheduleStart = std::chrono::steady_clock::now();
+        for (u32 i = 0; i < YCSB_OPERATIONS_PER_ITERATION; ++i) {
+            auto intended = scheduleStart + std::chrono::nanoseconds((u64)(interval * issued++));
+            if (interval > 0) {
+                // sleeps wake up tens of microseconds late, the rest of the wait yields to other threads
+                auto wakeUp = intended - std::chrono::microseconds(YCSB_SLEEP_SLACK_US);
+                if (std::chrono::steady_clock::now() < wakeUp)
+                    std::this_thread::sleep_until(wakeUp);
+                while (std::chrono::steady_clock::now() < intended)
+                    std::this_thread::yield();
+            }
+
+            u8 draw = rng() % 100;
+            u8 operation = 0;
+            while (draw >= mix[operation]) {
+                draw -= mix[operation];
+                ++operation;
+            }
+            // a cursor per operation, so an open-loop thread doesn't keep the tree locked while it waits
+            // (under exclusive locking)
+            Cursor cursor;
+            if (operation == YCSB_OPERATION_INSERT) {
+                u64 record = ycsbRecords.fetch_add(1, std::memory_order_relaxed);
+                BtreeInitCursor(ycsbBtree, &cursor, 1);
+                BtreeCursorMoveTo(&cursor, record * YCSB_KEY_DENSITY);
+                BtreeCursorInsertEntry(ycsbBtree, &cursor, record * YCSB_KEY_DENSITY, ycsbValue(rng, valueLength));
+            } else {
+                u64 record = ycsbPickRecord(rng, distribution, initialRecords);
+                u1 write = operation == YCSB_OPERATION_UPDATE || operation == YCSB_OPERATION_READ_MODIFY_WRITE;
+                BtreeInitCursor(ycsbBtree, &cursor, write);
+                BtreeCursorMoveTo(&cursor, record * YCSB_KEY_DENSITY);
+                if (operation == YCSB_OPERATION_SCAN) {
+                    u64 length = 1 + rng() % YCSB_MAX_SCAN_LENGTH;
+                    for (u64 j = 0; j < length && BtreeCursorReadData(&cursor, &key, &value) == 0; ++j) {
+                        if (!BtreeCursorNextEntry(&cursor))
+                            break;
+                    }
+                } else {
+                    ++lookups;
+                    u1 hit = BtreeCursorReadData(&cursor, &key, &value) == 0 && key == record * YCSB_KEY_DENSITY;
+                    found += hit;
+                    // the tree has no update in place, an update replaces the entry
+                    if (hit && write && BtreeCursorRemoveEntry(&cursor)) {
+                        u64 newValue = operation == YCSB_OPERATION_UPDATE ? ycsbValue(rng, valueLength) : value + 1;
+                        BtreeCursorMoveTo(&cursor, key);
+                        BtreeCursorInsertEntry(ycsbBtree, &cursor, key, newValue);
+                    }
+                }
+            }
+            BtreeReleaseCursor(&cursor);
+
+            if (interval > 0) {
+                auto response = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - intended).count();
+                ycsbResponseCounts[BtreeLatencyBucket(response)].fetch_add(1, std::memory_order_relaxed);
+                u64 max = ycsbResponseMax.load(std::memory_order_relaxed);
+                while ((u64)response > max && !ycsbResponseMax.compare_exchange_weak(max, response));
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * YCSB_OPERATIONS_PER_ITERATION);
+    reportThreadCounters(state, state.iterations() * YCSB_OPERATIONS_PER_ITERATION);
+    reportLatencies(state);
+    // records inserted by other threads may not be in the tree yet when they are picked
+    if (lookups > 0)
+        state.counters["hit_rate"] = benchmark::Counter((double)found / lookups, benchmark::Counter::kAvgThreads);
+
+    SINGLE_THREAD_CLEANUP(
+        if (targetRate > 0) {
+            BtreeLatencyHistogram* responses = new BtreeLatencyHistogram();
+            for (u32 i = 0; i < BTREE_LATENCY_BUCKETS; ++i) {
+                responses->counts[i] = ycsbResponseCounts[i].load(std::memory_order_relaxed);
+                responses->total += responses->counts[i];
+            }
+            responses->max = ycsbResponseMax.load();
+            state.counters["response_p50"] = BtreeLatencyPercentile(responses, 50);
+            state.counters["response_p99"] = BtreeLatencyPercentile(responses, 99);
+            state.counters["response_p999"] = BtreeLatencyPercentile(responses, 99.9);
+            state.counters["response_max"] = responses->max;
+            delete responses;
+        }
+        state.counters["depth"] = treeDepth(ycsbBtree);
+        delete ycsbBtree;
+        delete[] keys;
+        delete[] values;
+    )
+}
+
+// every core workload with its own distribution; workload A under every distribution and value length;
+// workloads A and B open-loop at two rates; all of them with plain and buffered trees
+static void ycsbArguments(benchmark::internal::Benchmark* benchmark) {
+    for (u1 buffered = 0; buffered < 2; ++buffered) {
+        for (u8 workload = YCSB_WORKLOAD_A; workload <= YCSB_WORKLOAD_F; ++workload) {
+            u8 distribution = workload == YCSB_WORKLOAD_D ? YCSB_DISTRIBUTION_LATEST : YCSB_DISTRIBUTION_ZIPFIAN;
+            benchmark->Args({ 1000000, workload, distribution, YCSB_VALUE_LENGTH_WEIGHTED, 0, buffered });
+        }
+        for (u8 distribution : { YCSB_DISTRIBUTION_UNIFORM, YCSB_DISTRIBUTION_HOTSPOT })
+            benchmark->Args({ 1000000, YCSB_WORKLOAD_A, distribution, YCSB_VALUE_LENGTH_WEIGHTED, 0, buffered });
+        for (u8 valueLength : { 1, 8 })
+            benchmark->Args({ 1000000, YCSB_WORKLOAD_A, YCSB_DISTRIBUTION_ZIPFIAN, valueLength, 0, buffered });
+        for (u8 workload : { YCSB_WORKLOAD_A, YCSB_WORKLOAD_B }) {
+            for (i64 rate : { 100000, 500000 }) {
+                benchmark->Args({ 1000000, workload, YCSB_DISTRIBUTION_ZIPFIAN, YCSB_VALUE_LENGTH_WEIGHTED, rate,
+                                  buffered });
+            }
+        }
+    }
+}
+BENCHMARK(BM_Ycsb)
+    ->Apply(ycsbArguments)
+    ->ArgNames({ "records", "workload", "distribution", "value_length", "rate", "buffered" })
+    BENCHMARK_SHARED_SETTINGS;
+
+#define VARINT_BENCHMARK_VALUES 4096
+#define VARINT_LENGTH_WEIGHTED 0
+
+// values for the varint kernels: lengths of generateData2 or all of the given length
+static void generateVarintValues(u64 *values, u64 count, u8 length) {
+    mt19937_64 rng(SEED);
+    for (u64 i = 0; i < count; ++i) {
+        if (length == VARINT_LENGTH_WEIGHTED) {
+            values[i] = generateData2_weightedValue(rng);
+        } else {
+            u64 top = 1ULL << (8 * length - 1);
+            values[i] = (rng() & (top - 1)) | top;
+        }
+    }
+}
+
+// argument is the value length, 0 means the distribution of generateData2
+static void BM_VarintByteSize(benchmark::State &state) {
+    u64 values[VARINT_BENCHMARK_VALUES];
+    generateVarintValues(values, VARINT_BENCHMARK_VALUES, state.range(0));
+    for (auto _ : state) {
+        u64 total = 0;
+        for (u64 i = 0; i < VARINT_BENCHMARK_VALUES; ++i)
+            total += getValueByteSize(values[i], 0);
+        benchmark::DoNotOptimize(total);
+    }
+    state.SetItemsProcessed(state.iterations() * VARINT_BENCHMARK_VALUES);
+}
+BENCHMARK(BM_VarintByteSize)->DenseRange(0, 8);
+
+static void BM_VarintEncode(benchmark::State &state) {
+    u64 values[VARINT_BENCHMARK_VALUES];
+    generateVarintValues(values, VARINT_BENCHMARK_VALUES, state.range(0));
+    u8 *buffer = new u8[VARINT_BENCHMARK_VALUES * sizeof(u64)];
+    for (auto _ : state) {
+        u8 *position = buffer;
+        for (u64 i = 0; i < VARINT_BENCHMARK_VALUES; ++i)
+            position += encode(values[i], position);
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * VARINT_BENCHMARK_VALUES);
+    delete[] buffer;
+}
+BENCHMARK(BM_VarintEncode)->DenseRange(0, 8);
+
+// values are packed one after another as in cells, so every decode is an unaligned load
+static void BM_VarintDecode(benchmark::State &state) {
+    u64 values[VARINT_BENCHMARK_VALUES];
+    u8 sizes[VARINT_BENCHMARK_VALUES];
+    generateVarintValues(values, VARINT_BENCHMARK_VALUES, state.range(0));
+    u8 *buffer = new u8[VARINT_BENCHMARK_VALUES * sizeof(u64) + PAGER_PAGE_READ_PADDING]();
+    u8 *position = buffer;
+    for (u64 i = 0; i < VARINT_BENCHMARK_VALUES; ++i) {
+        sizes[i] = encode(values[i], position);
+        position += sizes[i];
+    }
+    for (auto _ : state) {
+        u64 total = 0;
+        position = buffer;
+        for (u64 i = 0; i < VARINT_BENCHMARK_VALUES; ++i) {
+            total += decode(sizes[i], position);
+            position += sizes[i];
+        }
+        benchmark::DoNotOptimize(total);
+    }
+    state.SetItemsProcessed(state.iterations() * VARINT_BENCHMARK_VALUES);
+    delete[] buffer;
+}
+BENCHMARK(BM_VarintDecode)->DenseRange(0, 8);
+
 BENCHMARK_MAIN();
\ No newline at end of file
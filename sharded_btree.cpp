@@ -0,0 +1,265 @@
+#include "types.h"
+#include "sharded_btree.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+static inline u64 mixKey(u64 key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+ShardedBtree* ShardedBtreeCreate(u64* keys, u64* values, u64 size, u16 shardsCount, u8 partitioning,
+                                 u8 pageFormat, u8 fillFactor, u16 threadsCount, u1 buffered) {
+    if (shardsCount == 0 || shardsCount > SHARDED_BTREE_MAX_SHARDS) {
+        fprintf(stderr, "ShardedBtreeCreate: %u shards, at most %u are supported\n", shardsCount,
+                SHARDED_BTREE_MAX_SHARDS);
+        abort();
+    }
+    ShardedBtree* tree = new ShardedBtree;
+    tree->shardsCount = shardsCount;
+    tree->partitioning = partitioning;
+    if (partitioning == SHARDED_BTREE_RANGE) {
+        u64 from = 0;
+        for (u16 i = 0; i < shardsCount; ++i) {
+            // all entries with the bound key start the shard, so duplicate keys never span two shards
+            u64 to = size;
+            if (i + 1 < shardsCount) {
+                to = size == 0 ? 0 : std::lower_bound(keys, keys + size, keys[size * (i + 1) / shardsCount]) - keys;
+                tree->bounds[i + 1] = size == 0 ? ~0ull / shardsCount * (i + 1) : keys[size * (i + 1) / shardsCount];
+            }
+            if (to < from)
+                to = from;
+            tree->shards[i] = BtreeCreateTree(keys + from, values + from, to - from, pageFormat, fillFactor,
+                                              threadsCount, buffered);
+            from = to;
+        }
+        tree->bounds[0] = 0;
+        return tree;
+    }
+
+    // keys of a shard keep their order
+    u64 counts[SHARDED_BTREE_MAX_SHARDS] = {};
+    for (u64 i = 0; i < size; ++i)
+        ++counts[mixKey(keys[i]) % shardsCount];
+    u64* shardKeys = new u64[size];
+    u64* shardValues = new u64[size];
+    u64 starts[SHARDED_BTREE_MAX_SHARDS];
+    u64 ends[SHARDED_BTREE_MAX_SHARDS];
+    for (u16 i = 0; i < shardsCount; ++i)
+        starts[i] = ends[i] = i == 0 ? 0 : starts[i - 1] + counts[i - 1];
+    for (u64 i = 0; i < size; ++i) {
+        u16 shard = mixKey(keys[i]) % shardsCount;
+        shardKeys[ends[shard]] = keys[i];
+        shardValues[ends[shard]++] = values[i];
+    }
+    for (u16 i = 0; i < shardsCount; ++i) {
+        tree->shards[i] = BtreeCreateTree(shardKeys + starts[i], shardValues + starts[i], counts[i], pageFormat,
+                                          fillFactor, threadsCount, buffered);
+        tree->bounds[i] = 0;
+    }
+    delete[] shardKeys;
+    delete[] shardValues;
+    return tree;
+}
+
+void ShardedBtreeDestroy(ShardedBtree* tree) {
+    for (u16 i = 0; i < tree->shardsCount; ++i)
+        delete tree->shards[i];
+    delete tree;
+}
+
+u16 ShardedBtreeShardOf(const ShardedBtree* tree, u64 key) {
+    if (tree->partitioning == SHARDED_BTREE_HASH)
+        return mixKey(key) % tree->shardsCount;
+    // last shard whose bound isn't above the key
+    return std::upper_bound(tree->bounds, tree->bounds + tree->shardsCount, key) - tree->bounds - 1;
+}
+
+void ShardedBtreeInitCursor(ShardedBtree* tree, ShardedCursor* cursor, u1 write) {
+    cursor->tree = tree;
+    for (u16 i = 0; i < tree->shardsCount; ++i)
+        cursor->cursors[i] = nullptr;
+    cursor->write = write;
+    cursor->shard = 0;
+    cursor->key = 0;
+    cursor->merging = 0;
+}
+
+static void closeShardCursor(ShardedCursor* cursor, u16 shard) {
+    if (cursor->cursors[shard] == nullptr)
+        return;
+    BtreeDestroyCursor(cursor->tree->shards[shard], cursor->cursors[shard]);
+    cursor->cursors[shard] = nullptr;
+}
+
+void ShardedBtreeReleaseCursor(ShardedCursor* cursor) {
+    for (u16 i = 0; i < cursor->tree->shardsCount; ++i)
+        closeShardCursor(cursor, i);
+    cursor->merging = 0;
+}
+
+void ShardedBtreeRebindCursor(ShardedCursor* cursor, u1 write) {
+    if (cursor->merging) {
+        ShardedBtreeReleaseCursor(cursor);
+    } else {
+        closeShardCursor(cursor, cursor->shard);
+    }
+    cursor->write = write;
+}
+
+// ends a scan and returns the cursor of the shard, which is the only one open afterwards; the cursor of the previous
+// shard is rebound to it, so it keeps its lock (if any) only until the new one is taken
+static Cursor* focusShard(ShardedCursor* cursor, u16 shard) {
+    if (cursor->merging) {
+        for (u16 i = 0; i < cursor->tree->shardsCount; ++i) {
+            if (i != cursor->shard)
+                closeShardCursor(cursor, i);
+        }
+        cursor->merging = 0;
+    }
+    if (shard != cursor->shard) {
+        Cursor* shardCursor = cursor->cursors[cursor->shard];
+        cursor->cursors[cursor->shard] = nullptr;
+        if (shardCursor != nullptr)
+            BtreeRebindCursor(cursor->tree->shards[shard], shardCursor, cursor->write);
+        cursor->cursors[shard] = shardCursor;
+        cursor->shard = shard;
+    }
+    if (cursor->cursors[shard] == nullptr)
+        BtreeCreateCursor(cursor->tree->shards[shard], &cursor->cursors[shard], cursor->write);
+    return cursor->cursors[shard];
+}
+
+u8 ShardedCursorMoveTo(ShardedCursor* cursor, u64 key) {
+    cursor->key = key;
+    return BtreeCursorMoveTo(focusShard(cursor, ShardedBtreeShardOf(cursor->tree, key)), key);
+}
+
+void ShardedCursorInsertEntry(ShardedCursor* cursor, u64 key, u64 value) {
+    u16 shard = ShardedBtreeShardOf(cursor->tree, key);
+    if (cursor->merging || shard != cursor->shard || cursor->cursors[shard] == nullptr)
+        ShardedCursorMoveTo(cursor, key);
+    BtreeCursorInsertEntry(cursor->tree->shards[shard], cursor->cursors[shard], key, value);
+}
+
+u1 ShardedCursorRemoveEntry(ShardedCursor* cursor) {
+    if (cursor->cursors[cursor->shard] == nullptr)
+        return 0;
+    return BtreeCursorRemoveEntry(focusShard(cursor, cursor->shard));
+}
+
+u1 ShardedCursorReadData(const ShardedCursor* cursor, u64* key, u64* value) {
+    if (cursor->merging) {
+        if (!cursor->heads[cursor->shard])
+            return 1;
+        *key = cursor->headKeys[cursor->shard];
+        *value = cursor->headValues[cursor->shard];
+        return 0;
+    }
+    if (cursor->cursors[cursor->shard] == nullptr)
+        return 1;
+    return BtreeCursorReadData(cursor->cursors[cursor->shard], key, value);
+}
+
+// a cursor moved to a missing key may stay after the last entry of a leaf, it is moved to the next entry
+static u1 settleShardCursor(Cursor* shardCursor, u64* key, u64* value) {
+    if (BtreeCursorReadData(shardCursor, key, value) == 0)
+        return 1;
+    return BtreeCursorNextEntry(shardCursor) && BtreeCursorReadData(shardCursor, key, value) == 0;
+}
+
+// range partitioning: moves on to the first entry of the next shard which has one
+static u1 nextRangeShard(ShardedCursor* cursor) {
+    u64 key;
+    u64 value;
+    while (cursor->shard + 1 < cursor->tree->shardsCount) {
+        Cursor* shardCursor = focusShard(cursor, cursor->shard + 1);
+        BtreeCursorFirstLeaf(shardCursor);
+        if (settleShardCursor(shardCursor, &key, &value))
+            return 1;
+    }
+    return 0;
+}
+
+// hash partitioning: the shard with the smallest head becomes the current one
+static u1 pickMergedShard(ShardedCursor* cursor) {
+    u1 found = 0;
+    for (u16 i = 0; i < cursor->tree->shardsCount; ++i) {
+        if (cursor->heads[i] && (!found || cursor->headKeys[i] < cursor->headKeys[cursor->shard])) {
+            cursor->shard = i;
+            found = 1;
+        }
+    }
+    return found;
+}
+
+// hash partitioning: opens cursors on all shards except the current one and puts them at the first entry with a key
+// not below key
+static void startMerge(ShardedCursor* cursor, u64 key) {
+#if BTREE_LOCK_GRANULARITY_EXCLUSIVE
+    if (cursor->write) {
+        fprintf(stderr, "ShardedCursorNextEntry: write cursors can't scan a hash partitioned tree\n");
+        abort();
+    }
+#endif
+    for (u16 i = 0; i < cursor->tree->shardsCount; ++i) {
+        if (i == cursor->shard && cursor->cursors[i] != nullptr)
+            continue;
+        if (cursor->cursors[i] == nullptr)
+            BtreeCreateCursor(cursor->tree->shards[i], &cursor->cursors[i], cursor->write);
+        BtreeCursorMoveTo(cursor->cursors[i], key);
+        cursor->heads[i] = settleShardCursor(cursor->cursors[i], &cursor->headKeys[i], &cursor->headValues[i]);
+    }
+    cursor->merging = 1;
+}
+
+u1 ShardedCursorSeek(ShardedCursor* cursor, u64 key) {
+    u64 _;
+    if (cursor->tree->partitioning == SHARDED_BTREE_RANGE) {
+        ShardedCursorMoveTo(cursor, key);
+        return settleShardCursor(cursor->cursors[cursor->shard], &_, &_) || nextRangeShard(cursor);
+    }
+    ShardedBtreeReleaseCursor(cursor);
+    cursor->key = key;
+    startMerge(cursor, key);
+    return pickMergedShard(cursor);
+}
+
+u1 ShardedCursorNextEntry(ShardedCursor* cursor) {
+    Cursor* shardCursor = cursor->cursors[cursor->shard];
+    if (shardCursor == nullptr)
+        return 0;
+    if (cursor->tree->partitioning == SHARDED_BTREE_RANGE)
+        return BtreeCursorNextEntry(shardCursor) || nextRangeShard(cursor);
+    u16 shard = cursor->shard;
+    if (!cursor->merging) {
+        // other shards may hold keys between the one the cursor was moved to and the entry it is at
+        u64 value;
+        u64 from = cursor->key;
+        BtreeCursorReadData(shardCursor, &from, &value);
+        startMerge(cursor, from);
+    }
+    cursor->heads[shard] = BtreeCursorNextEntry(shardCursor)
+        && BtreeCursorReadData(shardCursor, &cursor->headKeys[shard], &cursor->headValues[shard]) == 0;
+    return pickMergedShard(cursor);
+}
+
+void ShardedBtreeCollectStats(ShardedBtree* tree, BtreeStats* stats) {
+    *stats = {};
+    for (u16 i = 0; i < tree->shardsCount; ++i) {
+        BtreeStats shardStats;
+        BtreeCollectStats(tree->shards[i], &shardStats);
+        stats->leafPages += shardStats.leafPages;
+        stats->innerPages += shardStats.innerPages;
+        stats->entries += shardStats.entries;
+        stats->usedBytes += shardStats.usedBytes;
+        stats->messages += shardStats.messages;
+        stats->depth = std::max(stats->depth, shardStats.depth);
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef SHARDED_BTREE_H
+#define SHARDED_BTREE_H
+
+#include "types.h"
+#include "btree_base.h"
+
+#define SHARDED_BTREE_MAX_SHARDS 64
+
+// shard i holds the keys from bounds[i] up to bounds[i + 1], the bounds split the initial keys into equal parts;
+// scans go through the shards one after another
+#define SHARDED_BTREE_RANGE 0
+// the shard of a key is picked by its hash, so hot key ranges are spread over all shards; scans merge the shards
+#define SHARDED_BTREE_HASH 1
+
+// independent trees over disjoint parts of the keys: writers of different shards never meet on a page, a tree lock
+// or the structure modification lock. Shards share the pager, whose thread page caches keep allocations apart
+struct ShardedBtree {
+    Btree* shards[SHARDED_BTREE_MAX_SHARDS];
+    u64 bounds[SHARDED_BTREE_MAX_SHARDS]; // range partitioning only, smallest key of every shard, bounds[0] is 0
+    u16 shardsCount;
+    u8 partitioning;
+};
+typedef struct ShardedBtree ShardedBtree;
+
+// point operations go to the cursor of the shard of their key, which is the only one open; scans of a range
+// partitioned tree go on to the next shard, scans of a hash partitioned tree open a cursor on every shard and
+// step the one with the smallest key (a key lives in a single shard, so the order is total)
+struct ShardedCursor {
+    ShardedBtree* tree;
+    Cursor* cursors[SHARDED_BTREE_MAX_SHARDS]; // nullptr for shards without an open cursor
+    u1 write;
+    u16 shard; // shard of the current entry
+    u64 key; // key of the last ShardedCursorMoveTo or ShardedCursorSeek
+    // hash partitioning: a scan is running, heads are the entries every shard cursor is at
+    u1 merging;
+    u1 heads[SHARDED_BTREE_MAX_SHARDS]; // 0 for shards scanned past their last entry
+    u64 headKeys[SHARDED_BTREE_MAX_SHARDS];
+    u64 headValues[SHARDED_BTREE_MAX_SHARDS];
+};
+typedef struct ShardedCursor ShardedCursor;
+
+// keys have to be sorted as for BtreeCreateTree, every shard is bulk loaded from its part of them with the rest of
+// the arguments. Shards store their roots in the pager as any tree, so BtreeOpenTree can't open them again
+ShardedBtree* ShardedBtreeCreate(u64* keys, u64* values, u64 size, u16 shardsCount, u8 partitioning,
+                                 u8 pageFormat = PAGER_PAGE_FORMAT_CELLS, u8 fillFactor = 100, u16 threadsCount = 1,
+                                 u1 buffered = 0);
+void ShardedBtreeDestroy(ShardedBtree* tree);
+u16 ShardedBtreeShardOf(const ShardedBtree* tree, u64 key);
+// shard cursors are opened by the operations; under exclusive locking a write cursor holds the lock of one shard at
+// a time, so it can't scan a hash partitioned tree
+void ShardedBtreeInitCursor(ShardedBtree* tree, ShardedCursor* cursor, u1 write);
+void ShardedBtreeReleaseCursor(ShardedCursor* cursor);
+// closes the shard cursors and changes the mode, the cursor loses its position
+void ShardedBtreeRebindCursor(ShardedCursor* cursor, u1 write);
+u8 ShardedCursorMoveTo(ShardedCursor* cursor, u64 key);
+// moves the cursor to the key first if it lives in another shard than the current entry
+void ShardedCursorInsertEntry(ShardedCursor* cursor, u64 key, u64 value);
+// removes the current entry, a scan ends there: the cursor stays in the shard of the entry
+u1 ShardedCursorRemoveEntry(ShardedCursor* cursor);
+u1 ShardedCursorReadData(const ShardedCursor* cursor, u64* key, u64* value);
+// starts a scan at the first entry with a key not below key, returns 0 if there is none
+u1 ShardedCursorSeek(ShardedCursor* cursor, u64 key);
+// forward only, in the order of keys over all shards
+u1 ShardedCursorNextEntry(ShardedCursor* cursor);
+// sums of the shards, depth is the one of the deepest shard
+void ShardedBtreeCollectStats(ShardedBtree* tree, BtreeStats* stats);
+
+#endif //SHARDED_BTREE_H
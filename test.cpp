@@ -1,7 +1,12 @@
 #include <stdio.h>
 #include "btree_base.h"
 #include "pager.h"
+#include "wal.h"
 #include <iostream>
+#include <map>
+#include <random>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -67,7 +72,7 @@ void test_insert() {
 
     for (int i = 0; i < dataSize; ++i) {
         BtreeCursorMoveTo(cursor, keys[i] + 1);
-        BtreeCursorInsertEntry(cursor, keys[i] + 1, values[i]);
+        BtreeCursorInsertEntry(tree, cursor, keys[i] + 1, values[i]);
         // printf("inserted %llu\n", keys[i] + 1);
         // BtreePrint(root);
         // printf("\n");
@@ -127,8 +132,309 @@ void test_next_entry() {
 
 }
 
+void test_prev_entry() {
+    pagerInit(20000);
+    const u64 dataSize = 1001;
+    u64* keys = new u64[dataSize];
+    u64* values = new u64[dataSize];
+    for (u64 i = 0; i < dataSize; i++) {
+        keys[i] = i + 1;
+        values[i] = i + 1 + (i % 3);
+    }
+
+    Btree *tree = BtreeCreateTree(keys, values, dataSize);
+
+    Cursor* cursor;
+    BtreeCreateCursor(tree, &cursor, 0);
+    u64 key, value;
+    // past the last entry, first step back lands on the max key
+    BtreeCursorMoveTo(cursor, keys[dataSize - 1] + 1);
+    for (u64 i = dataSize; i > 0; i--) {
+        BtreeCursorPrevEntry(cursor);
+        BtreeCursorReadData(cursor, &key, &value);
+        if (key != keys[i - 1]) {
+            printf("MISMATCH expected: %llu actual: %llu\n", keys[i - 1], key);
+            break;
+        }
+    }
+    if (BtreeCursorPrevEntry(cursor))
+        printf("MISMATCH entry before the first one\n");
+    BtreeDestroyCursor(tree, cursor);
+}
+
+// separators at the right edge grow in place with every wider key appended; the root is nearly full and keeps
+// free cells of the separators removed by merges, so the grown separator is placed after a vacuum of the root
+void test_grow_cells() {
+    for (u64 dataSize = 178018; dataSize < 179500; dataSize += 53) {
+        pagerInit(1 << 16);
+        u64* keys = new u64[dataSize];
+        u64* values = new u64[dataSize];
+        for (u64 i = 0; i < dataSize; i++) {
+            keys[i] = i + 1;
+            values[i] = i;
+        }
+
+        Btree* tree = BtreeCreateTree(keys, values, dataSize);
+
+        Cursor* cursor;
+        BtreeCreateCursor(tree, &cursor, 1);
+        const u64 removedCount = 3000;
+        for (u64 i = dataSize / 4; i < dataSize / 4 + removedCount; i++) {
+            BtreeCursorMoveTo(cursor, keys[i]);
+            BtreeCursorRemoveEntry(cursor);
+        }
+        for (u8 width = 3; width <= 8; width++) {
+            u64 key = 1ull << (8 * width - 1);
+            BtreeCursorMoveTo(cursor, key);
+            BtreeCursorInsertEntry(tree, cursor, key, width);
+        }
+        u64 key, value;
+        for (u8 width = 3; width <= 8; width++) {
+            u64 expectedKey = 1ull << (8 * width - 1);
+            BtreeCursorMoveTo(cursor, expectedKey);
+            BtreeCursorReadData(cursor, &key, &value);
+            if (key != expectedKey || value != width)
+                printf("MISMATCH size %llu: expected %llu actual: %llu\n", dataSize, expectedKey, key);
+        }
+        BtreeDestroyCursor(tree, cursor);
+
+        u64 expectedCount = dataSize - removedCount + 6;
+        u64 count = BtreeCountRange(tree, 0, ~0ull);
+        if (count != expectedCount)
+            printf("MISMATCH size %llu: expected %llu entries, counted %llu\n", dataSize, expectedCount, count);
+        delete[] keys;
+        delete[] values;
+    }
+}
+
+// scans the tree, its entries and BtreeCountRange have to match the map
+void check_entries(Btree* tree, const map<u64, u64>& expected, const char* stage) {
+    Cursor* cursor;
+    BtreeCreateCursor(tree, &cursor, 0);
+    BtreeCursorFirstLeaf(cursor);
+    auto entry = expected.begin();
+    u64 scanned = 0;
+    do {
+        u64 key, value;
+        // leaves emptied by removes have no entry to read
+        if (BtreeCursorReadData(cursor, &key, &value) != 0)
+            continue;
+        if (entry == expected.end() || key != entry->first || value != entry->second) {
+            printf("MISMATCH %s: entry %llu is %llu %llu\n", stage, scanned, key, value);
+            break;
+        }
+        ++entry;
+        ++scanned;
+    } while (BtreeCursorNextEntry(cursor));
+    BtreeDestroyCursor(tree, cursor);
+    if (scanned != expected.size())
+        printf("MISMATCH %s: expected %zu entries, scanned %llu\n", stage, expected.size(), scanned);
+    u64 counted = BtreeCountRange(tree, 0, ~0ull);
+    if (counted != expected.size())
+        printf("MISMATCH %s: expected %zu entries, counted %llu\n", stage, expected.size(), counted);
+}
+
+// deletes [lo, hi] from the tree and the map, no cursor of the tree may be open
+void check_delete_range(Btree* tree, map<u64, u64>& expected, u64 lo, u64 hi, const char* stage) {
+    auto from = expected.lower_bound(lo);
+    auto to = expected.upper_bound(hi);
+    u64 expectedRemoved = distance(from, to);
+    expected.erase(from, to);
+    u64 removed = BtreeDeleteRange(tree, lo, hi);
+    if (removed != expectedRemoved)
+        printf("MISMATCH %s: expected %llu removed entries, actual: %llu\n", stage, expectedRemoved, removed);
+    check_entries(tree, expected, stage);
+}
+
+// random inserts and removes with occasional wide keys, range deletes and then removes of most entries;
+// the tree (write buffered or not) has to hold the same entries as the map after every stage
+void test_random_updates(u1 buffered) {
+    pagerInit(1 << 20);
+    const u64 dataSize = 200000;
+    u64* keys = new u64[dataSize];
+    u64* values = new u64[dataSize];
+    map<u64, u64> expected;
+    for (u64 i = 0; i < dataSize; i++) {
+        keys[i] = (i + 1) * 4;
+        values[i] = i;
+        expected[keys[i]] = values[i];
+    }
+
+    Btree* tree = BtreeCreateTree(keys, values, dataSize, PAGER_PAGE_FORMAT_CELLS, 100, 1, buffered);
+
+    mt19937_64 rng(1832923);
+    Cursor* cursor;
+    BtreeCreateCursor(tree, &cursor, 1);
+    for (u64 i = 0; i < dataSize; i++) {
+        u64 key = rng() % (dataSize * 8);
+        if (rng() % 16 == 0)
+            key |= rng() % (1ull << 56);
+        if (rng() % 2 == 0) {
+            if (expected.count(key) > 0)
+                continue;
+            BtreeCursorMoveTo(cursor, key);
+            BtreeCursorInsertEntry(tree, cursor, key, i);
+            expected[key] = i;
+        } else {
+            auto entry = expected.lower_bound(key);
+            if (entry == expected.end())
+                continue;
+            BtreeCursorMoveTo(cursor, entry->first);
+            BtreeCursorRemoveEntry(cursor);
+            expected.erase(entry);
+        }
+    }
+    BtreeDestroyCursor(tree, cursor);
+
+    // whole leaves and inner pages inside the range go at once
+    check_delete_range(tree, expected, dataSize * 2, dataSize * 5, "mid-tree range delete");
+    // a few neighbouring entries of a single leaf
+    auto first = expected.lower_bound(dataSize * 6);
+    auto last = first;
+    advance(last, 5);
+    check_delete_range(tree, expected, first->first, last->first, "single leaf range delete");
+
+    BtreeCreateCursor(tree, &cursor, 1);
+    // most entries go, so pages merge while their messages are flushed
+    while (expected.size() > dataSize / 10) {
+        auto entry = expected.lower_bound(rng() % (dataSize * 8));
+        if (entry == expected.end())
+            continue;
+        BtreeCursorMoveTo(cursor, entry->first);
+        BtreeCursorRemoveEntry(cursor);
+        expected.erase(entry);
+    }
+    BtreeDestroyCursor(tree, cursor);
+    BtreeFlushMessages(tree);
+    check_entries(tree, expected, "random updates");
+
+    // the emptied root starts over as a single leaf
+    check_delete_range(tree, expected, 0, ~0ull, "whole tree range delete");
+    BtreeCreateCursor(tree, &cursor, 1);
+    for (u64 i = 0; i < dataSize / 10; i++) {
+        u64 key = (i + 1) * 8;
+        BtreeCursorMoveTo(cursor, key);
+        BtreeCursorInsertEntry(tree, cursor, key, i);
+        expected[key] = i;
+    }
+    BtreeDestroyCursor(tree, cursor);
+    BtreeFlushMessages(tree);
+    check_entries(tree, expected, "inserts after whole tree range delete");
+    delete[] keys;
+    delete[] values;
+}
+
+// changes logged after a checkpoint are replayed onto the tree loaded from it; a torn record at the end of the log
+// is skipped by replay and cut off by walOpen
+void test_wal_replay() {
+    const char* logPath = "test_wal.log";
+    const char* checkpointPath = "test_wal.checkpoint";
+    unlink(logPath);
+    unlink(checkpointPath);
+
+    pagerInit(1 << 20);
+    const u64 dataSize = 20000;
+    u64* keys = new u64[dataSize];
+    u64* values = new u64[dataSize];
+    map<u64, u64> expected;
+    for (u64 i = 0; i < dataSize; i++) {
+        keys[i] = (i + 1) * 4;
+        values[i] = i;
+        expected[keys[i]] = values[i];
+    }
+    Btree* tree = BtreeCreateTree(keys, values, dataSize);
+    delete[] keys;
+    delete[] values;
+
+    walOpen(logPath);
+    walCheckpoint(tree, checkpointPath);
+    mt19937_64 rng(1832923);
+    Cursor* cursor;
+    BtreeCreateCursor(tree, &cursor, 1);
+    for (u64 i = 0; i < dataSize; i++) {
+        u64 key = rng() % (dataSize * 8);
+        if (rng() % 2 == 0) {
+            if (expected.count(key) > 0)
+                continue;
+            BtreeCursorMoveTo(cursor, key);
+            BtreeCursorInsertEntry(tree, cursor, key, i);
+            expected[key] = i;
+        } else {
+            auto entry = expected.lower_bound(key);
+            if (entry == expected.end())
+                continue;
+            BtreeCursorMoveTo(cursor, entry->first);
+            BtreeCursorRemoveEntry(cursor);
+            expected.erase(entry);
+        }
+    }
+    BtreeDestroyCursor(tree, cursor);
+
+    // every other key of the batch is already in the tree (unless it was removed), upserts replace its value
+    const u64 batchSize = 1000;
+    u64 batchKeys[batchSize];
+    u64 batchValues[batchSize];
+    for (u64 i = 0; i < batchSize; i++) {
+        batchKeys[i] = dataSize + i * 2;
+        batchValues[i] = dataSize * 10 + i;
+        expected[batchKeys[i]] = batchValues[i];
+    }
+    BtreeInsertBatch(tree, batchKeys, batchValues, batchSize, 1);
+    check_delete_range(tree, expected, dataSize * 3, dataSize * 4, "range delete before replay");
+
+    WalStats stats;
+    walGetStats(&stats);
+    walClose();
+
+    u64* checkpointKeys;
+    u64* checkpointValues;
+    u64 checkpointCount;
+    u64 checkpointSequence;
+    if (!walLoadCheckpoint(checkpointPath, &checkpointKeys, &checkpointValues, &checkpointCount, &checkpointSequence)) {
+        printf("MISMATCH checkpoint can't be loaded\n");
+        return;
+    }
+    pagerInit(1 << 20);
+    tree = BtreeCreateTree(checkpointKeys, checkpointValues, checkpointCount);
+    u64 applied = walReplay(logPath, checkpointSequence, tree);
+    if (applied != stats.records)
+        printf("MISMATCH expected %llu replayed records, actual: %llu\n", stats.records, applied);
+    check_entries(tree, expected, "replay");
+
+    // the last record is torn
+    struct stat logStat;
+    stat(logPath, &logStat);
+    if (truncate(logPath, logStat.st_size - 5) != 0) {
+        printf("MISMATCH log can't be truncated\n");
+        return;
+    }
+    pagerInit(1 << 20);
+    tree = BtreeCreateTree(checkpointKeys, checkpointValues, checkpointCount);
+    applied = walReplay(logPath, checkpointSequence, tree);
+    if (applied != stats.records - 1)
+        printf("MISMATCH expected %llu replayed records of a torn log, actual: %llu\n", stats.records - 1, applied);
+    // the header takes the place of one record
+    u64 recordSize = logStat.st_size / (stats.records + 1);
+    walOpen(logPath);
+    walClose();
+    struct stat cutStat;
+    stat(logPath, &cutStat);
+    if ((u64)cutStat.st_size != logStat.st_size - recordSize)
+        printf("MISMATCH expected cut log of %llu bytes, actual: %llu\n", logStat.st_size - recordSize, (u64)cutStat.st_size);
+
+    delete[] checkpointKeys;
+    delete[] checkpointValues;
+    unlink(logPath);
+    unlink(checkpointPath);
+}
+
 int main() {
     //test_insert();
     test_next_entry();
+    test_prev_entry();
+    test_grow_cells();
+    test_random_updates(0);
+    test_random_updates(1);
+    test_wal_replay();
     return 0;
 }
\ No newline at end of file
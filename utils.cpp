@@ -5,6 +5,20 @@
 #include "types.h"
 #include "utils.h"
 
+void array_shift64(u64* array, const u16 start, const u16 end, const i16 direction) {
+    if(direction == 0)
+        return;
+    if(direction < 0) {
+        for(u16 i = start; i < end; ++i) {
+            array[i + direction] = array[i];
+        }
+    } else {
+        for(u16 iOrig = end - 1, iShift = end - 1 + direction; iOrig >= start && iShift >= start + direction; --iOrig, --iShift) {
+            array[iShift] = array[iOrig];
+        }
+    }
+}
+
 void array_shift32(u32* array, const u16 start, const u16 end, const i16 direction) {
     if(direction == 0)
         return;
@@ -47,6 +61,12 @@ void array_shift8(u8* array, const u16 start, const u16 end, const i16 direction
     }
 }
 
+void array_copy64(u64* from, u64* to, const u16 fromStart, const u16 toStart, const u16 amount) {
+    for(u16 i = 0; i < amount; ++i) {
+        to[toStart + i] = from[fromStart + i];
+    }
+}
+
 void array_copy16(u16* from, u16* to, const u16 fromStart, const u16 toStart, const u16 amount) {
     for(u16 i = 0; i < amount; ++i) {
         to[toStart + i] = from[fromStart + i];
@@ -3,11 +3,37 @@
 
 #include "types.h"
 
+#include <cstring>
+
+void array_shift64(u64* array, const u16 start, const u16 end, const i16 direction);
 void array_shift32(u32* array, const u16 start, const u16 end, const i16 direction);
 void array_shift16(u16* array, const u16 start, const u16 end, const i16 direction);
 void array_shift8(u8* array, const u16 start, const u16 end, const i16 direction);
 
+void array_copy64(u64* from, u64* to, const u16 fromStart, const u16 toStart, const u16 amount);
 void array_copy16(u16* from, u16* to, const u16 fromStart, const u16 toStart, const u16 amount);
 void array_copy8(u8* from, u8* to, const u16 fromStart, const u16 toStart, const u16 amount);
 
+// little-endian varints of cell payloads, size is the amount of significant bytes (0 only for zero)
+
+// zero takes zeroWeight bytes, any other value - bytes up to its highest non-zero one
+inline u8 getValueByteSize(u64 value, u8 zeroWeight) {
+    return value == 0 ? zeroWeight : (u8)(8 - (__builtin_clzll(value) >> 3));
+}
+
+// loads a whole word, so 8 bytes from pBegin must be readable (pages keep PAGER_PAGE_READ_PADDING after them)
+inline u64 decode(const u8 size, const u8 *pBegin) {
+    u64 word;
+    memcpy(&word, pBegin, sizeof(word));
+    u64 mask = size == 0 ? 0 : ~0ULL >> (64 - 8 * size);
+    return word & mask;
+}
+
+// writes exactly the significant bytes, neighbouring cells stay untouched
+inline u8 encode(const u64 value, u8 *pBegin) {
+    u8 valueByteSize = getValueByteSize(value, 0);
+    memcpy(pBegin, &value, valueByteSize);
+    return valueByteSize;
+}
+
 #endif //UTILS_H
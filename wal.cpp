@@ -0,0 +1,454 @@
+#include "types.h"
+#include "wal.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#define WAL_FILE_MAGIC 0x31474f4c45455254ULL
+#define WAL_CHECKPOINT_MAGIC 0x31504b4345455254ULL
+// records appended between two writes to the file, a full buffer is written by the appending thread
+#define WAL_BUFFER_RECORDS 4096
+// entries written or read by one checkpoint system call
+#define WAL_CHECKPOINT_CHUNK_ENTRIES 4096
+
+struct WalRecord {
+    u64 sequence;
+    u64 key;
+    u64 value;
+    u32 kind;
+    // covers the other fields, so a torn record at the end of the log isn't taken for a complete one
+    u32 checksum;
+};
+
+// the header takes the place of the first record, records follow it without gaps
+struct WalFileHeader {
+    u64 magic;
+    u64 firstSequence; // sequence number of the first record, previous ones are in the checkpoint
+    u64 recordByteSize;
+    u64 reserved;
+};
+static_assert(sizeof(WalFileHeader) == sizeof(WalRecord), "log header must take exactly one record");
+
+struct WalCheckpointHeader {
+    u64 magic;
+    u64 sequence; // entries include changes of all records up to this one
+    u64 count;
+};
+
+int WalFile = -1;
+u8 WalSyncMode;
+u64 WalFileSize;
+WalRecord* WalBuffer;
+WalRecord* WalSpareBuffer; // written to the file while appends go to WalBuffer
+u32 WalBufferCount;
+u64 NextSequence; // protected by walAppendLock
+u64 WrittenSequence; // protected by walWriteLock
+u64 DurableSequence; // protected by walSyncLock
+u1 WalSyncing; // a group commit sync is in progress
+u1 WalStopping; // the async sync thread has to exit
+pthread_t walSyncThread;
+pthread_mutex_t walAppendLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t walWriteLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t walSyncLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t walSynced = PTHREAD_COND_INITIALIZER;
+pthread_cond_t walStopRequested = PTHREAD_COND_INITIALIZER;
+std::atomic<u64> WalRecords;
+std::atomic<u64> WalSyncs;
+std::atomic<u64> WalBytes;
+
+static u32 recordChecksum(const WalRecord* record) {
+    u64 hash = (record->sequence ^ record->kind) * 0x9e3779b97f4a7c15ULL;
+    hash = (hash ^ (hash >> 31) ^ record->key) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 29) ^ record->value) * 0x94d049bb133111ebULL;
+    return (u32)(hash ^ (hash >> 32));
+}
+
+static void writeFully(int file, const void* data, u64 size, u64 offset, const char* error) {
+    if (pwrite(file, data, size, offset) != (ssize_t)size) {
+        perror(error);
+        abort();
+    }
+}
+
+// moves the buffered records to the file (without syncing it), returns the sequence number of the last written record
+static u64 writeBufferedRecords() {
+    pthread_mutex_lock(&walWriteLock);
+    pthread_mutex_lock(&walAppendLock);
+    WalRecord* records = WalBuffer;
+    u32 count = WalBufferCount;
+    WalBuffer = WalSpareBuffer;
+    WalSpareBuffer = records;
+    WalBufferCount = 0;
+    if (count > 0)
+        WrittenSequence = NextSequence - 1;
+    pthread_mutex_unlock(&walAppendLock);
+
+    if (count > 0) {
+        writeFully(WalFile, records, (u64)count * sizeof(WalRecord), WalFileSize, "wal: record write failed");
+        WalFileSize += (u64)count * sizeof(WalRecord);
+        WalBytes += (u64)count * sizeof(WalRecord);
+    }
+    u64 written = WrittenSequence;
+    pthread_mutex_unlock(&walWriteLock);
+    return written;
+}
+
+static void syncFile(u64 writtenSequence) {
+    if (fdatasync(WalFile) != 0) {
+        perror("wal: sync failed");
+        abort();
+    }
+    ++WalSyncs;
+    pthread_mutex_lock(&walSyncLock);
+    if (writtenSequence > DurableSequence)
+        DurableSequence = writtenSequence;
+    pthread_cond_broadcast(&walSynced);
+    pthread_mutex_unlock(&walSyncLock);
+}
+
+static void* asyncSyncLoop(void*) {
+    pthread_mutex_lock(&walSyncLock);
+    while (!WalStopping) {
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += WAL_ASYNC_SYNC_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&walStopRequested, &walSyncLock, &deadline);
+        if (WalStopping)
+            break;
+        pthread_mutex_unlock(&walSyncLock);
+        syncFile(writeBufferedRecords());
+        pthread_mutex_lock(&walSyncLock);
+    }
+    pthread_mutex_unlock(&walSyncLock);
+    return nullptr;
+}
+
+static u1 readFileHeader(int file, WalFileHeader* header) {
+    return pread(file, header, sizeof(*header), 0) == sizeof(*header)
+        && header->magic == WAL_FILE_MAGIC && header->recordByteSize == sizeof(WalRecord);
+}
+
+// removes an entry with the key and the value; cursors don't keep their place among entries of the same key when
+// they move to another leaf (see restoreCursorPath), so entries of the key with other values are taken out
+// until it's found and then inserted back
+static void removeEntry(Btree* tree, Cursor* cursor, u64 key, u64 value) {
+    std::vector<u64> otherValues;
+    while (1) {
+        u64 entryKey;
+        u64 entryValue;
+        BtreeCursorMoveTo(cursor, key);
+        if (BtreeCursorReadData(cursor, &entryKey, &entryValue) != 0 || entryKey != key)
+            break;
+        BtreeCursorRemoveEntry(cursor);
+        if (entryValue == value)
+            break;
+        otherValues.push_back(entryValue);
+    }
+    for (u64 otherValue : otherValues) {
+        BtreeCursorMoveTo(cursor, key);
+        BtreeCursorInsertEntry(tree, cursor, key, otherValue);
+    }
+}
+
+// changes the tree as the record says, with a write cursor of the tree
+static void applyRecord(Btree* tree, Cursor* cursor, const WalRecord* record) {
+    if (record->kind == WAL_RECORD_INSERT) {
+        BtreeCursorMoveTo(cursor, record->key);
+        BtreeCursorInsertEntry(tree, cursor, record->key, record->value);
+    } else if (!tree->buffered) {
+        removeEntry(tree, cursor, record->key, record->value);
+    } else {
+        // leaves don't show pending messages, buffered trees remove whichever entry the key has
+        u64 key;
+        u64 _;
+        BtreeCursorMoveTo(cursor, record->key);
+        if (BtreeCursorReadData(cursor, &key, &_) == 0 && key == record->key)
+            BtreeCursorRemoveEntry(cursor);
+    }
+}
+
+// reads records in order until the end of the file or the first torn one, those after fromSequence are applied
+// to the tree (if there is one); returns the amount of valid records
+static u64 readRecords(int file, const WalFileHeader* header, u64 fromSequence, Btree* tree, u64* applied) {
+    WalRecord* records = new WalRecord[WAL_BUFFER_RECORDS];
+    Cursor* cursor = nullptr;
+    if (tree != nullptr)
+        BtreeCreateCursor(tree, &cursor, 1);
+    u64 valid = 0;
+    *applied = 0;
+    u1 torn = 0;
+    while (!torn) {
+        ssize_t bytes = pread(file, records, WAL_BUFFER_RECORDS * sizeof(WalRecord),
+                              sizeof(WalFileHeader) + valid * sizeof(WalRecord));
+        u32 count = bytes > 0 ? bytes / sizeof(WalRecord) : 0;
+        torn = count < WAL_BUFFER_RECORDS;
+        for (u32 i = 0; i < count; ++i) {
+            const WalRecord* record = records + i;
+            if (record->sequence != header->firstSequence + valid || record->checksum != recordChecksum(record)
+                || (record->kind != WAL_RECORD_INSERT && record->kind != WAL_RECORD_REMOVE)) {
+                torn = 1;
+                break;
+            }
+            ++valid;
+            if (cursor != nullptr && record->sequence > fromSequence) {
+                applyRecord(tree, cursor, record);
+                ++*applied;
+            }
+        }
+    }
+    if (cursor != nullptr)
+        BtreeDestroyCursor(tree, cursor);
+    delete [] records;
+    return valid;
+}
+
+u1 walOpen(const char* path, u8 syncMode) {
+    if (WalFile >= 0)
+        walClose();
+    int file = open(path, O_RDWR | O_CREAT, 0644);
+    if (file < 0)
+        return 0;
+
+    struct stat fileStat;
+    fstat(file, &fileStat);
+    WalFileHeader header = {};
+    if (fileStat.st_size == 0) {
+        header.magic = WAL_FILE_MAGIC;
+        header.firstSequence = 1;
+        header.recordByteSize = sizeof(WalRecord);
+        writeFully(file, &header, sizeof(header), 0, "wal: header write failed");
+    } else if (!readFileHeader(file, &header)) {
+        close(file);
+        return 0;
+    }
+    // records after the last valid one were being written during a crash, none of them was committed
+    u64 _;
+    u64 valid = readRecords(file, &header, 0, nullptr, &_);
+    WalFileSize = sizeof(WalFileHeader) + valid * sizeof(WalRecord);
+    if (ftruncate(file, WalFileSize) != 0 || fdatasync(file) != 0) {
+        perror("wal: can't cut the log tail");
+        abort();
+    }
+
+    WalFile = file;
+    WalSyncMode = syncMode;
+    NextSequence = header.firstSequence + valid;
+    WrittenSequence = DurableSequence = NextSequence - 1;
+    WalBuffer = new WalRecord[WAL_BUFFER_RECORDS];
+    WalSpareBuffer = new WalRecord[WAL_BUFFER_RECORDS];
+    WalBufferCount = 0;
+    WalSyncing = 0;
+    WalStopping = 0;
+    WalRecords = WalSyncs = WalBytes = 0;
+    if (syncMode == WAL_SYNC_ASYNC)
+        pthread_create(&walSyncThread, nullptr, asyncSyncLoop, nullptr);
+    return 1;
+}
+
+void walClose() {
+    if (WalFile < 0)
+        return;
+    if (WalSyncMode == WAL_SYNC_ASYNC) {
+        pthread_mutex_lock(&walSyncLock);
+        WalStopping = 1;
+        pthread_cond_signal(&walStopRequested);
+        pthread_mutex_unlock(&walSyncLock);
+        pthread_join(walSyncThread, nullptr);
+    }
+    walSync();
+    close(WalFile);
+    WalFile = -1;
+    delete [] WalBuffer;
+    delete [] WalSpareBuffer;
+}
+
+u1 walIsOpen() {
+    return WalFile >= 0;
+}
+
+u8 walGetSyncMode() {
+    return WalSyncMode;
+}
+
+void walGetStats(WalStats* stats) {
+    stats->records = WalRecords;
+    stats->syncs = WalSyncs;
+    stats->bytes = WalBytes;
+    pthread_mutex_lock(&walSyncLock);
+    stats->durableSequence = DurableSequence;
+    pthread_mutex_unlock(&walSyncLock);
+}
+
+u64 walAppend(u8 kind, u64 key, u64 value) {
+    while (1) {
+        pthread_mutex_lock(&walAppendLock);
+        if (WalBufferCount < WAL_BUFFER_RECORDS)
+            break;
+        pthread_mutex_unlock(&walAppendLock);
+        // buffer is full, its records go to the file to make room; they become durable with the next sync
+        writeBufferedRecords();
+    }
+    WalRecord* record = WalBuffer + WalBufferCount++;
+    u64 sequence = NextSequence++;
+    record->sequence = sequence;
+    record->key = key;
+    record->value = value;
+    record->kind = kind;
+    record->checksum = recordChecksum(record);
+    pthread_mutex_unlock(&walAppendLock);
+    ++WalRecords;
+    return sequence;
+}
+
+void walCommit(u64 sequence) {
+    if (sequence == 0 || WalSyncMode == WAL_SYNC_ASYNC)
+        return;
+    if (WalSyncMode == WAL_SYNC_EVERY_COMMIT) {
+        syncFile(writeBufferedRecords());
+        return;
+    }
+    // the first waiting thread syncs records of all threads waiting behind it, they are woken up together
+    pthread_mutex_lock(&walSyncLock);
+    while (DurableSequence < sequence) {
+        if (WalSyncing) {
+            pthread_cond_wait(&walSynced, &walSyncLock);
+            continue;
+        }
+        WalSyncing = 1;
+        pthread_mutex_unlock(&walSyncLock);
+        u64 written = writeBufferedRecords();
+        syncFile(written);
+        pthread_mutex_lock(&walSyncLock);
+        WalSyncing = 0;
+        pthread_cond_broadcast(&walSynced);
+    }
+    pthread_mutex_unlock(&walSyncLock);
+}
+
+void walSync() {
+    if (WalFile >= 0)
+        syncFile(writeBufferedRecords());
+}
+
+u1 walCheckpoint(Btree* tree, const char* path) {
+    if (WalFile < 0)
+        return 0;
+    // messages of a buffered tree are logged as well, the checkpoint takes the entries they result in
+    BtreeFlushMessages(tree);
+    // nothing writes to the tree, so changes of all appended records are in its entries
+    pthread_mutex_lock(&walAppendLock);
+    u64 sequence = NextSequence - 1;
+    pthread_mutex_unlock(&walAppendLock);
+
+    char temporaryPath[4096];
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp", path);
+    int file = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file < 0)
+        return 0;
+
+    WalCheckpointHeader header = {WAL_CHECKPOINT_MAGIC, sequence, 0};
+    u64* chunk = new u64[WAL_CHECKPOINT_CHUNK_ENTRIES * 2];
+    u64 chunkCount = 0;
+    Cursor* cursor;
+    BtreeCreateCursor(tree, &cursor, 0);
+    BtreeCursorFirstLeaf(cursor);
+    do {
+        // leaves emptied by removes have no entry to read
+        if (BtreeCursorReadData(cursor, chunk + chunkCount * 2, chunk + chunkCount * 2 + 1) != 0)
+            continue;
+        if (++chunkCount == WAL_CHECKPOINT_CHUNK_ENTRIES) {
+            writeFully(file, chunk, chunkCount * 2 * sizeof(u64), sizeof(header) + header.count * 2 * sizeof(u64),
+                       "wal: checkpoint write failed");
+            header.count += chunkCount;
+            chunkCount = 0;
+        }
+    } while (BtreeCursorNextEntry(cursor));
+    BtreeDestroyCursor(tree, cursor);
+    writeFully(file, chunk, chunkCount * 2 * sizeof(u64), sizeof(header) + header.count * 2 * sizeof(u64),
+               "wal: checkpoint write failed");
+    header.count += chunkCount;
+    delete [] chunk;
+    writeFully(file, &header, sizeof(header), 0, "wal: checkpoint write failed");
+    if (fdatasync(file) != 0 || close(file) != 0 || rename(temporaryPath, path) != 0) {
+        perror("wal: checkpoint failed");
+        abort();
+    }
+
+    // records up to the checkpoint aren't needed anymore, a crash before the log is emptied only makes replay
+    // skip them; the buffered ones are dropped as well
+    pthread_mutex_lock(&walWriteLock);
+    pthread_mutex_lock(&walAppendLock);
+    WalBufferCount = 0;
+    WalFileHeader fileHeader = {WAL_FILE_MAGIC, sequence + 1, sizeof(WalRecord), 0};
+    writeFully(WalFile, &fileHeader, sizeof(fileHeader), 0, "wal: header write failed");
+    WalFileSize = sizeof(WalFileHeader);
+    if (ftruncate(WalFile, WalFileSize) != 0) {
+        perror("wal: can't empty the log");
+        abort();
+    }
+    WrittenSequence = sequence;
+    pthread_mutex_unlock(&walAppendLock);
+    pthread_mutex_unlock(&walWriteLock);
+    syncFile(sequence);
+    return 1;
+}
+
+u1 walLoadCheckpoint(const char* path, u64** keys, u64** values, u64* count, u64* sequence) {
+    int file = open(path, O_RDONLY);
+    if (file < 0)
+        return 0;
+    WalCheckpointHeader header;
+    struct stat fileStat;
+    fstat(file, &fileStat);
+    if (pread(file, &header, sizeof(header), 0) != sizeof(header) || header.magic != WAL_CHECKPOINT_MAGIC
+        || (u64)fileStat.st_size != sizeof(header) + header.count * 2 * sizeof(u64)) {
+        close(file);
+        return 0;
+    }
+    *keys = new u64[header.count];
+    *values = new u64[header.count];
+    u64* chunk = new u64[WAL_CHECKPOINT_CHUNK_ENTRIES * 2];
+    for (u64 from = 0; from < header.count; from += WAL_CHECKPOINT_CHUNK_ENTRIES) {
+        u64 chunkCount = header.count - from < WAL_CHECKPOINT_CHUNK_ENTRIES ? header.count - from : WAL_CHECKPOINT_CHUNK_ENTRIES;
+        if (pread(file, chunk, chunkCount * 2 * sizeof(u64), sizeof(header) + from * 2 * sizeof(u64))
+            != (ssize_t)(chunkCount * 2 * sizeof(u64))) {
+            perror("wal: checkpoint read failed");
+            abort();
+        }
+        for (u64 i = 0; i < chunkCount; ++i) {
+            (*keys)[from + i] = chunk[i * 2];
+            (*values)[from + i] = chunk[i * 2 + 1];
+        }
+    }
+    delete [] chunk;
+    close(file);
+    *count = header.count;
+    *sequence = header.sequence;
+    return 1;
+}
+
+u64 walReplay(const char* path, u64 fromSequence, Btree* tree) {
+    if (WalFile >= 0) {
+        fprintf(stderr, "wal: replay with the log open would log the replayed changes again\n");
+        abort();
+    }
+    int file = open(path, O_RDONLY);
+    if (file < 0)
+        return 0;
+    WalFileHeader header;
+    u64 applied = 0;
+    if (readFileHeader(file, &header))
+        readRecords(file, &header, fromSequence, tree, &applied);
+    close(file);
+    return applied;
+}
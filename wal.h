@@ -0,0 +1,58 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include "types.h"
+#include "btree_base.h"
+
+// every commit writes the buffered records and syncs the file by itself
+#define WAL_SYNC_EVERY_COMMIT 0
+// commits waiting together are made durable by a single sync of the thread which came first
+#define WAL_SYNC_GROUP 1
+// commits return at once, a background thread syncs the file every WAL_ASYNC_SYNC_INTERVAL_MS
+#define WAL_SYNC_ASYNC 2
+
+#define WAL_ASYNC_SYNC_INTERVAL_MS 10
+
+// logical records, replayed through cursors of the tree; removes carry the value of the removed entry,
+// which tells it from other entries with the same key
+#define WAL_RECORD_INSERT 1
+#define WAL_RECORD_REMOVE 2
+
+struct WalStats {
+    u64 records;
+    u64 syncs; // fdatasync calls of commits and of the async thread
+    u64 bytes; // record bytes written to the file
+    u64 durableSequence; // sequence number of the last record known to be on disk
+};
+typedef struct WalStats WalStats;
+
+// opens (or creates) the log, a torn tail left by a crash is cut off; while the log is open inserts and removes
+// of all trees are logged. Returns 0 if the file can't be opened or isn't a log file
+u1 walOpen(const char* path, u8 syncMode = WAL_SYNC_GROUP);
+// makes all records durable and closes the file
+void walClose();
+u1 walIsOpen();
+u8 walGetSyncMode();
+void walGetStats(WalStats* stats);
+
+// appends the record to the in-memory buffer and returns its sequence number; writers call it while the changed
+// entry is still locked, so records of a key follow the order of its changes
+u64 walAppend(u8 kind, u64 key, u64 value);
+// waits (depending on the sync mode) until the record with the sequence number is durable, 0 returns at once;
+// must be called after the locks of the change are released
+void walCommit(u64 sequence);
+// makes all appended records durable in any sync mode
+void walSync();
+
+// writes all entries of the tree and the sequence number they include to path (through a temporary file
+// renamed over it), then empties the log; the log must be open and nothing may write to the tree meanwhile
+u1 walCheckpoint(Btree* tree, const char* path);
+// reads a checkpoint into new arrays for BtreeCreateTree, returns 0 if there is no valid checkpoint at path
+u1 walLoadCheckpoint(const char* path, u64** keys, u64** values, u64* count, u64* sequence);
+// applies records with sequence numbers after fromSequence to the tree, until the end of the log or the first
+// torn record; must run before walOpen, so the changes aren't logged again. Returns the amount of applied records.
+// Buffered trees remove by key only, with duplicate keys they may keep other values of a key after replay
+// than before it
+u64 walReplay(const char* path, u64 fromSequence, Btree* tree);
+
+#endif //WAL_H